@@ -0,0 +1,90 @@
+-- Runs one benchmark case and prints its result as a JSON object:
+-- lua bench/case.lua <grammar> <shape> <bytes> [min_time]
+local corpus = require("bench.corpus")
+
+local grammar, shape, size, min_time = arg[1], arg[2], tonumber(arg[3]), tonumber(arg[4] or "1")
+
+local parsers = {
+  json = function()
+    local json = require("example.json")
+    return function(s)
+      return json.parse_json(s) ~= nil
+    end
+  end,
+  xml = function()
+    local ok, element = dofile("example/simple_xml.lua")
+    assert(ok, "example/simple_xml.lua failed its own checks")
+    return function(s)
+      local out, rest = element:parse(s)
+      return out ~= nil and rest == ""
+    end
+  end,
+  log = function()
+    local log = require("bench.log")
+    return function(s)
+      return log.parse_log(s) ~= nil
+    end
+  end,
+}
+
+local parse = assert(parsers[grammar], "unknown grammar " .. tostring(grammar))()
+local input = corpus[grammar](shape, size)
+local bytes = #input
+
+-- small inputs get a warm-up run, large ones are their own
+if bytes <= 1024 * 1024 then
+  parse(input)
+end
+
+local times = {}
+local total = 0
+repeat
+  collectgarbage("collect")
+  local start = os.clock()
+  local ok = parse(input)
+  local t = os.clock() - start
+  if not ok then
+    io.stderr:write(string.format("%s/%s: the corpus did not parse\n", grammar, shape))
+    os.exit(1)
+  end
+  times[#times + 1] = t
+  total = total + t
+until (total >= min_time and #times >= 3) or t >= min_time or #times >= 1000
+
+table.sort(times)
+local median = times[(#times + 1) // 2]
+
+-- bytes the Lua allocator handed out during one parse, with the collector
+-- held off. Skipped where that would not fit in memory
+local alloc = "null"
+if bytes <= 16 * 1024 * 1024 then
+  collectgarbage("collect")
+  collectgarbage("stop")
+  local before = collectgarbage("count")
+  parse(input)
+  alloc = string.format("%d", math.floor((collectgarbage("count") - before) * 1024))
+  collectgarbage("restart")
+  collectgarbage("collect")
+end
+
+local peak = "null"
+local status = io.open("/proc/self/status")
+if status then
+  for line in status:lines() do
+    local kb = line:match("^VmHWM:%s*(%d+)")
+    if kb then
+      peak = string.format("%d", tonumber(kb) * 1024)
+    end
+  end
+  status:close()
+end
+
+local function mbs(t)
+  return t > 0 and string.format("%.3f", bytes / t / 1e6) or "null"
+end
+
+print(string.format(
+  '{"grammar": "%s", "shape": "%s", "bytes": %d, "runs": %d, ' ..
+  '"median_s": %.6f, "best_s": %.6f, "median_mb_s": %s, "best_mb_s": %s, ' ..
+  '"lua_alloc_bytes": %s, "peak_rss_bytes": %s}',
+  grammar, shape, bytes, #times, median, times[1], mbs(median), mbs(times[1]), alloc, peak))
@@ -0,0 +1,93 @@
+-- Deterministic inputs for the benchmarks. Every generator repeats a unit
+-- until the requested size is reached, so results are comparable across
+-- runs and commits.
+local M = {}
+
+-- a small LCG, math.random differs between Lua builds
+local function rng(seed)
+  local state = seed
+  return function(n)
+    state = (state * 1103515245 + 12345) % 2147483648
+    return state % n
+  end
+end
+
+local words = { "alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta", "theta" }
+
+-- joins units from unit(i) with sep until about size bytes
+local function fill(size, open, close, sep, unit)
+  local parts = { open }
+  local len = #open + #close
+  local i = 0
+  while len < size do
+    i = i + 1
+    local u = unit(i)
+    if i > 1 then
+      parts[#parts + 1] = sep
+      len = len + #sep
+    end
+    parts[#parts + 1] = u
+    len = len + #u
+  end
+  parts[#parts + 1] = close
+  return table.concat(parts)
+end
+
+local DEPTH = 32
+
+function M.json(shape, size)
+  local r = rng(1)
+  if shape == "shallow" then
+    return fill(size, "[", "]", ",", function(i)
+      return string.format('{"id": %d, "name": "%s", "active": %s, "score": %d.%d}',
+        i, words[r(#words) + 1], r(2) == 0 and "true" or "false", r(1000), r(100))
+    end)
+  end
+
+  return fill(size, "[", "]", ",", function(i)
+    local open, close = {}, {}
+    for d = 1, DEPTH do
+      open[d] = d % 2 == 1 and '{"k": [' or "["
+      close[DEPTH - d + 1] = d % 2 == 1 and "]}" or "]"
+    end
+    return table.concat(open) .. i .. table.concat(close)
+  end)
+end
+
+function M.xml(shape, size)
+  local r = rng(2)
+  if shape == "shallow" then
+    return fill(size, "<root>\n", "\n</root>\n", "\n", function(i)
+      return string.format('  <item id="%d" name="%s"/>', i, words[r(#words) + 1])
+    end)
+  end
+
+  return fill(size, "<root>\n", "\n</root>\n", "\n", function(i)
+    local open, close = {}, {}
+    for d = 1, DEPTH do
+      open[d] = string.format('<n d="%d">', d)
+      close[d] = "</n>"
+    end
+    return table.concat(open) .. string.format('<leaf id="%d"/>', i) .. table.concat(close)
+  end)
+end
+
+local levels = { "DEBUG", "INFO", "INFO", "INFO", "WARN", "ERROR" }
+
+function M.log(_, size)
+  local r = rng(3)
+  return fill(size, "", "\n", "\n", function(i)
+    return string.format("2024-05-01T12:%02d:%02dZ %s [worker-%d] id=%d path=/api/%s ms=%d",
+      (i // 60) % 60, i % 60, levels[r(#levels) + 1], r(16), i, words[r(#words) + 1], r(500))
+  end)
+end
+
+-- "64K", "1M" or a plain byte count
+function M.parse_size(s)
+  local n, unit = s:match("^(%d+)([KMG]?)$")
+  assert(n, "bad size " .. s)
+  local scale = { [""] = 1, K = 1024, M = 1024 * 1024, G = 1024 * 1024 * 1024 }
+  return tonumber(n) * scale[unit]
+end
+
+return M
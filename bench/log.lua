@@ -0,0 +1,35 @@
+-- A log line grammar for the benchmarks:
+-- 2024-05-01T12:34:56Z INFO [worker-3] id=123 path=/api/items ms=45
+local P = require("parser")
+
+local M = {}
+
+local space     = P.literal(" ")
+
+local timestamp = P.take_while("[%dTZ:%-]", 1)
+local level     = P.one_of({ "DEBUG", "INFO", "WARN", "ERROR" })
+local component = P.between(P.literal("["), P.take_while("[%w_%-]", 1), P.literal("]"))
+
+local field     = P.take_while("[%w_]", 1)
+  :take_after(P.literal("="))
+  :pair(P.take_while("[^ \n]", 1))
+
+M.line          = timestamp
+  :take_after(space)
+  :pair(level)
+  :take_after(space)
+  :pair(component)
+  :pair(space:drop_for(field):zero_or_more())
+  :take_after(P.literal("\n"))
+
+M.grammar       = M.line:zero_or_more():compile()
+
+function M.parse_log(str)
+  local result, rest = M.grammar:parse(str)
+  if not result or rest ~= "" then
+    return nil, "Invalid log"
+  end
+  return result
+end
+
+return M
@@ -0,0 +1,240 @@
+// Microbenchmarks for single combinators, driven through the Lua API the
+// way p:parse is called from Lua. Every case runs a fixed number of calls
+// per sample, after warm-up samples, and reports the median and p99 of the
+// sample means, each the time of one sample over its calls. The p99 is the
+// spread between samples, not the tail of single calls, which are too short
+// to time one by one. The any_char row is the floor every other row pays
+// for the call itself.
+//
+//   bench_micro [--json] [filter]
+
+#define _GNU_SOURCE
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef LUA_SRC_DIR
+#define LUA_SRC_DIR ""
+#endif
+
+#define WARMUP_SAMPLES 20
+#define SAMPLES 200
+
+int luaopen_parser_core(lua_State *L);
+
+typedef struct {
+  const char *name;
+  // returns the parser and the input it is run on
+  const char *setup;
+  int calls; // per sample, pinned so runs compare
+} MicroCase;
+
+static const MicroCase cases[] = {
+    {"any_char", "return P.any_char(), 'x'", 20000},
+    {"literal/11", "return P.literal('hello world'), 'hello world'", 20000},
+    {"literal/1k",
+     "local s = string.rep('abcdefgh', 128) return P.literal(s), s", 5000},
+    {"char_class", "return P.char_class('%a'), 'x'", 20000},
+    {"take_while/64k", "return P.take_while('%a'), string.rep('a', 65536)",
+     200},
+
+    // alternatives share their first byte, so none is skipped by dispatch
+    // and the chain fails depth - 1 times before it matches
+    {"or_else/depth=1", "return P.literal('x0'), 'x0'", 20000},
+    {"or_else/depth=4",
+     "local p = P.literal('x0') for i = 1, 3 do "
+     "p = p:or_else(P.literal('x' .. i)) end return p, 'x3'",
+     20000},
+    {"or_else/depth=16",
+     "local p = P.literal('x0') for i = 1, 15 do "
+     "p = p:or_else(P.literal('x' .. i)) end return p, 'x15'",
+     10000},
+    {"or_else/depth=16/compiled",
+     "local p = P.literal('x0') for i = 1, 15 do "
+     "p = p:or_else(P.literal('x' .. i)) end return p:compile(), 'x15'",
+     10000},
+
+    {"zero_or_more/any_char/4k",
+     "return P.any_char():zero_or_more(), string.rep('a', 4096)", 200},
+    {"zero_or_more/literal/4k",
+     "return P.literal('a'):zero_or_more(), string.rep('a', 4096)", 200},
+    {"zero_or_more/literal/4k/compiled",
+     "return P.literal('a'):zero_or_more():compile(), string.rep('a', 4096)",
+     200},
+    {"many_concat/4k", "return P.any_char():many_concat(), string.rep('a', 4096)",
+     200},
+
+    // resolved once, then a plain indirection
+    {"lazy/once", "return P.lazy(function() return P.any_char() end), 'x'",
+     20000},
+    // the thunk runs on every parse
+    {"lazy/dynamic",
+     "local inner = P.any_char() "
+     "return P.lazy(function() return inner end, { once = false }), 'x'",
+     20000},
+
+    {"map", "return P.any_char():map(function(c) return c end), 'x'", 20000},
+    {"pred", "return P.any_char():pred(function() return true end), 'x'",
+     20000},
+    {"map/4k",
+     "return P.any_char():map(function(c) return c end):zero_or_more(), "
+     "string.rep('a', 4096)",
+     100},
+    {"pred/4k",
+     "return P.any_char():pred(function() return true end):zero_or_more(), "
+     "string.rep('a', 4096)",
+     100},
+};
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static lua_State *micro_state(void) {
+  lua_State *L = luaL_newstate();
+  if (!L) {
+    fprintf(stderr, "cannot create a Lua state\n");
+    exit(1);
+  }
+  luaL_openlibs(L);
+
+  // the core is linked in, the Lua half comes from the source tree
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "preload");
+  lua_pushcfunction(L, luaopen_parser_core);
+  lua_setfield(L, -2, "parser.core");
+  lua_pop(L, 1);
+
+  lua_getfield(L, -1, "path");
+  lua_pushfstring(L, "%s;%s/?.lua;%s/?/init.lua", lua_tostring(L, -1),
+                  LUA_SRC_DIR, LUA_SRC_DIR);
+  lua_setfield(L, -3, "path");
+  lua_pop(L, 2);
+
+  if (luaL_dostring(L, "P = require('parser')")) {
+    fprintf(stderr, "cannot load parser: %s\n", lua_tostring(L, -1));
+    exit(1);
+  }
+  return L;
+}
+
+// leaves parse, the parser and the input on the stack, returns the bytes a
+// parse consumes
+static size_t micro_setup(lua_State *L, const MicroCase *c) {
+  if (luaL_loadstring(L, c->setup) || lua_pcall(L, 0, 2, 0)) {
+    fprintf(stderr, "%s: %s\n", c->name, lua_tostring(L, -1));
+    exit(1);
+  }
+
+  lua_getfield(L, -2, "parse");
+  lua_insert(L, -3);
+
+  lua_pushvalue(L, -3);
+  lua_pushvalue(L, -3);
+  lua_pushvalue(L, -3);
+  if (lua_pcall(L, 2, 2, 0)) {
+    fprintf(stderr, "%s: %s\n", c->name, lua_tostring(L, -1));
+    exit(1);
+  }
+  if (lua_isnil(L, -2)) {
+    fprintf(stderr, "%s: the input does not parse\n", c->name);
+    exit(1);
+  }
+
+  size_t consumed = lua_rawlen(L, -3) - lua_rawlen(L, -1);
+  lua_pop(L, 2);
+  return consumed;
+}
+
+static double micro_sample(lua_State *L, int calls) {
+  int base = lua_gettop(L);
+  double start = now_ns();
+  for (int i = 0; i < calls; i++) {
+    lua_pushvalue(L, base - 2);
+    lua_pushvalue(L, base - 1);
+    lua_pushvalue(L, base);
+    lua_call(L, 2, 0);
+  }
+  return (now_ns() - start) / calls;
+}
+
+int main(int argc, char **argv) {
+  int json = 0;
+  const char *filter = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0)
+      json = 1;
+    else
+      filter = argv[i];
+  }
+
+#ifdef __linux__
+  // one core keeps migrations out of the tail
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(sched_getcpu() >= 0 ? sched_getcpu() : 0, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+#endif
+
+  lua_State *L = micro_state();
+  double samples[SAMPLES];
+
+  if (!json)
+    printf("%-34s %12s %12s %12s\n", "case", "ns/call", "p99 sample",
+           "ns/byte");
+
+  int first = 1;
+  if (json)
+    printf("[\n");
+
+  for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+    const MicroCase *c = &cases[k];
+    if (filter && !strstr(c->name, filter))
+      continue;
+
+    size_t bytes = micro_setup(L, c);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+
+    for (int i = 0; i < WARMUP_SAMPLES; i++)
+      micro_sample(L, c->calls);
+    for (int i = 0; i < SAMPLES; i++)
+      samples[i] = micro_sample(L, c->calls);
+    lua_settop(L, 0);
+
+    qsort(samples, SAMPLES, sizeof(double), cmp_double);
+    // samples hold the mean per-call time of each sample
+    double median = samples[SAMPLES / 2];
+    double p99 = samples[SAMPLES * 99 / 100];
+    double per_byte = bytes ? median / (double)bytes : 0;
+
+    if (json) {
+      printf("%s  {\"case\": \"%s\", \"calls\": %d, \"samples\": %d, "
+             "\"bytes\": %zu, \"median_ns_call\": %.2f, "
+             "\"p99_sample_mean_ns\": %.2f, \"ns_byte\": %.4f}",
+             first ? "" : ",\n", c->name, c->calls, SAMPLES, bytes, median,
+             p99, per_byte);
+    } else {
+      printf("%-34s %12.1f %12.1f %12.3f\n", c->name, median, p99, per_byte);
+    }
+    first = 0;
+  }
+
+  if (json)
+    printf("\n]\n");
+
+  lua_close(L);
+  return 0;
+}
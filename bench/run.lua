@@ -0,0 +1,68 @@
+-- End-to-end benchmarks: example/json.lua, example/simple_xml.lua and
+-- bench/log.lua over generated corpora, see bench/corpus.lua. Every case
+-- runs in its own process so its peak RSS is its own. Prints one JSON
+-- document to stdout.
+--
+-- BENCH_SIZES    comma separated input sizes, "1K,64K,1M,16M,100M" by default
+-- BENCH_MIN_TIME seconds of CPU time each case is repeated for, 1 by default
+-- BENCH_ONLY     runs the grammars listed, "json,xml,log" by default
+-- BENCH_BUILD_TYPE the CMake build type of the core under test, recorded in
+--                the output. `make bench` and the bench target set it
+local corpus = require("bench.corpus")
+
+local lua = arg[-1] or "lua"
+local sizes = os.getenv("BENCH_SIZES") or "1K,64K,1M,16M,100M"
+local min_time = tonumber(os.getenv("BENCH_MIN_TIME") or "1")
+local only = os.getenv("BENCH_ONLY") or "json,xml,log"
+
+local cases = {
+  { "json", "shallow" },
+  { "json", "deep" },
+  { "xml", "shallow" },
+  { "xml", "deep" },
+  { "log", "flat" },
+}
+
+local function run(cmd)
+  local p = io.popen(cmd)
+  local out = p:read("a")
+  local ok = p:close()
+  return ok, out
+end
+
+local _, commit = run("git rev-parse --short HEAD 2>/dev/null")
+commit = commit:match("%S+")
+
+local results = {}
+for _, case in ipairs(cases) do
+  local grammar, shape = case[1], case[2]
+  if ("," .. only .. ","):find("," .. grammar .. ",", 1, true) then
+    for size in sizes:gmatch("[^,%s]+") do
+      local bytes = corpus.parse_size(size)
+      io.stderr:write(string.format("bench %s/%s %s\n", grammar, shape, size))
+
+      local ok, out = run(string.format("%s bench/case.lua %s %s %d %g",
+        lua, grammar, shape, bytes, min_time))
+      local line = out:match("{.*}")
+      if ok and line then
+        results[#results + 1] = line
+      else
+        results[#results + 1] = string.format(
+          '{"grammar": "%s", "shape": "%s", "bytes": %d, "error": "case failed"}',
+          grammar, shape, bytes)
+      end
+    end
+  end
+end
+
+print("{")
+print(string.format('  "commit": %s,', commit and '"' .. commit .. '"' or "null"))
+print(string.format('  "lua": "%s",', _VERSION))
+local build_type = os.getenv("BENCH_BUILD_TYPE")
+print(string.format('  "build_type": %s,', build_type and '"' .. build_type .. '"' or "null"))
+print('  "results": [')
+for i, line in ipairs(results) do
+  print("    " .. line .. (i < #results and "," or ""))
+end
+print("  ]")
+print("}")
@@ -41,7 +41,7 @@ end)
 ----------------------------------------------------------------------
 
 null           = kwd("null", nil)
-boolean        = kwd("true", true):or_else(kwd("false", false))
+boolean        = token(parser.one_of({ ["true"] = true, ["false"] = false }))
 
 ----------------------------------------------------------------------
 -- string
@@ -53,11 +53,7 @@ json_string    = token(parser.quoted_string())
 -- number
 ----------------------------------------------------------------------
 
-local digit    = parser.any_char():pred(function(c)
-  return c:match("%d") ~= nil
-end)
-
-local digits   = digit:one_or_more():map(table.concat)
+local digits   = parser.take_while("%d", 1)
 
 local sign     =
     parser.literal("-")
@@ -83,15 +79,8 @@ local exponent =
 
 number         =
     token(
-      sign:pair(digits):pair(fraction):pair(exponent)
-    ):map(function(tree)
-      local sg = tree[1][1][1]
-      local int = tree[1][1][2]
-      local frac = tree[1][2]
-      local exp = tree[2]
-      local s = (sg or "") .. int .. (frac or "") .. (exp or "")
-      return tonumber(s)
-    end)
+      sign:pair(digits):pair(fraction):pair(exponent):recognize()
+    ):map(tonumber)
 
 ----------------------------------------------------------------------
 -- array
@@ -99,28 +88,14 @@ number         =
 
 local comma    = token(parser.literal(","))
 
+-- null elements leave holes, like they do in any Lua table. Once a bracket
+-- is open nothing else can match, the cut stops the retries on bad input
 array          =
-    token(parser.literal("["))
-    :and_then(function()
-      -- check for empty array
-      return token(parser.literal("]")):map(function() return {} end)
-          :or_else(
-            value:pair((comma:drop_for(value)):zero_or_more())
-            :take_after(token(parser.literal("]")))
-          )
-    end)
-    :map(function(pair)
-      if pair[1] == nil then
-        return {}
-      end
-      local first = pair[1]
-      local rest = pair[2]
-      local arr = { first }
-      for _, v in ipairs(rest) do
-        table.insert(arr, v)
-      end
-      return arr
-    end)
+    parser.between(
+      token(parser.literal("[")):cut(),
+      value:sep_by(comma),
+      token(parser.literal("]"))
+    )
 
 ----------------------------------------------------------------------
 -- object
@@ -129,28 +104,15 @@ array          =
 local colon    = token(parser.literal(":"))
 
 object         =
-    token(parser.literal("{"))
-    :and_then(function()
-      return token(parser.literal("}")):map(function() return {} end)
-          :or_else(
-            json_string:pair(colon:drop_for(value))
-            :pair(
-              (comma:drop_for(json_string:pair(colon:drop_for(value))))
-              :zero_or_more()
-            )
-            :take_after(token(parser.literal("}")))
-          )
-    end)
-    :map(function(tree)
-      if tree[1] == nil then
-        return {}
-      end
-      local first = tree[1]
-      local rest = tree[2]
+    parser.between(
+      token(parser.literal("{")):cut(),
+      json_string:pair(colon:drop_for(value)):sep_by(comma),
+      token(parser.literal("}"))
+    )
+    :map(function(members)
       local obj = {}
-      obj[first[1]] = first[2]
-      for _, pair in ipairs(rest) do
-        obj[pair[1]] = pair[2]
+      for _, member in ipairs(members) do
+        obj[member[1]] = member[2]
       end
       return obj
     end)
@@ -159,10 +121,12 @@ object         =
 -- Public API
 ----------------------------------------------------------------------
 
+local grammar  = value:compile()
+
 function M.parse_json(str)
-  local result, rest = value:parse(str)
+  local result, rest, err = grammar:parse(str)
   if not result then
-    return nil, "Invalid JSON"
+    return nil, "Invalid JSON" .. (err and ": " .. tostring(err) or "")
   end
 
   if rest:match("^%s*$") then
@@ -112,4 +112,5 @@ local xml_ast = {
     },
 }
 
-return P.utils.tables_equal(xml_ast, out) and rest == "hello\n"
+-- the grammar goes along for bench/case.lua
+return P.utils.tables_equal(xml_ast, out) and rest == "hello\n", element
@@ -5,43 +5,32 @@ for k, v in pairs(core) do
     M[k] = v
 end
 
-
----@param str string checkes wheatear str is a whitespace chararcter
----@return boolean
-local function is_whitespace(str)
-    return str:match("^%s*$") ~= nil
-end
-
 function M.set_inspect(parser, inspect_str)
     parser.inspect = inspect_str
     return parser
 end
 
 function M.whitespace_char()
-    return M.set_inspect(core.any_char():pred(is_whitespace), "whitespace_char")
+    return M.set_inspect(core.char_class("%s"), "whitespace_char")
+end
+
+function M.digit()
+    return M.set_inspect(core.char_class("%d"), "digit")
 end
 
 function M.space1()
-    return M.set_inspect(M.whitespace_char():one_or_more(), "space1")
+    return M.set_inspect(core.take_while("%s", 1), "space1")
 end
 
 function M.space0()
-    return M.set_inspect(M.whitespace_char():zero_or_more(), "space0")
+    return M.set_inspect(core.take_while("%s"), "space0")
 end
 
 function M.quoted_string()
     return M.set_inspect(
         M.space0():drop_for(
             core.literal('"'):drop_for(
-                core.any_char():pred(
-                    function(char)
-                        return char ~= '"'
-                    end
-                ):zero_or_more():take_after(M.literal('"'))
-            ):map(
-                function(chars)
-                    return table.concat(chars, "")
-                end
+                core.take_while('[^"]'):take_after(core.literal('"'))
             )
         ),
         "quoted_string"
@@ -50,22 +39,9 @@ end
 
 function M.identifier()
     return M.set_inspect(
-        core.any_char():pred(
-            function(ch)
-                return ch:match("[%a_]") ~= nil
-            end
-        ):and_then(
-            function(first)
-                return core.any_char():pred(
-                    function(ch)
-                        return ch:match("[%w_%-]") ~= nil
-                    end
-                ):zero_or_more():map(
-                    function(rest)
-                        table.insert(rest, 1, first)
-                        return table.concat(rest, "")
-                    end
-                )
+        core.char_class("[%a_]"):pair(core.take_while("[%w_%-]")):map(
+            function(parts)
+                return parts[1] .. parts[2]
             end
         ),
         "identifier"
@@ -73,25 +49,24 @@ function M.identifier()
 end
 
 function M.pure(id)
-    local p = core.new(function(input)
-        return id, input
+    local p = core.custom(function(_, pos)
+        return id, pos
     end)
 
     return M.set_inspect(p, string.format("pure(%q)", id))
 end
 
-function M.consume_until(mark)
-    local p = core.new(function(input)
-        local start_pos, end_pos = input:find(mark, 1, true)
-        if not start_pos then
-            return nil, input
-        end
+function M.between(open, p, close)
+    return M.set_inspect(open:drop_for(p):take_after(close), "between")
+end
 
-        local out = input:sub(1, end_pos)
-        local rest = input:sub(end_pos + 1, input:len())
+function M.commit(p)
+    return p:cut()
+end
 
-        return out, rest
-    end)
+function M.consume_until(mark)
+    -- a missing mark yields nil without consuming anything
+    local p = core.take_until(mark, true):or_else(M.pure(nil))
 
     return M.set_inspect(p, string.format("consume_until(%q)", mark))
 end
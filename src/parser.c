@@ -1,8 +1,18 @@
 #include <lauxlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <lua.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "parser.h"
 
@@ -10,35 +20,119 @@
    ParseResult
    --------------------------- */
 
-static ParseResult parse_ok(const char *rest, int lua_ref) {
-  ParseResult r = {1, rest, lua_ref};
+static ParseResult parse_ok(size_t pos) {
+  ParseResult r = {1, 0, 0, pos};
   return r;
 }
 
-static ParseResult parse_err(const char *input) {
-  ParseResult r = {0, input, LUA_NOREF};
+static ParseResult parse_err(size_t pos) {
+  ParseResult r = {0, 0, 0, pos};
   return r;
 }
 
+static ParseResult parse_more(size_t pos) {
+  ParseResult r = {0, 1, 0, pos};
+  return r;
+}
+
+/* ---------------------------
+   Expected sets
+   --------------------------- */
+
+static void parse_expect(ParseContext *ctx, size_t pos, Parser *p) {
+  ParseError *e = &ctx->err;
+  if (pos < e->pos)
+    return;
+
+  // anything expected before this offset no longer matters
+  if (pos > e->pos) {
+    e->pos = pos;
+    e->n = 0;
+  }
+
+  for (int i = 0; i < e->n; i++) {
+    if (e->expected[i] == p)
+      return;
+  }
+  if (e->n < EXPECT_MAX)
+    e->expected[e->n++] = p;
+}
+
+// records what p would have expected first at pos, for alternatives that
+// were skipped without running
+static void parse_expect_first(ParseContext *ctx, size_t pos, Parser *p,
+                               int depth) {
+  if (depth > EXPECT_MAX_DEPTH || pos < ctx->err.pos)
+    return;
+
+  Parser *kids[2];
+  int n = parser_children(p, kids);
+
+  switch (p->kind) {
+  case P_LITERAL:
+  case P_ANY_CHAR:
+  case P_CHAR_CLASS:
+  case P_TAKE_WHILE:
+  case P_TAKE_UNTIL:
+  case P_ONE_OF:
+  case P_LABEL:
+    parse_expect(ctx, pos, p);
+    return;
+
+  case P_OR_ELSE:
+    parse_expect_first(ctx, pos, kids[0], depth + 1);
+    parse_expect_first(ctx, pos, kids[1], depth + 1);
+    return;
+
+  default:
+    if (n > 0)
+      parse_expect_first(ctx, pos, kids[0], depth + 1);
+  }
+}
+
 static Parser *parser_new(ParserKind k, parse_fn_t parse, destroy_fn_t destroy,
-                          void *data, lua_State *L) {
-  Parser *p = (Parser *)malloc(sizeof(Parser));
-  if (!p) {
-    perror("malloc");
-    exit(1);
+                          size_t size, lua_State *L) {
+  // the node and its payload are one allocation
+  Arena *a = arena_current(L);
+  Parser *p;
+  if (a) {
+    p = (Parser *)arena_alloc(a, sizeof(Parser) + size);
+  } else {
+    p = (Parser *)malloc(sizeof(Parser) + size);
+    if (!p) {
+      perror("malloc");
+      exit(1);
+    }
   }
+
+  memset(p->data, 0, size);
   p->kind = k;
   p->parse = parse;
   p->destroy = destroy;
-  p->data = data;
   p->refcount = 1;
   p->L = L;
   p->lua_ref = LUA_NOREF;
+  p->arena = a;
+  p->arena_next = NULL;
+
+  // the creator's ref goes to the arena like any other
+  if (a) {
+    p->arena_next = a->nodes;
+    a->nodes = p;
+    a->nnodes++;
+    a->refcount++;
+  }
+
   return p;
 }
 
 static void parser_ref(Parser *p) {
-  if (p)
+  if (!p)
+    return;
+
+  if (p->arena)
+    p->arena->refcount++;
+  else
     p->refcount++;
 }
 
@@ -47,6 +141,13 @@ static void parser_unref(Parser *p) {
   if (!p)
     return;
 
+  // exactly zero, releases made while the arena is torn down go below it
+  if (p->arena) {
+    if (--p->arena->refcount == 0)
+      arena_destroy(p->arena);
+    return;
+  }
+
   p->refcount--;
   if (p->refcount <= 0) {
     luaL_unref(p->L, LUA_REGISTRYINDEX, p->lua_ref);
@@ -59,41 +160,333 @@ static void parser_unref(Parser *p) {
   }
 }
 
-static ParseResult literal_parse(Parser *p, const char *input) {
-  LiteralData *d = (LiteralData *)p->data;
-  size_t n = strlen(d->lit);
-  if (strncmp(input, d->lit, n) == 0) {
+static void parser_hold(Arena *holder, Parser *child) {
+  if (child && (!child->arena || child->arena != holder))
+    parser_ref(child);
+}
+
+static void parser_release(Arena *holder, Parser *child) {
+  if (child && (!child->arena || child->arena != holder))
+    parser_unref(child);
+}
+
+/* ---------------------------
+   Grammar arenas
+   --------------------------- */
+
+#define ARENA_CHUNK 4096
+
+// registry key of the arena parsers are currently built in
+static const char arena_key = 0;
+
+static Arena *arena_current(lua_State *L) {
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &arena_key);
+  Arena *a = (Arena *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return a;
+}
+
+static void *arena_alloc(Arena *a, size_t size) {
+  size_t align = sizeof(max_align_t);
+  size = (size + align - 1) & ~(align - 1);
+
+  ArenaChunk *c = a->chunks;
+  if (!c || c->cap - c->used < size) {
+    size_t cap = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+    c = (ArenaChunk *)malloc(sizeof(ArenaChunk) + cap);
+    if (!c) {
+      perror("malloc");
+      exit(1);
+    }
+    c->used = 0;
+    c->cap = cap;
+    c->next = a->chunks;
+    a->chunks = c;
+  }
+
+  void *ptr = (char *)c->data + c->used;
+  c->used += size;
+  a->bytes += size;
+  return ptr;
+}
+
+static void arena_destroy(Arena *a) {
+  // destroy hooks drop Lua refs and outside children, the memory goes below
+  for (Parser *p = a->nodes; p; p = p->arena_next) {
+    if (p->destroy)
+      p->destroy(p);
+  }
+
+  ArenaChunk *c = a->chunks;
+  while (c) {
+    ArenaChunk *next = c->next;
+    free(c);
+    c = next;
+  }
+
+  free(a);
+}
+
+static ParseResult parser_run(Parser *p, ParseContext *ctx, size_t pos) {
+  // combinators may hold a value on the stack while a child runs
+  luaL_checkstack(ctx->L, 4, "parser nesting too deep");
+
+  // leaves are cheaper to re-run than to look up
+  ParseResult r;
+  if (ctx->prof)
+    r = profile_run(p, ctx, pos);
+  else if (ctx->memo_all && p->kind != P_LITERAL && p->kind != P_ANY_CHAR &&
+           p->kind != P_ONE_OF && p->kind != P_MEMO)
+    r = memo_run(p, ctx, pos);
+  else
+    r = p->parse(p, ctx, pos);
+
+  if (r.ok || r.more)
+    return r;
+
+  switch (p->kind) {
+  case P_LITERAL:
+  case P_ANY_CHAR:
+  case P_CHAR_CLASS:
+  case P_TAKE_WHILE:
+  case P_TAKE_UNTIL:
+  case P_ONE_OF:
+    parse_expect(ctx, pos, p);
+    break;
+  default:
+    break;
+  }
+  return r;
+}
+
+static ParseResult parser_try(Parser *p, ParseContext *ctx, size_t pos) {
+  int outer = ctx->cut;
+  ctx->cut = 0;
+
+  ParseResult r = parser_run(p, ctx, pos);
+  if (!r.ok && ctx->cut)
+    r.cut = 1;
+
+  if (ctx->prof && !r.ok && !r.more && !r.cut)
+    profile_entry(ctx->prof, p)->backtracks++;
+
+  // a cut inside a way that worked commits the enclosing choices too
+  ctx->cut |= outer;
+  return r;
+}
+
+/* ---------------------------
+   Packrat memo table
+   --------------------------- */
+
+static size_t memo_hash(Parser *p, size_t offset) {
+  size_t h = (size_t)(uintptr_t)p * 0x9E3779B97F4A7C15ull;
+  return h ^ (offset * 0xC2B2AE3D27D4EB4Full) ^ (h >> 29);
+}
+
+static MemoEntry *memo_slot(MemoEntry *entries, size_t cap, Parser *p,
+                            size_t offset) {
+  size_t i = memo_hash(p, offset) & (cap - 1);
+  while (entries[i].parser &&
+         (entries[i].parser != p || entries[i].offset != offset))
+    i = (i + 1) & (cap - 1);
+  return &entries[i];
+}
+
+static void memo_grow(MemoTable *m) {
+  size_t cap = m->cap * 2;
+  MemoEntry *entries = (MemoEntry *)calloc(cap, sizeof(MemoEntry));
+  if (!entries) {
+    perror("calloc");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < m->cap; i++) {
+    MemoEntry *e = &m->entries[i];
+    if (e->parser)
+      *memo_slot(entries, cap, e->parser, e->offset) = *e;
+  }
+
+  free(m->entries);
+  m->entries = entries;
+  m->cap = cap;
+}
+
+// pushes the slot memo_get fills, before the parse pushes anything
+static void memo_reserve(ParseContext *ctx) {
+  lua_pushnil(ctx->L);
+  ctx->memo_idx = lua_gettop(ctx->L);
+}
+
+static MemoTable *memo_get(ParseContext *ctx) {
+  if (ctx->memo)
+    return ctx->memo;
+
+  lua_State *L = ctx->L;
+  MemoTable *m = (MemoTable *)lua_newuserdata(L, sizeof(MemoTable));
+  m->cap = 64;
+  m->count = 0;
+  m->entries = (MemoEntry *)calloc(m->cap, sizeof(MemoEntry));
+  if (!m->entries) {
+    perror("calloc");
+    exit(1);
+  }
+  luaL_setmetatable(L, "ParserMemo");
+
+  m->L = L;
+  m->idx = ctx->memo_idx;
+  m->trim_at = MEMO_TRIM_MIN;
+  lua_newtable(L);
+  lua_setuservalue(L, -2);
+  lua_replace(L, ctx->memo_idx);
+
+  ctx->memo = m;
+  return m;
+}
+
+// drops the reserved slot, the output of the parse stays on top
+static void memo_release(ParseContext *ctx) {
+  MemoTable *m = ctx->memo;
+  if (m) {
+    free(m->entries);
+    m->entries = NULL;
+    ctx->memo = NULL;
+  }
+  lua_remove(ctx->L, ctx->memo_idx);
+}
+
+static int memo_gc(lua_State *L) {
+  MemoTable *m = (MemoTable *)luaL_checkudata(L, 1, "ParserMemo");
+  free(m->entries);
+  m->entries = NULL;
+  return 0;
+}
+
+static ParseResult memo_run(Parser *p, ParseContext *ctx, size_t pos) {
+  MemoTable *m = memo_get(ctx);
+  lua_State *L = ctx->L;
+
+  MemoEntry *e = memo_slot(m->entries, m->cap, p, pos);
+  if (e->parser) {
+    ctx->cut |= e->cut;
+    if (!e->ok) {
+      ParseResult r = parse_err(pos);
+      r.cut = e->cut;
+      return r;
+    }
+
+    lua_getuservalue(L, m->idx);
+    lua_rawgeti(L, -1, e->value_ref);
+    lua_remove(L, -2);
+
+    return parse_ok(e->pos);
+  }
+
+  int outer = ctx->cut;
+  ctx->cut = 0;
+  ParseResult r = p->parse(p, ctx, pos);
+  int cut = ctx->cut;
+  ctx->cut |= outer;
+
+  // the answer may change once more input arrives
+  if (r.more)
+    return r;
+
+  // nested parses may have grown the table, look the slot up again
+  if ((m->count + 1) * 2 > m->cap)
+    memo_grow(m);
+  e = memo_slot(m->entries, m->cap, p, pos);
+  if (!e->parser)
+    m->count++;
+  e->parser = p;
+  e->offset = pos;
+  e->ok = r.ok;
+  e->cut = cut;
+  e->pos = r.pos;
+  e->value_ref = LUA_NOREF;
+
+  if (r.ok) {
+    lua_getuservalue(L, m->idx);
+    lua_pushvalue(L, -2);
+    e->value_ref = luaL_ref(L, -2);
+    lua_pop(L, 1);
+  }
+
+  return r;
+}
+
+// nothing parses before offset again once a cut passed it, so the entries
+// there can go. Rebuilding is only worth it when the table has grown
+static void memo_trim(MemoTable *m, size_t offset) {
+  if (m->count < m->trim_at)
+    return;
+
+  MemoEntry *entries = (MemoEntry *)calloc(m->cap, sizeof(MemoEntry));
+  if (!entries) {
+    perror("calloc");
+    exit(1);
+  }
+
+  lua_State *L = m->L;
+  lua_getuservalue(L, m->idx);
 
-    lua_pushlstring(p->L, d->lit, n);
-    int ref = luaL_ref(p->L, LUA_REGISTRYINDEX);
+  size_t count = 0;
+  for (size_t i = 0; i < m->cap; i++) {
+    MemoEntry *e = &m->entries[i];
+    if (!e->parser)
+      continue;
+
+    if (e->offset < offset) {
+      luaL_unref(L, -1, e->value_ref);
+      continue;
+    }
 
-    return parse_ok(input + n, ref);
+    *memo_slot(entries, m->cap, e->parser, e->offset) = *e;
+    count++;
   }
+  lua_pop(L, 1);
 
-  return parse_err(input);
+  free(m->entries);
+  m->entries = entries;
+  m->count = count;
+  m->trim_at = count * 2 > MEMO_TRIM_MIN ? count * 2 : MEMO_TRIM_MIN;
 }
 
-static void literal_destroy(Parser *p) {
+static ParseResult literal_parse(Parser *p, ParseContext *ctx, size_t pos) {
   LiteralData *d = (LiteralData *)p->data;
-  if (d) {
-    free(d->lit);
-    free(d);
+  size_t n = d->len;
+  size_t avail = ctx->in.len - pos;
+  if (n <= avail && memcmp(ctx->in.base + pos, d->lit, n) == 0) {
+    lua_pushlstring(ctx->L, d->lit, n);
+    return parse_ok(pos + n);
   }
+
+  // the input ends inside something that still looks like the literal
+  if (ctx->partial && n > avail &&
+      memcmp(ctx->in.base + pos, d->lit, avail) == 0)
+    return parse_more(pos);
+
+  return parse_err(pos);
 }
 
-static Parser *make_literal(lua_State *L, const char *s) {
-  LiteralData *d = (LiteralData *)malloc(sizeof(LiteralData));
-  d->lit = strdup(s);
-  return parser_new(P_LITERAL, literal_parse, literal_destroy, d, L);
+static Parser *make_literal(lua_State *L, const char *s, size_t len) {
+  Parser *p = parser_new(P_LITERAL, literal_parse, NULL,
+                         sizeof(LiteralData) + len + 1, L);
+  LiteralData *d = (LiteralData *)p->data;
+  memcpy(d->lit, s, len);
+  d->lit[len] = '\0'; // keeps inspect happy
+  d->len = len;
+  return p;
 }
 
-static ParseResult any_char_parse(Parser *p, const char *input) {
+static ParseResult any_char_parse(Parser *p, ParseContext *ctx, size_t pos) {
   (void)p;
-  if (!input || input[0] == '\0')
-    return parse_err(input);
+  if (pos >= ctx->in.len)
+    return ctx->partial ? parse_more(pos) : parse_err(pos);
 
+  const char *input = ctx->in.base + pos;
   unsigned char uc = (unsigned char)input[0];
-  int len = 1;
+  size_t len = 1;
   if ((uc & 0x80) == 0)
     len = 1;
   else if ((uc & 0xE0) == 0xC0)
@@ -103,92 +496,77 @@ static ParseResult any_char_parse(Parser *p, const char *input) {
   else if ((uc & 0xF8) == 0xF0)
     len = 4;
 
-  lua_pushlstring(p->L, input, len);
-  int ref = luaL_ref(p->L, LUA_REGISTRYINDEX);
+  // a truncated sequence at the end of the input is taken as is
+  if (len > ctx->in.len - pos) {
+    if (ctx->partial)
+      return parse_more(pos);
+    len = ctx->in.len - pos;
+  }
 
-  return parse_ok(input + len, ref);
+  lua_pushlstring(ctx->L, input, len);
+  return parse_ok(pos + len);
 }
 
-static void any_char_destroy(Parser *p) { free(p->data); }
-
 static Parser *make_any_char(lua_State *L) {
-  AnyCharData *d = (AnyCharData *)malloc(sizeof(AnyCharData));
-  return parser_new(P_ANY_CHAR, any_char_parse, any_char_destroy, d, L);
+  return parser_new(P_ANY_CHAR, any_char_parse, NULL, 0, L);
 }
 
-static ParseResult map_parse(Parser *p, const char *input) {
+static ParseResult map_parse(Parser *p, ParseContext *ctx, size_t pos) {
   MapData *d = (MapData *)p->data;
-  ParseResult r = d->inner->parse(d->inner, input);
+  ParseResult r = parser_run(d->inner, ctx, pos);
   if (!r.ok)
     return r;
 
-  // get function from registry and call with r.output
-  lua_State *L = p->L;
-  lua_rawgeti(L, LUA_REGISTRYINDEX, d->func_ref); // push function
-
-  if (r.lua_ref != LUA_NOREF)
-    lua_rawgeti(L, LUA_REGISTRYINDEX, r.lua_ref);
-  else
-    lua_pushnil(L);
+  // call the function with the inner output, which is on top of the stack
+  lua_State *L = ctx->L;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, d->func_ref);
+  lua_insert(L, -2);
 
   if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
     // error calling lua function - return parse error
     const char *err = lua_tostring(L, -1);
     fprintf(stderr, "map callback error: %s\n", err ? err : "(unknown)");
     lua_pop(L, 1);
-    return parse_err(input);
-  }
-
-  if (r.lua_ref != LUA_NOREF) {
-    luaL_unref(L, LUA_REGISTRYINDEX, r.lua_ref);
+    return parse_err(pos);
   }
 
-  // push the result to the registery
-  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-
-  return parse_ok(r.rest, ref);
+  return parse_ok(r.pos);
 }
 
 static void map_destroy(Parser *p) {
   MapData *d = (MapData *)p->data;
-  if (d) {
-    // unref lua func
-    if (d->func_ref != LUA_NOREF && p->L) {
-      luaL_unref(p->L, LUA_REGISTRYINDEX, d->func_ref);
-    }
-    if (d->inner)
-      parser_unref(d->inner);
-    free(d);
+  // unref lua func
+  if (d->func_ref != LUA_NOREF && p->L) {
+    luaL_unref(p->L, LUA_REGISTRYINDEX, d->func_ref);
   }
+  if (d->inner)
+    parser_release(p->arena, d->inner);
 }
 
 static Parser *make_map(lua_State *L, Parser *inner, int func_ref) {
-  MapData *d = (MapData *)malloc(sizeof(MapData));
+  Parser *p = parser_new(P_MAP, map_parse, map_destroy, sizeof(MapData), L);
+  MapData *d = (MapData *)p->data;
   d->inner = inner;
-  parser_ref(d->inner); // take ownership
+  parser_hold(p->arena, d->inner); // take ownership
   d->func_ref = func_ref;
-  return parser_new(P_MAP, map_parse, map_destroy, d, L);
+  return p;
 }
 
-static ParseResult and_then_parse(Parser *p, const char *input) {
+static ParseResult and_then_parse(Parser *p, ParseContext *ctx, size_t pos) {
   AndThenData *d = (AndThenData *)p->data;
-  ParseResult r = d->inner->parse(d->inner, input);
+  ParseResult r = parser_run(d->inner, ctx, pos);
   if (!r.ok)
     return r;
 
-  lua_State *L = p->L;
+  lua_State *L = ctx->L;
   lua_rawgeti(L, LUA_REGISTRYINDEX, d->func_ref);
-
-  if (r.lua_ref != LUA_NOREF)
-    lua_rawgeti(L, LUA_REGISTRYINDEX, r.lua_ref);
-  else
-    lua_pushnil(L);
+  lua_insert(L, -2);
 
   if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
     const char *err = lua_tostring(L, -1);
     fprintf(stderr, "and_then callback error: %s\n", err ? err : "(unknown)");
     lua_pop(L, 1);
-    return parse_err(input);
+    return parse_err(pos);
   }
 
   // check returned value is Parser userdata
@@ -196,7 +574,7 @@ static ParseResult and_then_parse(Parser *p, const char *input) {
   if (!retp) {
     // not a parser
     lua_pop(L, 1);
-    return parse_err(input);
+    return parse_err(pos);
   }
 
   Parser *next = *retp;
@@ -206,85 +584,198 @@ static ParseResult and_then_parse(Parser *p, const char *input) {
   parser_ref(next);
   lua_pop(L, 1); // pop return value, remove userdata pointer from the stack
 
-  ParseResult r2 = next->parse(next, r.rest);
+  ParseResult r2 = parser_run(next, ctx, r.pos);
   parser_unref(next);
 
-  if (r.lua_ref != LUA_NOREF)
-    luaL_unref(L, LUA_REGISTRYINDEX, r.lua_ref);
-
   return r2;
 }
 
 static void and_then_destroy(Parser *p) {
   AndThenData *d = (AndThenData *)p->data;
-  if (d) {
-    if (d->func_ref != LUA_NOREF && p->L) {
-      luaL_unref(p->L, LUA_REGISTRYINDEX, d->func_ref);
-    }
-    if (d->inner)
-      parser_unref(d->inner);
-    free(d);
+  if (d->func_ref != LUA_NOREF && p->L) {
+    luaL_unref(p->L, LUA_REGISTRYINDEX, d->func_ref);
   }
+  if (d->inner)
+    parser_release(p->arena, d->inner);
 }
 
 static Parser *make_and_then(lua_State *L, Parser *inner, int func_ref) {
-  AndThenData *d = (AndThenData *)malloc(sizeof(AndThenData));
+  Parser *p = parser_new(P_AND_THEN, and_then_parse, and_then_destroy,
+                         sizeof(AndThenData), L);
+  AndThenData *d = (AndThenData *)p->data;
   d->inner = inner;
-  parser_ref(d->inner);
+  parser_hold(p->arena, d->inner);
   d->func_ref = func_ref;
-  return parser_new(P_AND_THEN, and_then_parse, and_then_destroy, d, L);
+  return p;
 }
 
-static ParseResult or_parse(Parser *p, const char *input) {
+static ParseResult or_parse(Parser *p, ParseContext *ctx, size_t pos) {
   OrData *d = (OrData *)p->data;
-  ParseResult r1 = d->left->parse(d->left, input);
-  if (r1.ok)
-    return r1;
-  return d->right->parse(d->right, input);
+
+  if (!d->dispatch) {
+    // building may run lazy thunks, which could have built it already
+    OrDispatch *t = or_dispatch_build(p, ctx->L);
+    if (d->dispatch)
+      or_dispatch_free(t);
+    else
+      d->dispatch = t;
+  }
+
+  OrDispatch *t = d->dispatch;
+  if (t->n == 0) {
+    ParseResult r1 = parser_try(d->left, ctx, pos);
+    if (r1.ok || r1.more || r1.cut)
+      return r1;
+    return parser_run(d->right, ctx, pos);
+  }
+
+  // every alternative that consumes anything would ask for more here
+  if (ctx->partial && pos == ctx->in.len)
+    return parse_more(pos);
+
+  size_t at = pos < ctx->in.len ? (unsigned char)ctx->in.base[pos] : 256;
+  uint64_t mask = t->masks[at];
+  ParseResult r = parse_err(pos);
+
+  for (uint64_t m = mask; m; m &= m - 1) {
+    r = parser_try(t->alts[__builtin_ctzll(m)], ctx, pos);
+    if (r.ok || r.more || r.cut)
+      return r;
+  }
+
+  // report the failure the last alternative would have, skipped or not
+  if (!((mask >> (t->n - 1)) & 1)) {
+    or_expect_skipped(ctx, pos, p);
+    return parse_err(pos);
+  }
+  return r;
+}
+
+// the alternatives the dispatch table skipped at pos still count as expected
+static void or_expect_skipped(ParseContext *ctx, size_t pos, Parser *p) {
+  OrDispatch *t = ((OrData *)p->data)->dispatch;
+  if (pos < ctx->err.pos)
+    return;
+
+  size_t at = pos < ctx->in.len ? (unsigned char)ctx->in.base[pos] : 256;
+  for (int i = 0; i < t->n; i++) {
+    if (!((t->masks[at] >> i) & 1))
+      parse_expect_first(ctx, pos, t->alts[i], 0);
+  }
 }
 
 static void or_destroy(Parser *p) {
   OrData *d = (OrData *)p->data;
-  if (d) {
-    if (d->left)
-      parser_unref(d->left);
-    if (d->right)
-      parser_unref(d->right);
-    free(d);
-  }
+  if (d->left)
+    parser_release(p->arena, d->left);
+  if (d->right)
+    parser_release(p->arena, d->right);
+  or_dispatch_free(d->dispatch);
 }
 
 static Parser *make_or(lua_State *L, Parser *a, Parser *b) {
-  OrData *d = (OrData *)malloc(sizeof(OrData));
+  Parser *p = parser_new(P_OR_ELSE, or_parse, or_destroy, sizeof(OrData), L);
+  OrData *d = (OrData *)p->data;
   d->left = a;
-  parser_ref(a);
+  parser_hold(p->arena, a);
   d->right = b;
-  parser_ref(b);
-  return parser_new(P_OR_ELSE, or_parse, or_destroy, d, L);
+  parser_hold(p->arena, b);
+  d->dispatch = NULL;
+  return p;
+}
+
+// collects the alternatives of a chain of or_else nodes in order, returns
+// -1 if there are more than OR_MAX_ALTS
+static int or_flatten(Parser *p, Parser **alts, int n) {
+  if (n < 0)
+    return n;
+
+  if (p->kind != P_OR_ELSE) {
+    if (n == OR_MAX_ALTS)
+      return -1;
+    alts[n] = p;
+    return n + 1;
+  }
+
+  OrData *d = (OrData *)p->data;
+  return or_flatten(d->right, alts, or_flatten(d->left, alts, n));
+}
+
+static OrDispatch *or_dispatch_build(Parser *p, lua_State *L) {
+  OrDispatch *t = (OrDispatch *)calloc(1, sizeof(OrDispatch));
+  if (!t) {
+    perror("calloc");
+    exit(1);
+  }
+  Parser *alts[OR_MAX_ALTS];
+
+  int n = or_flatten(p, alts, 0);
+  if (n < 0)
+    return t;
+
+  uint64_t masks[257] = {0};
+  int useful = 0;
+
+  for (int i = 0; i < n; i++) {
+    uint64_t bit = 1ull << i;
+    CharSet set;
+    memset(&set, 0, sizeof(CharSet));
+
+    if (first_set(alts[i], L, &set, 0) != FIRST_CONSUMES) {
+      for (int c = 0; c < 257; c++)
+        masks[c] |= bit;
+      continue;
+    }
+
+    useful = 1;
+    for (int c = 0; c < 256; c++) {
+      if (charset_has(&set, (unsigned char)c))
+        masks[c] |= bit;
+    }
+  }
+
+  if (!useful)
+    return t;
+
+  t->n = n;
+  t->alts = (Parser **)malloc(sizeof(Parser *) * n);
+  t->masks = (uint64_t *)malloc(sizeof(masks));
+  if (!t->alts || !t->masks) {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(t->alts, alts, sizeof(Parser *) * n);
+  memcpy(t->masks, masks, sizeof(masks));
+
+  return t;
+}
+
+static void or_dispatch_free(OrDispatch *t) {
+  if (t) {
+    free(t->alts);
+    free(t->masks);
+    free(t);
+  }
 }
 
-static ParseResult pred_parse(Parser *p, const char *input) {
+static ParseResult pred_parse(Parser *p, ParseContext *ctx, size_t pos) {
   PredData *d = (PredData *)p->data;
-  lua_State *L = p->L;
+  lua_State *L = ctx->L;
 
-  const char *start = input;
-  ParseResult inner_r = d->inner->parse(d->inner, input);
+  ParseResult inner_r = parser_run(d->inner, ctx, pos);
   if (!inner_r.ok) {
     return inner_r;
   }
 
+  // call the predicate on a copy, the inner output stays as our result
   lua_rawgeti(L, LUA_REGISTRYINDEX, d->func_ref);
-  if (inner_r.lua_ref != LUA_NOREF) {
-    lua_rawgeti(L, LUA_REGISTRYINDEX, inner_r.lua_ref);
-  } else {
-    lua_pushnil(L);
-  }
+  lua_pushvalue(L, -2);
 
   if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
     const char *err = lua_tostring(L, -1);
     fprintf(stderr, "pred callback error: %s\n", err ? err : "(unknown)");
-    lua_pop(L, 1);
-    return parse_err(start);
+    lua_pop(L, 2);
+    return parse_err(pos);
   }
 
   int truthy = lua_toboolean(L, -1);
@@ -294,287 +785,445 @@ static ParseResult pred_parse(Parser *p, const char *input) {
     return inner_r;
   }
 
-  if (inner_r.lua_ref != LUA_NOREF) {
-    luaL_unref(L, LUA_REGISTRYINDEX, inner_r.lua_ref);
-  }
-
-  return parse_err(start);
+  lua_pop(L, 1);
+  return parse_err(pos);
 }
 
 static void pred_destroy(Parser *p) {
   PredData *d = (PredData *)p->data;
-  if (d) {
-    if (d->func_ref != LUA_NOREF && p->L)
-      luaL_unref(p->L, LUA_REGISTRYINDEX, d->func_ref);
-    if (d->inner)
-      parser_unref(d->inner);
-    free(d);
-  }
+  if (d->func_ref != LUA_NOREF && p->L)
+    luaL_unref(p->L, LUA_REGISTRYINDEX, d->func_ref);
+  if (d->inner)
+    parser_release(p->arena, d->inner);
 }
 
 static Parser *make_pred(lua_State *L, Parser *inner, int func_ref) {
-  PredData *d = (PredData *)malloc(sizeof(PredData));
+  Parser *p = parser_new(P_PRED, pred_parse, pred_destroy, sizeof(PredData), L);
+  PredData *d = (PredData *)p->data;
   d->inner = inner;
-  parser_ref(d->inner);
+  parser_hold(p->arena, d->inner);
   d->func_ref = func_ref;
-  return parser_new(P_PRED, pred_parse, pred_destroy, d, L);
+  return p;
 }
 
 // TODO: rename to take_after
 // since we are using it as a method lit1:left(lit2) doesn't make sense
 // instead: lit1:take_after(lit2) makes it clear, we are taking lit1 after
 // parsing lit2
-static ParseResult take_after_parse(Parser *p, const char *input) {
+static ParseResult take_after_parse(Parser *p, ParseContext *ctx, size_t pos) {
   TakeAfterData *d = (TakeAfterData *)p->data;
-  lua_State *L = p->L;
+  lua_State *L = ctx->L;
 
-  ParseResult r1 = d->left->parse(d->left, input);
+  ParseResult r1 = parser_run(d->left, ctx, pos);
   if (!r1.ok)
     return r1;
 
-  ParseResult r2 = d->right->parse(d->right, r1.rest);
+  ParseResult r2 = parser_run(d->right, ctx, r1.pos);
   if (!r2.ok) {
-    // if we are here, that means r1 has succeeded which means it allocated a
-    // memory for it's result which have to free if r2 fails.
-    if (r1.lua_ref != LUA_NOREF)
-      luaL_unref(L, LUA_REGISTRYINDEX, r1.lua_ref);
-
+    // if we are here, that means r1 has succeeded which means it left its
+    // result on the stack, which we have to drop if r2 fails.
+    lua_pop(L, 1);
     return r2;
   }
 
-  if (r2.lua_ref != LUA_NOREF) {
-    luaL_unref(L, LUA_REGISTRYINDEX, r2.lua_ref);
-  }
-
-  return parse_ok(r2.rest, r1.lua_ref);
+  lua_pop(L, 1);
+  return parse_ok(r2.pos);
 }
 
 static void take_after_destroy(Parser *p) {
   TakeAfterData *d = (TakeAfterData *)p->data;
 
-  if (d) {
-    if (d->left)
-      parser_unref(d->left);
-    if (d->right)
-      parser_unref(d->right);
+  if (d->left)
+    parser_release(p->arena, d->left);
+  if (d->right)
+    parser_release(p->arena, d->right);
 
-    free(d);
-  }
 }
 
 static Parser *make_take_after(lua_State *L, Parser *left, Parser *right) {
-  TakeAfterData *d = (TakeAfterData *)malloc(sizeof(TakeAfterData));
+  Parser *p = parser_new(P_TAKE_AFTER, take_after_parse, take_after_destroy,
+                         sizeof(TakeAfterData), L);
+  TakeAfterData *d = (TakeAfterData *)p->data;
 
   d->left = left;
-  parser_ref(left);
+  parser_hold(p->arena, left);
 
   d->right = right;
-  parser_ref(right);
+  parser_hold(p->arena, right);
 
-  return parser_new(P_TAKE_AFTER, take_after_parse, take_after_destroy, d, L);
+  return p;
 }
 
 // TODO: rename to drop_for
 // since we are using it as a method lit1:right(lit2) doesn't make sense
 // instead: lit1:drop_for(lit2) makes it clear, we are droping lit1 for lit2
 // after parsing lit1
-static ParseResult drop_for_parse(Parser *p, const char *input) {
+static ParseResult drop_for_parse(Parser *p, ParseContext *ctx, size_t pos) {
   DropForData *d = (DropForData *)p->data;
-  lua_State *L = p->L;
+  lua_State *L = ctx->L;
 
-  ParseResult r1 = d->left->parse(d->left, input);
+  ParseResult r1 = parser_run(d->left, ctx, pos);
   if (!r1.ok)
     return r1;
 
-  ParseResult r2 = d->right->parse(d->right, r1.rest);
+  ParseResult r2 = parser_run(d->right, ctx, r1.pos);
   if (!r2.ok) {
-    if (r1.lua_ref != LUA_NOREF)
-      luaL_unref(L, LUA_REGISTRYINDEX, r1.lua_ref);
-
+    lua_pop(L, 1);
     return r2;
   }
 
-  if (r1.lua_ref != LUA_NOREF)
-    luaL_unref(L, LUA_REGISTRYINDEX, r1.lua_ref);
-
-  return parse_ok(r2.rest, r2.lua_ref);
+  lua_remove(L, -2);
+  return parse_ok(r2.pos);
 }
 
 static void drop_for_destroy(Parser *p) {
   DropForData *d = (DropForData *)p->data;
 
-  if (d) {
-    if (d->left)
-      parser_unref(d->left);
-    if (d->right)
-      parser_unref(d->right);
+  if (d->left)
+    parser_release(p->arena, d->left);
+  if (d->right)
+    parser_release(p->arena, d->right);
 
-    free(d);
-  }
 }
 
 static Parser *make_drop_for(lua_State *L, Parser *left, Parser *right) {
-  DropForData *d = (DropForData *)malloc(sizeof(DropForData));
+  Parser *p = parser_new(P_DROP_FOR, drop_for_parse, drop_for_destroy,
+                         sizeof(DropForData), L);
+  DropForData *d = (DropForData *)p->data;
 
   d->left = left;
-  parser_ref(left);
+  parser_hold(p->arena, left);
 
   d->right = right;
-  parser_ref(right);
+  parser_hold(p->arena, right);
 
-  return parser_new(P_DROP_FOR, drop_for_parse, drop_for_destroy, d, L);
+  return p;
 }
 
-static ParseResult one_or_more_parse(Parser *p, const char *input) {
+static ParseResult one_or_more_parse(Parser *p, ParseContext *ctx, size_t pos) {
   RepData *d = (RepData *)p->data;
-  lua_State *L = p->L;
-  const char *cur = input;
+  lua_State *L = ctx->L;
+  size_t cur = pos;
 
   // First parse (must succeed)
-  ParseResult r = d->inner->parse(d->inner, cur);
+  ParseResult r = parser_run(d->inner, ctx, cur);
   if (!r.ok)
     return r;
 
   lua_newtable(L);
+  lua_insert(L, -2);
   int count = 0;
 
   do {
     count++;
-    if (r.lua_ref != LUA_NOREF) {
-      lua_rawgeti(L, LUA_REGISTRYINDEX, r.lua_ref);
-      luaL_unref(L, LUA_REGISTRYINDEX, r.lua_ref);
-    } else {
-      lua_pushnil(L);
-    }
     lua_rawseti(L, -2, count);
-    cur = r.rest;
+    cur = r.pos;
 
-    r = d->inner->parse(d->inner, cur); // RE-PARSE HERE
+    r = parser_try(d->inner, ctx, cur); // RE-PARSE HERE
   } while (r.ok);
 
-  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-  return parse_ok(cur, ref);
+  if (r.more || r.cut) {
+    lua_pop(L, 1);
+    return r;
+  }
+
+  return parse_ok(cur);
 }
 
-static ParseResult zero_or_more_parse(Parser *p, const char *input) {
+static ParseResult zero_or_more_parse(Parser *p, ParseContext *ctx,
+                                      size_t pos) {
   RepData *d = (RepData *)p->data;
-  lua_State *L = p->L;
-  const char *cur = input;
+  lua_State *L = ctx->L;
+  size_t cur = pos;
 
   lua_newtable(L);
   int count = 0;
 
   while (1) {
-    ParseResult r = d->inner->parse(d->inner, cur);
-    if (!r.ok)
+    ParseResult r = parser_try(d->inner, ctx, cur);
+    if (!r.ok) {
+      if (r.more || r.cut) {
+        lua_pop(L, 1);
+        return r;
+      }
       break;
+    }
 
     count++;
-    if (r.lua_ref != LUA_NOREF) {
-      lua_rawgeti(L, LUA_REGISTRYINDEX, r.lua_ref);
-      luaL_unref(L, LUA_REGISTRYINDEX, r.lua_ref);
-    } else {
-      lua_pushnil(L);
-    }
     lua_rawseti(L, -2, count);
 
-    cur = r.rest;
+    cur = r.pos;
   }
 
-  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-  return parse_ok(cur, ref);
+  return parse_ok(cur);
 }
 
 static void rep_destroy(Parser *p) {
   RepData *d = (RepData *)p->data;
-  if (d) {
-    if (d->inner)
-      parser_unref(d->inner);
-    free(d);
-  }
+  if (d->inner)
+    parser_release(p->arena, d->inner);
 }
 
 static Parser *make_one_or_more(lua_State *L, Parser *inner) {
-  RepData *d = (RepData *)malloc(sizeof(RepData));
+  Parser *p = parser_new(P_ONE_OR_MORE, one_or_more_parse, rep_destroy,
+                         sizeof(RepData), L);
+  RepData *d = (RepData *)p->data;
   d->inner = inner;
-  parser_ref(d->inner);
-  return parser_new(P_ONE_OR_MORE, one_or_more_parse, rep_destroy, d, L);
+  parser_hold(p->arena, d->inner);
+  return p;
 }
 
 static Parser *make_zero_or_more(lua_State *L, Parser *inner) {
-  RepData *d = (RepData *)malloc(sizeof(RepData));
+  Parser *p = parser_new(P_ZERO_OR_MORE, zero_or_more_parse, rep_destroy,
+                         sizeof(RepData), L);
+  RepData *d = (RepData *)p->data;
+  d->inner = inner;
+  parser_hold(p->arena, d->inner);
+  return p;
+}
+
+static ParseResult many_concat_parse(Parser *p, ParseContext *ctx,
+                                     size_t pos) {
+  SpanData *d = (SpanData *)p->data;
+  lua_State *L = ctx->L;
+  size_t cur = pos;
+  int count = 0;
+
+  while (1) {
+    ParseResult r = parser_try(d->inner, ctx, cur);
+    if (!r.ok) {
+      if (r.more || r.cut || count < d->min)
+        return r;
+      break;
+    }
+
+    lua_pop(L, 1);
+    count++;
+
+    // an iteration that consumed nothing would repeat forever
+    if (r.pos == cur)
+      break;
+    cur = r.pos;
+  }
+
+  lua_pushlstring(L, ctx->in.base + pos, cur - pos);
+  return parse_ok(cur);
+}
+
+static ParseResult recognize_parse(Parser *p, ParseContext *ctx, size_t pos) {
+  SpanData *d = (SpanData *)p->data;
+
+  ParseResult r = parser_run(d->inner, ctx, pos);
+  if (!r.ok)
+    return r;
+
+  lua_pop(ctx->L, 1);
+  lua_pushlstring(ctx->L, ctx->in.base + pos, r.pos - pos);
+  return r;
+}
+
+static void span_destroy(Parser *p) {
+  SpanData *d = (SpanData *)p->data;
+  if (d->inner)
+    parser_release(p->arena, d->inner);
+}
+
+static Parser *make_many_concat(lua_State *L, Parser *inner, int min) {
+  Parser *p = parser_new(P_MANY_CONCAT, many_concat_parse, span_destroy,
+                         sizeof(SpanData), L);
+  SpanData *d = (SpanData *)p->data;
+  d->inner = inner;
+  parser_hold(p->arena, d->inner);
+  d->min = min;
+  return p;
+}
+
+static Parser *make_recognize(lua_State *L, Parser *inner) {
+  Parser *p = parser_new(P_RECOGNIZE, recognize_parse, span_destroy,
+                         sizeof(SpanData), L);
+  SpanData *d = (SpanData *)p->data;
   d->inner = inner;
-  parser_ref(d->inner);
-  return parser_new(P_ZERO_OR_MORE, zero_or_more_parse, rep_destroy, d, L);
+  parser_hold(p->arena, d->inner);
+  return p;
 }
 
-static ParseResult pair_parse(Parser *p, const char *input) {
+static ParseResult pair_parse(Parser *p, ParseContext *ctx, size_t pos) {
   PairData *d = (PairData *)p->data;
-  lua_State *L = p->L;
+  lua_State *L = ctx->L;
 
-  ParseResult r_left = d->left->parse(d->left, input);
+  ParseResult r_left = parser_run(d->left, ctx, pos);
   if (!r_left.ok) {
     return r_left;
   }
 
-  ParseResult r_right = d->right->parse(d->right, r_left.rest);
+  ParseResult r_right = parser_run(d->right, ctx, r_left.pos);
 
   if (!r_right.ok) {
-    if (r_left.lua_ref != LUA_NOREF) {
-      luaL_unref(L, LUA_REGISTRYINDEX, r_left.lua_ref);
-    }
-
+    lua_pop(L, 1);
     return r_right;
   }
 
-  lua_newtable(L);
-
-  if (r_left.lua_ref != LUA_NOREF) {
-    lua_rawgeti(L, LUA_REGISTRYINDEX, r_left.lua_ref);
-    luaL_unref(L, LUA_REGISTRYINDEX, r_left.lua_ref);
-  } else {
-    lua_pushnil(L);
-  }
+  // stack: left, right -> {left, right}
+  lua_createtable(L, 2, 0);
+  lua_insert(L, -3);
+  lua_rawseti(L, -3, 2); // right is second element
   lua_rawseti(L, -2, 1); // left is first element
 
-  if (r_right.lua_ref != LUA_NOREF) {
-    lua_rawgeti(L, LUA_REGISTRYINDEX, r_right.lua_ref);
-    luaL_unref(L, LUA_REGISTRYINDEX, r_right.lua_ref);
-  } else {
-    lua_pushnil(L);
-  }
-  lua_rawseti(L, -2, 2); // right is first element
-
-  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-  return parse_ok(r_right.rest, ref);
+  return parse_ok(r_right.pos);
 }
 
 static void pair_destroy(Parser *p) {
   PairData *d = (PairData *)p->data;
-  if (d) {
-    if (d->left)
-      parser_unref(d->left);
-    if (d->right)
-      parser_unref(d->right);
-    free(d);
-  }
+  if (d->left)
+    parser_release(p->arena, d->left);
+  if (d->right)
+    parser_release(p->arena, d->right);
 }
 
 static Parser *make_pair(lua_State *L, Parser *left, Parser *right) {
-  PairData *d = (PairData *)malloc(sizeof(PairData));
+  Parser *p = parser_new(P_PAIR, pair_parse, pair_destroy, sizeof(PairData), L);
+  PairData *d = (PairData *)p->data;
 
   d->left = left;
-  parser_ref(left);
+  parser_hold(p->arena, left);
 
   d->right = right;
-  parser_ref(right);
+  parser_hold(p->arena, right);
+
+  return p;
+}
+
+// remembers how long the lists a node builds get, capped so one huge list
+// doesn't make every later table huge as well
+static void list_hint(int *hint, int count) {
+  if (count > *hint)
+    *hint = count < LIST_HINT_MAX ? count : LIST_HINT_MAX;
+}
+
+static ParseResult sep_by_parse(Parser *p, ParseContext *ctx, size_t pos) {
+  SepByData *d = (SepByData *)p->data;
+  lua_State *L = ctx->L;
+  size_t cur = pos;
+  int count = 0;
+
+  lua_createtable(L, d->hint, 0);
+
+  ParseResult r = parser_try(d->item, ctx, pos);
+  while (r.ok) {
+    lua_rawseti(L, -2, ++count);
+
+    // an iteration that consumed nothing would repeat forever
+    if (count > 1 && r.pos == cur)
+      break;
+    cur = r.pos;
+
+    // a trailing separator is left unparsed
+    r = parser_try(d->sep, ctx, cur);
+    if (!r.ok)
+      break;
+    lua_pop(L, 1);
+
+    r = parser_try(d->item, ctx, r.pos);
+  }
+
+  if (r.more || r.cut || count < d->min) {
+    lua_pop(L, 1);
+    return r;
+  }
+
+  list_hint(&d->hint, count);
+  return parse_ok(cur);
+}
+
+static void sep_by_destroy(Parser *p) {
+  SepByData *d = (SepByData *)p->data;
+  if (d->item)
+    parser_release(p->arena, d->item);
+  if (d->sep)
+    parser_release(p->arena, d->sep);
+}
+
+static Parser *make_sep_by(lua_State *L, Parser *item, Parser *sep, int min) {
+  Parser *p = parser_new(P_SEP_BY, sep_by_parse, sep_by_destroy,
+                         sizeof(SepByData), L);
+  SepByData *d = (SepByData *)p->data;
+
+  d->item = item;
+  parser_hold(p->arena, item);
+
+  d->sep = sep;
+  parser_hold(p->arena, sep);
+
+  d->min = min;
+  return p;
+}
+
+static ParseResult many_till_parse(Parser *p, ParseContext *ctx, size_t pos) {
+  ManyTillData *d = (ManyTillData *)p->data;
+  lua_State *L = ctx->L;
+  size_t cur = pos;
+  int count = 0;
+
+  lua_createtable(L, d->hint, 0);
+
+  while (1) {
+    ParseResult r = parser_try(d->end, ctx, cur);
+    if (r.ok) {
+      lua_pop(L, 1); // the end's value is dropped
+      list_hint(&d->hint, count);
+      return parse_ok(r.pos);
+    }
+
+    if (!r.more && !r.cut)
+      r = parser_run(d->inner, ctx, cur);
 
-  return parser_new(P_PAIR, pair_parse, pair_destroy, d, L);
+    if (!r.ok) {
+      lua_pop(L, 1);
+      return r;
+    }
+
+    // it would never get to the end
+    if (r.pos == cur) {
+      lua_pop(L, 2);
+      return parse_err(cur);
+    }
+
+    lua_rawseti(L, -2, ++count);
+    cur = r.pos;
+  }
+}
+
+static void many_till_destroy(Parser *p) {
+  ManyTillData *d = (ManyTillData *)p->data;
+  if (d->inner)
+    parser_release(p->arena, d->inner);
+  if (d->end)
+    parser_release(p->arena, d->end);
+}
+
+static Parser *make_many_till(lua_State *L, Parser *inner, Parser *end) {
+  Parser *p = parser_new(P_MANY_TILL, many_till_parse, many_till_destroy,
+                         sizeof(ManyTillData), L);
+  ManyTillData *d = (ManyTillData *)p->data;
+
+  d->inner = inner;
+  parser_hold(p->arena, inner);
+
+  d->end = end;
+  parser_hold(p->arena, end);
+
+  return p;
 }
 
-static ParseResult lazy_parse(Parser *p, const char *input) {
+// returns the parser behind a lazy node with a ref the caller must drop, or
+// NULL if the thunk failed
+static Parser *lazy_resolve(Parser *p, lua_State *L) {
   LazyData *d = (LazyData *)p->data;
-  lua_State *L = p->L;
+
+  if (d->target) {
+    parser_ref(d->target);
+    return d->target;
+  }
 
   lua_rawgeti(L, LUA_REGISTRYINDEX, d->func_ref);
 
@@ -583,14 +1232,14 @@ static ParseResult lazy_parse(Parser *p, const char *input) {
     fprintf(stderr, "lazy parser thunk error: %s\n", err ? err : "(unknown)");
     lua_pop(L, 1);
 
-    return parse_err(input);
+    return NULL;
   }
 
   Parser **pp = (Parser **)luaL_testudata(L, -1, "Parser");
 
-  if (!pp) {
+  if (!pp || !*pp) {
     lua_pop(L, 1);
-    return parse_err(input);
+    return NULL;
   }
 
   Parser *inner = *pp;
@@ -598,7 +1247,26 @@ static ParseResult lazy_parse(Parser *p, const char *input) {
 
   lua_pop(L, 1);
 
-  ParseResult r = inner->parse(inner, input);
+  if (d->once) {
+    d->target = inner;
+    parser_hold(p->arena, inner);
+  }
+
+  return inner;
+}
+
+static ParseResult lazy_parse(Parser *p, ParseContext *ctx, size_t pos) {
+  LazyData *d = (LazyData *)p->data;
+
+  // resolved grammars skip the thunk and the ref juggling entirely
+  if (d->target)
+    return parser_run(d->target, ctx, pos);
+
+  Parser *inner = lazy_resolve(p, ctx->L);
+  if (!inner)
+    return parse_err(pos);
+
+  ParseResult r = parser_run(inner, ctx, pos);
 
   parser_unref(inner);
   return r;
@@ -606,499 +1274,5262 @@ static ParseResult lazy_parse(Parser *p, const char *input) {
 
 static void lazy_destroy(Parser *p) {
   LazyData *d = (LazyData *)p->data;
-  if (d) {
-    if (d->func_ref != LUA_NOREF) {
-      luaL_unref(p->L, LUA_REGISTRYINDEX, d->func_ref);
-    }
-    free(d);
+  if (d->func_ref != LUA_NOREF) {
+    luaL_unref(p->L, LUA_REGISTRYINDEX, d->func_ref);
   }
+  if (d->target)
+    parser_release(p->arena, d->target);
 }
 
-static Parser *make_lazy(lua_State *L, int func_ref) {
-  LazyData *d = (LazyData *)malloc(sizeof(LazyData));
+static Parser *make_lazy(lua_State *L, int func_ref, int once) {
+  Parser *p = parser_new(P_LAZY, lazy_parse, lazy_destroy, sizeof(LazyData), L);
+  LazyData *d = (LazyData *)p->data;
   d->func_ref = func_ref;
+  d->once = once;
+  d->target = NULL;
 
-  return parser_new(P_LAZY, lazy_parse, lazy_destroy, d, L);
+  return p;
 }
 
-static ParseResult custom_parse(Parser *p, const char *input) {
+static ParseResult custom_parse(Parser *p, ParseContext *ctx, size_t pos) {
   CustomData *d = (CustomData *)p->data;
-  lua_State *L = p->L;
+  lua_State *L = ctx->L;
+
+  if (d->positional) {
+    // streamed input only becomes a Lua string when someone asks for it
+    if (lua_isnil(L, ctx->input_idx)) {
+      lua_pushlstring(L, ctx->in.base, ctx->in.len);
+      lua_replace(L, ctx->input_idx);
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, d->func_ref);
+    lua_pushvalue(L, ctx->input_idx);
+    lua_pushinteger(L, (lua_Integer)pos + 1);
+    if (lua_pcall(L, 2, 2, 0) != LUA_OK) {
+      const char *err = lua_tostring(L, -1);
+      fprintf(stderr, "custom parser error: %s\n", err ? err : "(unknown)");
+      lua_pop(L, 1);
+
+      return parse_err(pos);
+    }
+
+    // a missing or out of range position means the parser failed
+    int isnum;
+    lua_Integer next = lua_tointegerx(L, -1, &isnum);
+    if (!isnum || next < (lua_Integer)pos + 1 ||
+        next > (lua_Integer)ctx->in.len + 1) {
+      lua_pop(L, 2);
+      return parse_err(pos);
+    }
+    lua_pop(L, 1);
+
+    // it may have stopped only because the buffered input did
+    if (ctx->partial && (size_t)next - 1 == ctx->in.len) {
+      lua_pop(L, 1);
+      return parse_more(pos);
+    }
+
+    return parse_ok((size_t)next - 1);
+  }
+
+  size_t remaining = ctx->in.len - pos;
 
   lua_rawgeti(L, LUA_REGISTRYINDEX, d->func_ref);
-  lua_pushstring(L, input);
+  lua_pushlstring(L, ctx->in.base + pos, remaining);
   if (lua_pcall(L, 1, 2, 0) != LUA_OK) {
     const char *err = lua_tostring(L, -1);
     fprintf(stderr, "unable to create a new parser: %s\n",
             err ? err : "(unknown)");
     lua_pop(L, 1);
 
-    return parse_err(input);
+    return parse_err(pos);
   }
 
-  const char *out = lua_tostring(L, -2);
-  const char *rest = lua_tostring(L, -1);
+  // the function hands back the unconsumed suffix of what it was given
+  size_t rest_len;
+  const char *rest = lua_tolstring(L, -1, &rest_len);
+  if (!rest || rest_len > remaining) {
+    lua_pop(L, 2);
+    return parse_err(pos);
+  }
   lua_pop(L, 1);
 
-  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (ctx->partial && rest_len == 0) {
+    lua_pop(L, 1);
+    return parse_more(pos);
+  }
 
-  return parse_ok(rest, ref);
+  return parse_ok(pos + (remaining - rest_len));
 }
 
-static Parser *make_custom(lua_State *L, int func_ref) {
-  CustomData *d = (CustomData *)malloc(sizeof(CustomData));
+static Parser *make_custom(lua_State *L, int func_ref, int positional) {
+  Parser *p = parser_new(P_CUSTOM, custom_parse, custom_destroy,
+                         sizeof(CustomData), L);
+  CustomData *d = (CustomData *)p->data;
   d->func_ref = func_ref;
+  d->positional = positional;
 
-  return parser_new(P_CUSTOM, custom_parse, custom_destroy, d, L);
+  return p;
 }
 
 static void custom_destroy(Parser *p) {
   CustomData *d = (CustomData *)p->data;
 
-  if (d) {
-    if (d->func_ref != LUA_NOREF) {
-      luaL_unref(p->L, LUA_REGISTRYINDEX, d->func_ref);
-    }
-    free(d);
+  if (d->func_ref != LUA_NOREF) {
+    luaL_unref(p->L, LUA_REGISTRYINDEX, d->func_ref);
   }
 }
 
-/* inspector */
+static ParseResult memo_parse(Parser *p, ParseContext *ctx, size_t pos) {
+  MemoData *d = (MemoData *)p->data;
+  return memo_run(d->inner, ctx, pos);
+}
 
-static char *make_indent(int level) {
-  int n = level * 4;
+static void memo_destroy(Parser *p) {
+  MemoData *d = (MemoData *)p->data;
+  if (d->inner)
+    parser_release(p->arena, d->inner);
+}
 
-  if (n < 0)
-    n = 0;
+static Parser *make_memo(lua_State *L, Parser *inner) {
+  Parser *p = parser_new(P_MEMO, memo_parse, memo_destroy, sizeof(MemoData), L);
+  MemoData *d = (MemoData *)p->data;
+  d->inner = inner;
+  parser_hold(p->arena, d->inner);
+  return p;
+}
 
-  if (n > 63)
-    n = 63;
+/* ---------------------------
+   character classes
+   --------------------------- */
 
-  char *idnt = malloc(n + 1);
-  memset(idnt, ' ', n);
-  idnt[n] = '\0';
-  return idnt;
+// adds the bytes matched by a Lua class letter (%a, %d, %s, ...). Upper case
+// letters are the complement. Returns 0 if cl is not a class letter.
+static int charset_add_class(CharSet *cs, char cl) {
+  for (int c = 0; c < 256; c++) {
+    int in;
+    switch (tolower((unsigned char)cl)) {
+    case 'a':
+      in = isalpha(c);
+      break;
+    case 'c':
+      in = iscntrl(c);
+      break;
+    case 'd':
+      in = isdigit(c);
+      break;
+    case 'g':
+      in = isgraph(c);
+      break;
+    case 'l':
+      in = islower(c);
+      break;
+    case 'p':
+      in = ispunct(c);
+      break;
+    case 's':
+      in = isspace(c);
+      break;
+    case 'u':
+      in = isupper(c);
+      break;
+    case 'w':
+      in = isalnum(c);
+      break;
+    case 'x':
+      in = isxdigit(c);
+      break;
+    default:
+      return 0;
+    }
+
+    if (isupper((unsigned char)cl))
+      in = !in;
+    if (in)
+      charset_add(cs, (unsigned char)c);
+  }
+
+  return 1;
 }
 
-static char *inspect_literal(Parser *p, int indent) {
-  LiteralData *d = (LiteralData *)p->data;
-  char *ind = make_indent(indent);
-  const char *templ = "%sliteral(\"%s\")";
+// spec is a single class item ("%s", "x") or a bracketed set ("[^%d_-]")
+static int charset_parse(CharSet *cs, const char *spec, size_t len) {
+  memset(cs, 0, sizeof(CharSet));
+  if (len == 0)
+    return 0;
+
+  if (spec[0] != '[') {
+    if (spec[0] == '%') {
+      if (len != 2)
+        return 0;
+      if (!charset_add_class(cs, spec[1]))
+        charset_add(cs, (unsigned char)spec[1]);
+      return 1;
+    }
 
-  int size = snprintf(NULL, 0, templ, ind, d->lit) + 1;
-  char *buff = malloc(size);
+    if (len != 1)
+      return 0;
+    charset_add(cs, (unsigned char)spec[0]);
+    return 1;
+  }
 
-  if (buff == NULL) {
-    free(ind);
-    return NULL;
+  size_t i = 1;
+  int negate = 0;
+  if (i < len && spec[i] == '^') {
+    negate = 1;
+    i++;
   }
 
-  snprintf(buff, size, templ, ind, d->lit);
+  // like Lua, a ']' right after the opening bracket is a literal
+  int first = 1;
+  while (i < len && (spec[i] != ']' || first)) {
+    first = 0;
+    unsigned char c = (unsigned char)spec[i];
+
+    if (c == '%') {
+      if (i + 1 >= len)
+        return 0;
+      if (!charset_add_class(cs, spec[i + 1]))
+        charset_add(cs, (unsigned char)spec[i + 1]);
+      i += 2;
+    } else if (i + 2 < len && spec[i + 1] == '-' && spec[i + 2] != ']') {
+      for (unsigned int r = c; r <= (unsigned char)spec[i + 2]; r++)
+        charset_add(cs, (unsigned char)r);
+      i += 3;
+    } else {
+      charset_add(cs, c);
+      i++;
+    }
+  }
 
-  return buff;
+  // unterminated set, or trailing bytes after the closing bracket
+  if (i != len - 1)
+    return 0;
+
+  if (negate) {
+    for (int b = 0; b < 32; b++)
+      cs->bits[b] = (unsigned char)~cs->bits[b];
+  }
+
+  return 1;
 }
 
-static char *inspect_any_char(Parser *p, int indent) {
-  (void)p;
-  char *ind = make_indent(indent);
-  int size = snprintf(NULL, 0, "%sany_char()", ind);
-  char *buff = malloc(size);
+static ParseResult char_class_parse(Parser *p, ParseContext *ctx,
+                                    size_t pos) {
+  CharClassData *d = (CharClassData *)p->data;
 
-  if (buff == NULL) {
-    free(ind);
-    return NULL;
-  }
+  if (pos >= ctx->in.len)
+    return ctx->partial ? parse_more(pos) : parse_err(pos);
+  if (!charset_has(&d->set, (unsigned char)ctx->in.base[pos]))
+    return parse_err(pos);
 
-  return buff;
+  lua_pushlstring(ctx->L, ctx->in.base + pos, 1);
+  return parse_ok(pos + 1);
 }
 
-static char *inspect_binary(const char *name, Parser *left, Parser *right,
-                            int indent) {
-  char *ind = make_indent(indent);
-  char *left_str = inspect_parser(left, indent + 1);
-  char *right_str = inspect_parser(right, indent + 1);
-  const char *templ = "%s%s(\n%s\n%s\n%s)";
+static Parser *make_char_class(lua_State *L, const CharSet *set,
+                               const char *spec) {
+  size_t n = strlen(spec) + 1;
+  Parser *p = parser_new(P_CHAR_CLASS, char_class_parse, NULL,
+                         sizeof(CharClassData) + n, L);
+  CharClassData *d = (CharClassData *)p->data;
+  d->set = *set;
+  memcpy(d->spec, spec, n);
+  return p;
+}
 
-  int size = snprintf(NULL, 0, templ, ind, name, left_str, right_str, ind) + 1;
+static ParseResult take_while_parse(Parser *p, ParseContext *ctx,
+                                    size_t pos) {
+  TakeWhileData *d = (TakeWhileData *)p->data;
+  size_t n = scan_while(&d->set, &d->plan, ctx->in.base + pos,
+                        ctx->in.len - pos);
 
-  char *buff = malloc(size);
-  snprintf(buff, size, templ, ind, name, left_str, right_str, ind);
+  if (ctx->partial && n == ctx->in.len - pos)
+    return parse_more(pos);
 
-  free(ind);
-  free(left_str);
-  free(right_str);
+  if (n < d->min)
+    return parse_err(pos);
 
-  return buff;
+  lua_pushlstring(ctx->L, ctx->in.base + pos, n);
+  return parse_ok(pos + n);
 }
 
-static char *inspect_pair(Parser *p, int indent) {
-  PairData *d = (PairData *)p->data;
-  return inspect_binary("pair", d->left, d->right, indent);
+static Parser *make_take_while(lua_State *L, const CharSet *set,
+                               const char *spec, size_t min) {
+  size_t n = strlen(spec) + 1;
+  Parser *p = parser_new(P_TAKE_WHILE, take_while_parse, NULL,
+                         sizeof(TakeWhileData) + n, L);
+  TakeWhileData *d = (TakeWhileData *)p->data;
+  d->set = *set;
+  scan_plan(&d->plan, set);
+  memcpy(d->spec, spec, n);
+  d->min = min;
+  return p;
 }
 
-static char *inspect_take_after(Parser *p, int indent) {
-  TakeAfterData *d = (TakeAfterData *)p->data;
-  return inspect_binary("take_after", d->left, d->right, indent);
-}
+static ParseResult take_until_parse(Parser *p, ParseContext *ctx,
+                                    size_t pos) {
+  TakeUntilData *d = (TakeUntilData *)p->data;
+  size_t remaining = ctx->in.len - pos;
+  size_t at = scan_find(ctx->in.base + pos, remaining, d->mark, d->len);
 
-static char *inspect_drop_for(Parser *p, int indent) {
-  DropForData *d = (DropForData *)p->data;
-  return inspect_binary("drop_for", d->left, d->right, indent);
+  if (at == remaining && d->len > 0)
+    return ctx->partial ? parse_more(pos) : parse_err(pos);
+
+  size_t n = d->inclusive ? at + d->len : at;
+  lua_pushlstring(ctx->L, ctx->in.base + pos, n);
+  return parse_ok(pos + n);
 }
 
-static char *inspect_or_else(Parser *p, int indent) {
-  OrData *d = (OrData *)p->data;
-  return inspect_binary("or_else", d->left, d->right, indent);
+static Parser *make_take_until(lua_State *L, const char *mark, size_t len,
+                               int inclusive) {
+  Parser *p = parser_new(P_TAKE_UNTIL, take_until_parse, NULL,
+                         sizeof(TakeUntilData) + len + 1, L);
+  TakeUntilData *d = (TakeUntilData *)p->data;
+  memcpy(d->mark, mark, len);
+  d->mark[len] = '\0';
+  d->len = len;
+  d->inclusive = inclusive;
+  return p;
 }
 
-static char *inspect_one_or_more(Parser *p, int indent) {
-  RepData *d = (RepData *)p->data;
+/* ---------------------------
+   keyword trie
+   --------------------------- */
 
-  char *ind = make_indent(indent);
-  char *inner = inspect_parser(d->inner, indent + 1);
-  const char *templ = "%sone_or_more(\n%s\n%s)";
+// one pass over the input from pos, remembering the best word ending on the
+// way. Returns 1 with the word and where it ends, 0 if no keyword matches
+// and -1 if a partial input ran out before that was decided
+static int one_of_match(const OneOfData *d, const Input *in, size_t pos,
+                        int partial, int *word, size_t *end) {
+  const unsigned char *s = (const unsigned char *)in->base;
+  const TrieNode *n = &d->nodes[0];
+  int best = n->word;
+  size_t best_end = pos;
+
+  size_t i = pos;
+  while (n->nedges > 0) {
+    if (i == in->len) {
+      if (partial)
+        return -1;
+      break;
+    }
 
-  int size = snprintf(NULL, 0, templ, ind, inner, ind) + 1;
+    const TrieEdge *e = &ONE_OF_EDGES(d)[n->first_edge];
+    const TrieEdge *last = e + n->nedges;
+    while (e < last && e->byte < s[i])
+      e++;
+    if (e == last || e->byte != s[i])
+      break;
 
-  char *buff = malloc(size);
-  if (!buff) {
-    free(ind);
-    free(inner);
-    return NULL;
+    n = &d->nodes[e->child];
+    i++;
+
+    if (n->word >= 0 && (d->longest || best < 0 || n->word < best)) {
+      best = n->word;
+      best_end = i;
+    }
   }
-  snprintf(buff, size, templ, ind, inner, ind);
 
-  free(ind);
-  free(inner);
+  *word = best;
+  *end = best_end;
+  return best >= 0;
+}
 
-  return buff;
+// the matched keyword, or the value mapped to it
+static void one_of_push(lua_State *L, const OneOfData *d, const Input *in,
+                        size_t pos, int word, size_t end) {
+  if (d->values_ref == LUA_NOREF) {
+    lua_pushlstring(L, in->base + pos, end - pos);
+    return;
+  }
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, d->values_ref);
+  lua_rawgeti(L, -1, word + 1);
+  lua_remove(L, -2);
 }
 
-static char *inspect_zero_or_more(Parser *p, int indent) {
-  RepData *d = (RepData *)p->data;
+static ParseResult one_of_parse(Parser *p, ParseContext *ctx, size_t pos) {
+  OneOfData *d = (OneOfData *)p->data;
+  int word;
+  size_t end;
 
-  char *ind = make_indent(indent);
-  char *inner = inspect_parser(d->inner, indent + 1);
-  const char *templ = "%szero_or_more(\n%s\n%s)";
+  int m = one_of_match(d, &ctx->in, pos, ctx->partial, &word, &end);
+  if (m < 0)
+    return parse_more(pos);
+  if (m == 0)
+    return parse_err(pos);
 
-  int size = snprintf(NULL, 0, templ, ind, inner, ind) + 1;
+  one_of_push(ctx->L, d, &ctx->in, pos, word, end);
+  return parse_ok(end);
+}
 
-  char *buff = malloc(size);
-  if (!buff) {
-    free(ind);
-    free(inner);
-    return NULL;
+static void one_of_destroy(Parser *p) {
+  OneOfData *d = (OneOfData *)p->data;
+  if (d->values_ref != LUA_NOREF && p->L)
+    luaL_unref(p->L, LUA_REGISTRYINDEX, d->values_ref);
+}
+
+static int trie_word_cmp(const void *a, const void *b) {
+  const TrieWord *x = (const TrieWord *)a;
+  const TrieWord *y = (const TrieWord *)b;
+  size_t n = x->len < y->len ? x->len : y->len;
+
+  int c = memcmp(x->s, y->s, n);
+  if (c != 0)
+    return c;
+  if (x->len != y->len)
+    return x->len < y->len ? -1 : 1;
+  return x->id - y->id;
+}
+
+// words[lo, hi) are sorted and share their first depth bytes. Each node's
+// edges are laid out together before its children are built
+static int trie_build(TrieBuild *b, int lo, int hi, size_t depth) {
+  int id = b->nnodes++;
+  TrieNode *n = &b->nodes[id];
+  n->word = -1;
+
+  // words ending here sort first, a duplicate keeps its earliest id
+  while (lo < hi && b->words[lo].len == depth) {
+    if (n->word < 0)
+      n->word = b->words[lo].id;
+    lo++;
   }
 
-  snprintf(buff, size, templ, ind, inner, ind);
+  int nkids = 0;
+  for (int i = lo; i < hi; nkids++) {
+    unsigned char c = (unsigned char)b->words[i].s[depth];
+    while (i < hi && (unsigned char)b->words[i].s[depth] == c)
+      i++;
+  }
 
-  free(ind);
-  free(inner);
+  n->first_edge = b->nedges;
+  n->nedges = nkids;
+  b->nedges += nkids;
 
-  return buff;
-}
+  int e = n->first_edge;
+  for (int i = lo; i < hi; e++) {
+    unsigned char c = (unsigned char)b->words[i].s[depth];
+    int j = i;
+    while (j < hi && (unsigned char)b->words[j].s[depth] == c)
+      j++;
 
-static char *inspect_unary_with_func(const char *name, Parser *inner,
-                                     int indent) {
-  char *ind = make_indent(indent);
-  const char *templ = "%s%s(<function>\n%s%s\n)";
-  char *inner_str = inspect_parser(inner, indent + 1);
+    b->edges[e].byte = c;
+    b->edges[e].child = trie_build(b, i, j, depth + 1);
+    i = j;
+  }
 
-  int size = snprintf(NULL, 0, templ, ind, name, ind, inner_str) + 1;
-  char *buff = malloc(size);
-  if (!buff) {
-    free(ind);
-    free(inner_str);
-    return NULL;
+  return id;
+}
+
+static Parser *make_one_of(lua_State *L, TrieWord *words, int nwords,
+                           int longest, int values_ref) {
+  size_t total = 0;
+  for (int i = 0; i < nwords; i++)
+    total += words[i].len;
+
+  TrieBuild b;
+  b.words = words;
+  b.nnodes = 0;
+  b.nedges = 0;
+  b.nodes = (TrieNode *)malloc(sizeof(TrieNode) * (total + 1));
+  b.edges = (TrieEdge *)malloc(sizeof(TrieEdge) * (total + 1));
+  if (!b.nodes || !b.edges) {
+    perror("malloc");
+    exit(1);
   }
 
-  snprintf(buff, size, templ, ind, name, ind, inner_str);
+  qsort(words, nwords, sizeof(TrieWord), trie_word_cmp);
+  trie_build(&b, 0, nwords, 0);
+
+  // nodes and edges live inline behind the header
+  Parser *p = parser_new(P_ONE_OF, one_of_parse, one_of_destroy,
+                         sizeof(OneOfData) + sizeof(TrieNode) * b.nnodes +
+                             sizeof(TrieEdge) * b.nedges,
+                         L);
+  OneOfData *d = (OneOfData *)p->data;
+  d->nwords = nwords;
+  d->nnodes = b.nnodes;
+  d->nedges = b.nedges;
+  d->longest = longest;
+  d->values_ref = values_ref;
+  memcpy(d->nodes, b.nodes, sizeof(TrieNode) * b.nnodes);
+  memcpy((TrieEdge *)ONE_OF_EDGES(d), b.edges, sizeof(TrieEdge) * b.nedges);
+
+  free(b.nodes);
+  free(b.edges);
+  return p;
+}
 
-  free(ind);
-  free(inner_str);
+/* ---------------------------
+   cut
+   --------------------------- */
 
-  return buff;
-  return strdup("mappp");
+static ParseResult cut_parse(Parser *p, ParseContext *ctx, size_t pos) {
+  CutData *d = (CutData *)p->data;
+
+  ParseResult r = parser_run(d->inner, ctx, pos);
+  if (!r.ok)
+    return r;
+
+  ctx->cut = 1;
+  if (ctx->memo)
+    memo_trim(ctx->memo, r.pos);
+  return r;
 }
 
-static char *inspect_pred(Parser *p, int indent) {
-  PredData *d = (PredData *)p->data;
-  return inspect_unary_with_func("pred", d->inner, indent);
+static void cut_destroy(Parser *p) {
+  CutData *d = (CutData *)p->data;
+  if (d->inner)
+    parser_release(p->arena, d->inner);
 }
 
-static char *inspect_map(Parser *p, int indent) {
-  MapData *d = (MapData *)p->data;
-  return inspect_unary_with_func("map", d->inner, indent);
+static Parser *make_cut(lua_State *L, Parser *inner) {
+  Parser *p = parser_new(P_CUT, cut_parse, cut_destroy, sizeof(CutData), L);
+  CutData *d = (CutData *)p->data;
+  d->inner = inner;
+  parser_hold(p->arena, inner);
+  return p;
 }
 
-static char *inspect_and_then(Parser *p, int indent) {
-  AndThenData *d = (AndThenData *)p->data;
-  return inspect_unary_with_func("and_then", d->inner, indent);
+/* ---------------------------
+   label
+   --------------------------- */
+
+static ParseResult label_parse(Parser *p, ParseContext *ctx, size_t pos) {
+  LabelData *d = (LabelData *)p->data;
+  ParseError *e = &ctx->err;
+  size_t before = e->pos;
+  int n = e->n;
+
+  ParseResult r = parser_run(d->inner, ctx, pos);
+  if (r.ok || r.more)
+    return r;
+
+  // drop what the inner parsers expected here, unless they got further
+  if (e->pos == pos)
+    e->n = before == pos ? n : 0;
+  parse_expect(ctx, pos, p);
+  return r;
 }
 
-static char *inspect_lazy(Parser *p, int indent) {
-  LazyData *d = (LazyData *)p->data;
+static void label_destroy(Parser *p) {
+  LabelData *d = (LabelData *)p->data;
+  if (d->inner)
+    parser_release(p->arena, d->inner);
+}
 
-  char *ind = make_indent(indent);
-  const char *templ = "%slazy(<function>)\n";
+static Parser *make_label(lua_State *L, Parser *inner, const char *name,
+                          size_t len) {
+  Parser *p = parser_new(P_LABEL, label_parse, label_destroy,
+                         sizeof(LabelData) + len + 1, L);
+  LabelData *d = (LabelData *)p->data;
+  d->inner = inner;
+  parser_hold(p->arena, inner);
+  memcpy(d->name, name, len);
+  d->name[len] = '\0';
+  return p;
+}
 
-  int size = snprintf(NULL, 0, templ, ind) + 1;
+/* ---------------------------
+   expression parser
+   --------------------------- */
 
-  char *buff = malloc(size);
-  if (!buff) {
-    free(ind);
-    return NULL;
+// tries the prefix (or the infix and postfix) operators in order, returns
+// the index of the first that matched or asked for more input, -1 if none
+static int expr_match(ExprData *d, ParseContext *ctx, size_t pos, int prefix,
+                      ParseResult *r) {
+  for (int i = 0; i < d->nops; i++) {
+    if ((d->ops[i].fixity == EXPR_PREFIX) != prefix)
+      continue;
+
+    *r = parser_try(d->ops[i].op, ctx, pos);
+    if (r->ok || r->more || r->cut)
+      return i;
   }
 
-  snprintf(buff, size, templ, ind);
-  free(ind);
+  return -1;
+}
 
-  return buff;
+// replaces lhs, op, rhs on top of the stack with fold(lhs, op, rhs), or
+// with {lhs, op, rhs} when there is no fold function
+static int expr_fold(ExprData *d, lua_State *L) {
+  if (d->fold_ref == LUA_NOREF) {
+    lua_createtable(L, 3, 0);
+    lua_insert(L, -4);
+    lua_rawseti(L, -4, 3);
+    lua_rawseti(L, -3, 2);
+    lua_rawseti(L, -2, 1);
+    return 1;
+  }
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, d->fold_ref);
+  lua_insert(L, -4);
+
+  if (lua_pcall(L, 3, 1, 0) != LUA_OK) {
+    const char *err = lua_tostring(L, -1);
+    fprintf(stderr, "expr fold error: %s\n", err ? err : "(unknown)");
+    lua_pop(L, 1);
+    return 0;
+  }
+
+  return 1;
 }
 
-static char *inspect_parser(Parser *p, int indent) {
-  // TODO: could crash if recursive combinators are used
-  // we don't detect cycles yet.
+// precedence climbing: parses an operand and then every operator binding at
+// least as tight as min_prec, leaving the folded value on the stack
+static ParseResult expr_climb(Parser *p, ParseContext *ctx, size_t pos,
+                              int min_prec) {
+  ExprData *d = (ExprData *)p->data;
+  lua_State *L = ctx->L;
+  ParseResult r;
 
-  lua_State *L = p->L;
-  if (L && p->lua_ref != LUA_NOREF) {
-    lua_rawgeti(L, LUA_REGISTRYINDEX, p->lua_ref);
+  luaL_checkstack(L, 6, "expression nesting too deep");
 
-    lua_getuservalue(L, -1);
-    lua_getfield(L, -1, "inspect");
-    if (!lua_isnil(L, -1)) {
-      const char *inspect_str = lua_tostring(L, -1);
-      char *ind = make_indent(indent);
+  int i = expr_match(d, ctx, pos, 1, &r);
+  if (i >= 0) {
+    if (!r.ok)
+      return r;
 
-      int size = snprintf(NULL, 0, "%s%s", ind, inspect_str) + 1;
-      char *buff = malloc(size);
-      if (!buff) {
-        free(ind);
+    // stack: nil, op, operand
+    lua_pushnil(L);
+    lua_insert(L, -2);
+
+    ParseResult operand = expr_climb(p, ctx, r.pos, d->ops[i].prec);
+    if (!operand.ok) {
+      lua_pop(L, 2);
+      return operand;
+    }
+
+    if (!expr_fold(d, L))
+      return parse_err(pos);
+    r = operand;
+  } else {
+    r = parser_run(d->atom, ctx, pos);
+    if (!r.ok)
+      return r;
+  }
+
+  size_t cur = r.pos;
+
+  while (1) {
+    i = expr_match(d, ctx, cur, 0, &r);
+    if (i < 0)
+      break;
+
+    if (!r.ok) {
+      lua_pop(L, 1);
+      return r;
+    }
+
+    ExprOp *op = &d->ops[i];
+    if (op->prec < min_prec) {
+      lua_pop(L, 1);
+      break;
+    }
+
+    if (op->fixity == EXPR_POSTFIX) {
+      // an operator that consumes nothing would repeat forever
+      if (r.pos == cur) {
+        lua_pop(L, 1);
+        break;
       }
 
-      snprintf(buff, size, "%s%s", ind, inspect_str);
-      free(ind);
+      lua_pushnil(L);
+      if (!expr_fold(d, L))
+        return parse_err(pos);
+      cur = r.pos;
+      continue;
+    }
 
-      lua_pop(L, 3); // inspect, uservalue, userdata
-      return buff;
+    // the operand is tried like a choice, it may be left unparsed
+    int outer = ctx->cut;
+    ctx->cut = 0;
+    ParseResult rhs = expr_climb(p, ctx, r.pos, op->right ? op->prec
+                                                           : op->prec + 1);
+    if (!rhs.ok && ctx->cut)
+      rhs.cut = 1;
+    ctx->cut |= outer;
+
+    if (rhs.more || rhs.cut) {
+      lua_pop(L, 2);
+      return rhs;
     }
-    lua_pop(L, 3);
+
+    // an operator without an operand after it is left unparsed
+    if (!rhs.ok || rhs.pos == cur) {
+      lua_pop(L, rhs.ok ? 2 : 1);
+      break;
+    }
+
+    if (!expr_fold(d, L))
+      return parse_err(pos);
+    cur = rhs.pos;
   }
 
+  return parse_ok(cur);
+}
+
+static ParseResult expr_parse(Parser *p, ParseContext *ctx, size_t pos) {
+  return expr_climb(p, ctx, pos, INT_MIN);
+}
+
+static void expr_destroy(Parser *p) {
+  ExprData *d = (ExprData *)p->data;
+  if (d->fold_ref != LUA_NOREF && p->L)
+    luaL_unref(p->L, LUA_REGISTRYINDEX, d->fold_ref);
+  if (d->atom)
+    parser_release(p->arena, d->atom);
+  for (int i = 0; i < d->nops; i++)
+    parser_release(p->arena, d->ops[i].op);
+}
+
+// the operators are filled in by the caller
+static Parser *make_expr(lua_State *L, Parser *atom, int fold_ref, int nops) {
+  Parser *p = parser_new(P_EXPR, expr_parse, expr_destroy,
+                         sizeof(ExprData) + sizeof(ExprOp) * nops, L);
+  ExprData *d = (ExprData *)p->data;
+
+  d->atom = atom;
+  parser_hold(p->arena, atom);
+
+  d->fold_ref = fold_ref;
+  return p;
+}
+
+/* ---------------------------
+   FIRST sets
+   --------------------------- */
+
+// deep enough for real grammars, and it stops left recursion through lazy
+#define FIRST_MAX_DEPTH 16
+
+// adds to out the bytes p can start a match with, nullable parsers included.
+// Sequences only look past their left side when it is nullable.
+static FirstKind first_set(Parser *p, lua_State *L, CharSet *out, int depth) {
+  if (depth > FIRST_MAX_DEPTH)
+    return FIRST_UNKNOWN;
+
+  Parser *kids[2];
+  int n = parser_children(p, kids);
+
   switch (p->kind) {
-  case P_LITERAL:
-    return inspect_literal(p, indent);
+  case P_LITERAL: {
+    LiteralData *d = (LiteralData *)p->data;
+    if (d->len == 0)
+      return FIRST_NULLABLE;
+    charset_add(out, (unsigned char)d->lit[0]);
+    return FIRST_CONSUMES;
+  }
+
   case P_ANY_CHAR:
-    return inspect_any_char(p, indent);
+    memset(out->bits, 0xFF, sizeof(out->bits));
+    return FIRST_CONSUMES;
+
+  case P_CHAR_CLASS: {
+    CharClassData *d = (CharClassData *)p->data;
+    for (int b = 0; b < 32; b++)
+      out->bits[b] |= d->set.bits[b];
+    return FIRST_CONSUMES;
+  }
 
-  case P_PAIR:
-    return inspect_pair(p, indent);
-  case P_OR_ELSE:
-    return inspect_or_else(p, indent);
-  case P_TAKE_AFTER:
-    return inspect_take_after(p, indent);
-  case P_DROP_FOR:
-    return inspect_drop_for(p, indent);
+  case P_TAKE_WHILE: {
+    TakeWhileData *d = (TakeWhileData *)p->data;
+    for (int b = 0; b < 32; b++)
+      out->bits[b] |= d->set.bits[b];
+    return d->min == 0 ? FIRST_NULLABLE : FIRST_CONSUMES;
+  }
+
+  case P_TAKE_UNTIL: {
+    // anything can come before the marker, but it must be there
+    TakeUntilData *d = (TakeUntilData *)p->data;
+    memset(out->bits, 0xFF, sizeof(out->bits));
+    if (!d->inclusive || d->len == 0)
+      return FIRST_NULLABLE;
+    return FIRST_CONSUMES;
+  }
 
   case P_MAP:
-    return inspect_map(p, indent);
-  case P_AND_THEN:
-    return inspect_and_then(p, indent);
   case P_PRED:
-    return inspect_pred(p, indent);
-
+  case P_MEMO:
   case P_ONE_OR_MORE:
-    return inspect_one_or_more(p, indent);
+  case P_COMPILED:
+  case P_LABEL:
+  case P_CUT:
+    return first_set(kids[0], L, out, depth + 1);
+
   case P_ZERO_OR_MORE:
-    return inspect_zero_or_more(p, indent);
+    if (first_set(kids[0], L, out, depth + 1) == FIRST_UNKNOWN)
+      return FIRST_UNKNOWN;
+    return FIRST_NULLABLE;
+
+  case P_RECOGNIZE:
+    return first_set(kids[0], L, out, depth + 1);
+
+  case P_MANY_CONCAT: {
+    FirstKind k = first_set(kids[0], L, out, depth + 1);
+    if (k == FIRST_UNKNOWN || ((SpanData *)p->data)->min > 0)
+      return k;
+    return FIRST_NULLABLE;
+  }
+
+  case P_AND_THEN:
+    // the parser the callback returns is only known at parse time
+    if (first_set(kids[0], L, out, depth + 1) == FIRST_CONSUMES)
+      return FIRST_CONSUMES;
+    return FIRST_UNKNOWN;
+
+  case P_PAIR:
+  case P_TAKE_AFTER:
+  case P_DROP_FOR: {
+    FirstKind k = first_set(kids[0], L, out, depth + 1);
+    if (k != FIRST_NULLABLE)
+      return k;
+    return first_set(kids[1], L, out, depth + 1);
+  }
+
+  case P_OR_ELSE: {
+    FirstKind a = first_set(kids[0], L, out, depth + 1);
+    FirstKind b = first_set(kids[1], L, out, depth + 1);
+    return a > b ? a : b;
+  }
+
+  case P_ONE_OF: {
+    OneOfData *d = (OneOfData *)p->data;
+    const TrieNode *root = &d->nodes[0];
+    for (int i = 0; i < root->nedges; i++)
+      charset_add(out, ONE_OF_EDGES(d)[root->first_edge + i].byte);
+    return root->word >= 0 ? FIRST_NULLABLE : FIRST_CONSUMES;
+  }
+
+  case P_EXPR: {
+    // an expression starts with its atom or a prefix operator
+    ExprData *d = (ExprData *)p->data;
+    FirstKind k = first_set(d->atom, L, out, depth + 1);
+    for (int i = 0; i < d->nops; i++) {
+      if (d->ops[i].fixity != EXPR_PREFIX)
+        continue;
+      FirstKind o = first_set(d->ops[i].op, L, out, depth + 1);
+      if (o > k)
+        k = o;
+    }
+    return k;
+  }
+
+  case P_SEP_BY: {
+    FirstKind k = first_set(kids[0], L, out, depth + 1);
+    if (k == FIRST_UNKNOWN || ((SepByData *)p->data)->min > 0)
+      return k;
+    return FIRST_NULLABLE;
+  }
+
+  case P_MANY_TILL: {
+    // the end is tried first, an item only where it fails
+    FirstKind k = first_set(kids[1], L, out, depth + 1);
+    if (first_set(kids[0], L, out, depth + 1) == FIRST_UNKNOWN)
+      return FIRST_UNKNOWN;
+    return k;
+  }
 
   case P_LAZY:
-    return inspect_lazy(p, indent);
+    if (n == 0 && ((LazyData *)p->data)->once)
+      parser_unref(lazy_resolve(p, L));
+    if (parser_children(p, kids) == 0)
+      return FIRST_UNKNOWN;
+    return first_set(kids[0], L, out, depth + 1);
+
   default:
-    return strdup("unknow");
+    return FIRST_UNKNOWN;
   }
 }
 
 /* ---------------------------
-   Lua userdata helpers
+   grammar compiler
    --------------------------- */
 
-static Parser *check_parser_ud(lua_State *L, int idx) {
-  Parser **ud = (Parser **)luaL_checkudata(L, idx, "Parser");
-  if (!ud)
-    luaL_error(L, "expected Parser userdata");
-  return *ud;
+static int parser_children(Parser *p, Parser **out) {
+  switch (p->kind) {
+  case P_MAP:
+    out[0] = ((MapData *)p->data)->inner;
+    return 1;
+  case P_AND_THEN:
+    out[0] = ((AndThenData *)p->data)->inner;
+    return 1;
+  case P_PRED:
+    out[0] = ((PredData *)p->data)->inner;
+    return 1;
+  case P_ONE_OR_MORE:
+  case P_ZERO_OR_MORE:
+    out[0] = ((RepData *)p->data)->inner;
+    return 1;
+  case P_MEMO:
+    out[0] = ((MemoData *)p->data)->inner;
+    return 1;
+  case P_LABEL:
+    out[0] = ((LabelData *)p->data)->inner;
+    return 1;
+  case P_CUT:
+    out[0] = ((CutData *)p->data)->inner;
+    return 1;
+  case P_RECOGNIZE:
+  case P_MANY_CONCAT:
+    out[0] = ((SpanData *)p->data)->inner;
+    return 1;
+  case P_OR_ELSE:
+    out[0] = ((OrData *)p->data)->left;
+    out[1] = ((OrData *)p->data)->right;
+    return 2;
+  case P_TAKE_AFTER:
+    out[0] = ((TakeAfterData *)p->data)->left;
+    out[1] = ((TakeAfterData *)p->data)->right;
+    return 2;
+  case P_DROP_FOR:
+    out[0] = ((DropForData *)p->data)->left;
+    out[1] = ((DropForData *)p->data)->right;
+    return 2;
+  case P_PAIR:
+    out[0] = ((PairData *)p->data)->left;
+    out[1] = ((PairData *)p->data)->right;
+    return 2;
+  case P_SEP_BY:
+    out[0] = ((SepByData *)p->data)->item;
+    out[1] = ((SepByData *)p->data)->sep;
+    return 2;
+  case P_MANY_TILL:
+    out[0] = ((ManyTillData *)p->data)->inner;
+    out[1] = ((ManyTillData *)p->data)->end;
+    return 2;
+  case P_LAZY:
+    out[0] = ((LazyData *)p->data)->target;
+    return out[0] ? 1 : 0;
+  case P_COMPILED:
+    out[0] = ((CompiledData *)p->data)->source;
+    return 1;
+  default:
+    return 0;
+  }
 }
 
-static void push_parser_ud(lua_State *L, Parser *p) {
-  Parser **ud = (Parser **)lua_newuserdata(L, sizeof(Parser *));
-  *ud = p;
-  // userdata owns a ref of parser
-  parser_ref(p); // increment for userdata owner
-  luaL_getmetatable(L, "Parser");
-  lua_setmetatable(L, -2);
+/* every node the compiler has seen, keyed by address. Shared subtrees and
+   lazy targets are emitted once as subroutines, everything else inline */
+typedef struct {
+  Parser *node; // NULL marks an empty slot
+  int uses;
+  int sub;   // always emit as a subroutine (lazy targets may recurse)
+  int entry; // subroutine address, -1 until emitted
+} CompileSlot;
+
+typedef struct {
+  lua_State *L;
+  Program *prog;
+  int code_cap;
+  size_t consts_cap;
+  int classes_cap;
+  int nodes_cap;
+  int funcs_cap;
+  int switches_cap;
+  int tries_cap;
+
+  CompileSlot *slots;
+  size_t slots_cap; // always a power of two
+  size_t slots_count;
+
+  int depth; // values the current subroutine body holds on the Lua stack
+  int max_depth;
+} Compiler;
+
+static void *compile_grow(void *buf, int *cap, int need, size_t elem) {
+  if (need <= *cap)
+    return buf;
+
+  int n = *cap ? *cap * 2 : 16;
+  while (n < need)
+    n *= 2;
+
+  buf = realloc(buf, (size_t)n * elem);
+  if (!buf) {
+    perror("realloc");
+    exit(1);
+  }
+
+  *cap = n;
+  return buf;
+}
+
+static CompileSlot *compile_slot(Compiler *c, Parser *p) {
+  size_t mask = c->slots_cap - 1;
+  size_t i = ((size_t)(uintptr_t)p * 0x9E3779B97F4A7C15ull >> 16) & mask;
+
+  while (c->slots[i].node && c->slots[i].node != p)
+    i = (i + 1) & mask;
+
+  return &c->slots[i];
+}
+
+static CompileSlot *compile_slot_add(Compiler *c, Parser *p) {
+  if ((c->slots_count + 1) * 2 > c->slots_cap) {
+    CompileSlot *old = c->slots;
+    size_t old_cap = c->slots_cap;
+
+    c->slots_cap *= 2;
+    c->slots = (CompileSlot *)calloc(c->slots_cap, sizeof(CompileSlot));
+    if (!c->slots) {
+      perror("calloc");
+      exit(1);
+    }
+
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old[i].node)
+        *compile_slot(c, old[i].node) = old[i];
+    }
+    free(old);
+  }
+
+  CompileSlot *s = compile_slot(c, p);
+  if (!s->node) {
+    s->node = p;
+    s->entry = -1;
+    c->slots_count++;
+  }
+
+  return s;
+}
+
+// first pass: resolve lazy nodes and count how often each node is reached
+static void compile_count(Compiler *c, Parser *p) {
+  CompileSlot *s = compile_slot_add(c, p);
+  if (s->uses++ > 0)
+    return;
+
+  if (p->kind == P_LAZY && ((LazyData *)p->data)->once) {
+    parser_unref(lazy_resolve(p, c->L));
+
+    Parser *target = ((LazyData *)p->data)->target;
+    if (target)
+      compile_slot_add(c, target)->sub = 1;
+  }
+
+  // memoized and compiled subtrees keep running as they are
+  if (p->kind == P_MEMO)
+    return;
+
+  Parser *kids[2];
+  int n = parser_children(p, kids);
+  for (int i = 0; i < n; i++)
+    compile_count(c, kids[i]);
+
+  // sep_by emits its item twice, a call keeps nested lists from doubling
+  if (p->kind == P_SEP_BY)
+    compile_slot(c, kids[0])->uses++;
+}
+
+static int compile_emit(Compiler *c, OpCode op, int aux, int arg, int push) {
+  Program *prog = c->prog;
+  int cap = c->code_cap;
+  prog->code = (Instr *)compile_grow(prog->code, &c->code_cap,
+                                     prog->ncode + 1, sizeof(Instr));
+  prog->origins = (Parser **)compile_grow(prog->origins, &cap,
+                                          prog->ncode + 1, sizeof(Parser *));
+  prog->origins[prog->ncode] = NULL;
+
+  Instr *in = &prog->code[prog->ncode];
+  in->op = (unsigned char)op;
+  in->flag = 0;
+  in->aux = aux;
+  in->arg = arg;
+
+  c->depth += push;
+  if (c->depth > c->max_depth)
+    c->max_depth = c->depth;
+
+  return prog->ncode++;
+}
+
+static int compile_const(Compiler *c, const char *s, size_t len) {
+  Program *prog = c->prog;
+
+  while (prog->nconsts + len > c->consts_cap) {
+    c->consts_cap = c->consts_cap ? c->consts_cap * 2 : 64;
+    prog->consts = (char *)realloc(prog->consts, c->consts_cap);
+    if (!prog->consts) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+
+  memcpy(prog->consts + prog->nconsts, s, len);
+  prog->nconsts += len;
+
+  return (int)(prog->nconsts - len);
+}
+
+static int compile_class(Compiler *c, const CharSet *set, size_t min) {
+  Program *prog = c->prog;
+  prog->classes = (VMClass *)compile_grow(prog->classes, &c->classes_cap,
+                                          prog->nclasses + 1, sizeof(VMClass));
+
+  VMClass *k = &prog->classes[prog->nclasses];
+  k->set = *set;
+  scan_plan(&k->plan, set);
+  k->min = min;
+
+  return prog->nclasses++;
+}
+
+static int compile_func(Compiler *c, int func_ref) {
+  Program *prog = c->prog;
+  prog->funcs = (int *)compile_grow(prog->funcs, &c->funcs_cap,
+                                    prog->nfuncs + 1, sizeof(int));
+
+  prog->funcs[prog->nfuncs] = func_ref;
+  return prog->nfuncs++;
+}
+
+static int compile_trie(Compiler *c, const OneOfData *d) {
+  Program *prog = c->prog;
+  prog->tries = (const OneOfData **)compile_grow(
+      prog->tries, &c->tries_cap, prog->ntries + 1, sizeof(OneOfData *));
+
+  prog->tries[prog->ntries] = d;
+  return prog->ntries++;
+}
+
+static int compile_fallback(Compiler *c, Parser *p) {
+  Program *prog = c->prog;
+  prog->nodes = (Parser **)compile_grow(prog->nodes, &c->nodes_cap,
+                                        prog->nnodes + 1, sizeof(Parser *));
+
+  parser_hold(arena_current(c->L), p);
+  prog->nodes[prog->nnodes] = p;
+  return compile_emit(c, OP_NODE, prog->nnodes++, 0, 1);
+}
+
+static void compile_node(Compiler *c, Parser *p);
+
+// an or_else chain becomes a jump on the next byte. Alternatives are emitted
+// once as subroutines and each distinct set of candidates gets a short
+// choice sequence calling them in order.
+static void compile_switch(Compiler *c, Parser *p, OrDispatch *t) {
+  Program *prog = c->prog;
+  int depth = c->depth;
+  int entry[OR_MAX_ALTS];
+
+  int skip = compile_emit(c, OP_JUMP, 0, 0, 0);
+  for (int i = 0; i < t->n; i++) {
+    entry[i] = prog->ncode;
+    c->depth = 0;
+    compile_node(c, t->alts[i]);
+    compile_emit(c, OP_RET, 0, 0, 0);
+  }
+  c->depth = depth;
+  prog->code[skip].arg = prog->ncode;
+
+  prog->switches = (VMSwitch *)compile_grow(
+      prog->switches, &c->switches_cap, prog->nswitches + 1, sizeof(VMSwitch));
+  int sw = prog->nswitches++;
+  compile_emit(c, OP_SWITCH, sw, 0, 0);
+
+  // jumps to the end of the chain, patched once it is known
+  int *ends = NULL;
+  int nends = 0;
+  int ends_cap = 0;
+
+  for (int at = 0; at < 257; at++) {
+    uint64_t mask = t->masks[at];
+
+    int same = -1;
+    for (int prev = 0; prev < at && same < 0; prev++) {
+      if (t->masks[prev] == mask)
+        same = prev;
+    }
+    if (same >= 0) {
+      prog->switches[sw].target[at] = prog->switches[sw].target[same];
+      continue;
+    }
+
+    prog->switches[sw].target[at] = prog->ncode;
+
+    for (uint64_t m = mask; m; m &= m - 1) {
+      int i = __builtin_ctzll(m);
+      ends = (int *)compile_grow(ends, &ends_cap, nends + 1, sizeof(int));
+
+      // the last alternative of the chain fails on its own terms
+      if (i == t->n - 1) {
+        compile_emit(c, OP_CALL, 0, entry[i], 0);
+        ends[nends++] = compile_emit(c, OP_JUMP, 0, 0, 0);
+        break;
+      }
+
+      int choice = compile_emit(c, OP_CHOICE, 0, 0, 0);
+      compile_emit(c, OP_CALL, 0, entry[i], 0);
+      ends[nends++] = compile_emit(c, OP_COMMIT, 0, 0, 0);
+      prog->code[choice].arg = prog->ncode;
+    }
+
+    // the byte tells which alternatives were skipped
+    if (!((mask >> (t->n - 1)) & 1))
+      prog->origins[compile_emit(c, OP_FAIL, 0, at, 0)] = p;
+  }
+
+  for (int i = 0; i < nends; i++)
+    prog->code[ends[i]].arg = prog->ncode;
+  free(ends);
+
+  c->depth = depth + 1;
+  if (c->depth > c->max_depth)
+    c->max_depth = c->depth;
+}
+
+static void compile_body(Compiler *c, Parser *p) {
+  Program *prog = c->prog;
+  Parser *kids[2];
+  parser_children(p, kids);
+
+  switch (p->kind) {
+  case P_LITERAL: {
+    LiteralData *d = (LiteralData *)p->data;
+    int off = compile_const(c, d->lit, d->len);
+    int at = compile_emit(c, OP_LITERAL, off, (int)d->len, 1);
+    prog->origins[at] = p;
+    break;
+  }
+
+  case P_ANY_CHAR:
+    prog->origins[compile_emit(c, OP_ANY_CHAR, 0, 0, 1)] = p;
+    break;
+
+  case P_CHAR_CLASS: {
+    CharClassData *d = (CharClassData *)p->data;
+    int at = compile_emit(c, OP_CHAR_CLASS, compile_class(c, &d->set, 1), 0, 1);
+    prog->origins[at] = p;
+    break;
+  }
+
+  case P_TAKE_WHILE: {
+    TakeWhileData *d = (TakeWhileData *)p->data;
+    int at =
+        compile_emit(c, OP_TAKE_WHILE, compile_class(c, &d->set, d->min), 0, 1);
+    prog->origins[at] = p;
+    break;
+  }
+
+  case P_TAKE_UNTIL: {
+    TakeUntilData *d = (TakeUntilData *)p->data;
+    int off = compile_const(c, d->mark, d->len);
+    int at = compile_emit(c, OP_TAKE_UNTIL, off, (int)d->len, 1);
+    prog->code[at].flag = (unsigned char)d->inclusive;
+    prog->origins[at] = p;
+    break;
+  }
+
+  case P_PAIR:
+    compile_node(c, kids[0]);
+    compile_node(c, kids[1]);
+    compile_emit(c, OP_PAIR, 0, 0, -1);
+    break;
+
+  case P_TAKE_AFTER:
+    compile_node(c, kids[0]);
+    compile_node(c, kids[1]);
+    compile_emit(c, OP_POP, 0, 0, -1);
+    break;
+
+  case P_DROP_FOR:
+    compile_node(c, kids[0]);
+    compile_node(c, kids[1]);
+    compile_emit(c, OP_NIP, 0, 0, -1);
+    break;
+
+  case P_OR_ELSE: {
+    OrData *d = (OrData *)p->data;
+    if (!d->dispatch)
+      d->dispatch = or_dispatch_build(p, c->L);
+    if (d->dispatch->n > 0) {
+      compile_switch(c, p, d->dispatch);
+      break;
+    }
+
+    int depth = c->depth;
+    int choice = compile_emit(c, OP_CHOICE, 0, 0, 0);
+    compile_node(c, kids[0]);
+    int commit = compile_emit(c, OP_COMMIT, 0, 0, 0);
+
+    c->depth = depth;
+    prog->code[choice].arg = prog->ncode;
+    compile_node(c, kids[1]);
+    prog->code[commit].arg = prog->ncode;
+    break;
+  }
+
+  case P_ZERO_OR_MORE:
+  case P_ONE_OR_MORE: {
+    compile_emit(c, OP_NEWTABLE, 0, 0, 1);
+    int choice = compile_emit(c, OP_CHOICE, 0, 0, 0);
+    compile_node(c, kids[0]);
+    compile_emit(c, OP_APPEND, 0, 0, -1);
+    compile_emit(c, OP_LOOP, 0, choice + 1, 0);
+    prog->code[choice].arg = prog->ncode;
+
+    if (p->kind == P_ONE_OR_MORE)
+      compile_emit(c, OP_NONEMPTY, 0, 0, 0);
+    break;
+  }
+
+  case P_CUT:
+    compile_node(c, kids[0]);
+    compile_emit(c, OP_CUT, 0, 0, 0);
+    break;
+
+  case P_ONE_OF: {
+    OneOfData *d = (OneOfData *)p->data;
+    int at = compile_emit(c, OP_ONE_OF, compile_trie(c, d), 0, 1);
+    prog->code[at].flag = d->values_ref != LUA_NOREF;
+    prog->origins[at] = p;
+    break;
+  }
+
+  case P_LABEL:
+    prog->origins[compile_emit(c, OP_LABEL, 0, 0, 0)] = p;
+    compile_node(c, kids[0]);
+    compile_emit(c, OP_UNLABEL, 0, 0, 0);
+    break;
+
+  case P_RECOGNIZE:
+    compile_emit(c, OP_MARK, 0, 0, 0);
+    compile_node(c, kids[0]);
+    compile_emit(c, OP_SPAN, 0, 0, 0);
+    break;
+
+  case P_MANY_CONCAT: {
+    compile_emit(c, OP_MARK, 0, 0, 0);
+    if (((SpanData *)p->data)->min > 0) {
+      compile_node(c, kids[0]);
+      compile_emit(c, OP_POP, 0, 0, -1);
+    }
+
+    int choice = compile_emit(c, OP_CHOICE, 0, 0, 0);
+    compile_node(c, kids[0]);
+    compile_emit(c, OP_POP, 0, 0, -1);
+    compile_emit(c, OP_LOOP, 0, choice + 1, 0);
+    prog->code[choice].arg = prog->ncode;
+
+    int at = compile_emit(c, OP_SPAN, 0, 0, 1);
+    prog->code[at].flag = 1;
+    break;
+  }
+
+  case P_SEP_BY: {
+    // item (sep item)*, the loop backtracks over a trailing separator
+    compile_emit(c, OP_NEWTABLE, 0, 0, 1);
+    int first = -1;
+    if (((SepByData *)p->data)->min == 0)
+      first = compile_emit(c, OP_CHOICE, 0, 0, 0);
+    compile_node(c, kids[0]);
+    compile_emit(c, OP_APPEND, 0, 0, -1);
+    if (first >= 0)
+      compile_emit(c, OP_COMMIT, 0, prog->ncode + 1, 0);
+
+    int choice = compile_emit(c, OP_CHOICE, 0, 0, 0);
+    compile_node(c, kids[1]);
+    compile_emit(c, OP_POP, 0, 0, -1);
+    compile_node(c, kids[0]);
+    compile_emit(c, OP_APPEND, 0, 0, -1);
+    compile_emit(c, OP_LOOP, 0, choice + 1, 0);
+
+    prog->code[choice].arg = prog->ncode;
+    if (first >= 0)
+      prog->code[first].arg = prog->ncode;
+    break;
+  }
+
+  case P_MANY_TILL: {
+    // the outer entry fails the node once neither the end nor an item
+    // matches, or an item stops consuming
+    compile_emit(c, OP_NEWTABLE, 0, 0, 1);
+    int outer = compile_emit(c, OP_CHOICE, 0, 0, 0);
+
+    int choice = compile_emit(c, OP_CHOICE, 0, 0, 0);
+    compile_node(c, kids[1]);
+    compile_emit(c, OP_POP, 0, 0, -1);
+    int done = compile_emit(c, OP_COMMIT, 0, 0, 0);
+
+    prog->code[choice].arg = prog->ncode;
+    compile_node(c, kids[0]);
+    compile_emit(c, OP_APPEND, 0, 0, -1);
+    compile_emit(c, OP_LOOP, 0, choice, 0);
+    compile_emit(c, OP_FAIL, 0, 0, 0);
+
+    prog->code[done].arg = prog->ncode;
+    int leave = compile_emit(c, OP_COMMIT, 0, 0, 0);
+    prog->code[outer].arg = compile_emit(c, OP_FAIL, 0, 0, 0);
+    prog->code[leave].arg = prog->ncode;
+    break;
+  }
+
+  case P_MAP:
+    compile_emit(c, OP_MARK, 0, 0, 0);
+    compile_node(c, kids[0]);
+    compile_emit(c, OP_MAP, compile_func(c, ((MapData *)p->data)->func_ref),
+                 0, 0);
+    break;
+
+  case P_PRED:
+    compile_emit(c, OP_MARK, 0, 0, 0);
+    compile_node(c, kids[0]);
+    compile_emit(c, OP_PRED, compile_func(c, ((PredData *)p->data)->func_ref),
+                 0, 0);
+    break;
+
+  case P_AND_THEN:
+    compile_emit(c, OP_MARK, 0, 0, 0);
+    compile_node(c, kids[0]);
+    compile_emit(c, OP_AND_THEN,
+                 compile_func(c, ((AndThenData *)p->data)->func_ref), 0, 0);
+    break;
+
+  case P_LAZY:
+    if (((LazyData *)p->data)->target)
+      compile_node(c, kids[0]);
+    else
+      compile_fallback(c, p);
+    break;
+
+  case P_COMPILED:
+    compile_node(c, kids[0]);
+    break;
+
+  default:
+    compile_fallback(c, p);
+  }
+}
+
+static void compile_node(Compiler *c, Parser *p) {
+  CompileSlot *s = compile_slot(c, p);
+  int leaf = p->kind == P_LITERAL || p->kind == P_ANY_CHAR ||
+             p->kind == P_CHAR_CLASS || p->kind == P_TAKE_WHILE ||
+             p->kind == P_TAKE_UNTIL || p->kind == P_ONE_OF;
+
+  if (!s->sub && (s->uses < 2 || leaf)) {
+    compile_body(c, p);
+    return;
+  }
+
+  if (s->entry < 0) {
+    // emitted in place, the jump skips over it
+    int jump = compile_emit(c, OP_JUMP, 0, 0, 0);
+    s->entry = c->prog->ncode;
+
+    int depth = c->depth;
+    c->depth = 0;
+    compile_body(c, p);
+    compile_emit(c, OP_RET, 0, 0, 0);
+    c->depth = depth;
+
+    c->prog->code[jump].arg = c->prog->ncode;
+  }
+
+  compile_emit(c, OP_CALL, 0, s->entry, 1);
+}
+
+static Parser *compile_parser(lua_State *L, Parser *root) {
+  Compiler c;
+  memset(&c, 0, sizeof(Compiler));
+
+  Program prog;
+  memset(&prog, 0, sizeof(Program));
+
+  c.L = L;
+  c.prog = &prog;
+  c.slots_cap = 64;
+  c.slots = (CompileSlot *)calloc(c.slots_cap, sizeof(CompileSlot));
+  if (!c.slots) {
+    perror("calloc");
+    exit(1);
+  }
+
+  compile_count(&c, root);
+  compile_node(&c, root);
+  compile_emit(&c, OP_END, 0, 0, 0);
+
+  // room for the transient callback and argument slots on top
+  prog.frame_slots = c.max_depth + 4;
+
+  free(c.slots);
+
+  Parser *p = parser_new(P_COMPILED, compiled_parse, compiled_destroy,
+                         sizeof(CompiledData), L);
+  CompiledData *d = (CompiledData *)p->data;
+  d->source = root;
+  d->prog = prog;
+  parser_hold(p->arena, root);
+  return p;
+}
+
+/* ---------------------------
+   VM
+   --------------------------- */
+
+#define VM_INIT_FRAMES 32
+
+#define VM_CALL_FRAME -1
+#define VM_MARK_FRAME -2
+#define VM_LABEL_FRAME -3
+
+typedef struct {
+  int alt;    // where to resume, the return address for call frames
+  int top;    // Lua stack top to rewind to, or one of the frame markers
+  int cut;    // ctx->cut when a choice was entered, for a label the
+              // expected count to go back to if it fails where it started
+  size_t pos; // input offset to rewind to
+} VMFrame;
+
+// a labeled parser failed, like label_parse; alt is where OP_LABEL is
+static void vm_label_failed(ParseContext *ctx, const Program *prog,
+                            const VMFrame *f) {
+  if (ctx->err.pos == f->pos)
+    ctx->err.n = f->cut;
+  parse_expect(ctx, f->pos, prog->origins[f->alt]);
+}
+
+// reports a failed callback the same way the tree interpreter does
+static void vm_callback_error(lua_State *L, OpCode op) {
+  const char *what = op == OP_MAP    ? "map callback"
+                     : op == OP_PRED ? "pred callback"
+                                     : "and_then callback";
+  const char *err = lua_tostring(L, -1);
+  fprintf(stderr, "%s error: %s\n", what, err ? err : "(unknown)");
+  lua_pop(L, 1);
+}
+
+static ParseResult vm_run(Program *prog, ParseContext *ctx, size_t pos) {
+  lua_State *L = ctx->L;
+  const Instr *code = prog->code;
+  const Instr *ip = code;
+  const char *s = ctx->in.base;
+  size_t len = ctx->in.len;
+  int base = lua_gettop(L);
+
+  VMFrame init[VM_INIT_FRAMES];
+  VMFrame *frames = init;
+  int nframes = 0;
+  int cap = VM_INIT_FRAMES;
+  int anchor = 0; // 1 once the frames moved to a userdata at base
+  size_t start;
+  int more = 0; // a partial input ran out, nothing may backtrack past that
+
+  if (!lua_checkstack(L, prog->frame_slots))
+    luaL_error(L, "parser nesting too deep");
+
+  for (;;) {
+    // every instruction either continues or jumps to fail
+    switch ((OpCode)ip->op) {
+    case OP_LITERAL: {
+      size_t n = (size_t)ip->arg;
+      const char *lit = prog->consts + ip->aux;
+      if (n > len - pos) {
+        more = ctx->partial && memcmp(s + pos, lit, len - pos) == 0;
+        goto fail;
+      }
+      if (memcmp(s + pos, lit, n) != 0)
+        goto fail;
+
+      lua_pushlstring(L, s + pos, n);
+      pos += n;
+      ip++;
+      continue;
+    }
+
+    case OP_ANY_CHAR: {
+      if (pos >= len) {
+        more = ctx->partial;
+        goto fail;
+      }
+
+      unsigned char uc = (unsigned char)s[pos];
+      size_t n = 1;
+      if ((uc & 0xE0) == 0xC0)
+        n = 2;
+      else if ((uc & 0xF0) == 0xE0)
+        n = 3;
+      else if ((uc & 0xF8) == 0xF0)
+        n = 4;
+      if (n > len - pos) {
+        more = ctx->partial;
+        if (more)
+          goto fail;
+        n = len - pos;
+      }
+
+      lua_pushlstring(L, s + pos, n);
+      pos += n;
+      ip++;
+      continue;
+    }
+
+    case OP_CHAR_CLASS:
+      if (pos >= len) {
+        more = ctx->partial;
+        goto fail;
+      }
+      if (!charset_has(&prog->classes[ip->aux].set, (unsigned char)s[pos]))
+        goto fail;
+
+      lua_pushlstring(L, s + pos, 1);
+      pos++;
+      ip++;
+      continue;
+
+    case OP_TAKE_WHILE: {
+      const VMClass *k = &prog->classes[ip->aux];
+      size_t n = scan_while(&k->set, &k->plan, s + pos, len - pos);
+      more = ctx->partial && n == len - pos;
+      if (more || n < k->min)
+        goto fail;
+
+      lua_pushlstring(L, s + pos, n);
+      pos += n;
+      ip++;
+      continue;
+    }
+
+    case OP_TAKE_UNTIL: {
+      size_t mlen = (size_t)ip->arg;
+      size_t at = scan_find(s + pos, len - pos, prog->consts + ip->aux, mlen);
+      if (at == len - pos && mlen > 0) {
+        more = ctx->partial;
+        goto fail;
+      }
+
+      size_t n = ip->flag ? at + mlen : at;
+      lua_pushlstring(L, s + pos, n);
+      pos += n;
+      ip++;
+      continue;
+    }
+
+    case OP_ONE_OF: {
+      const OneOfData *t = prog->tries[ip->aux];
+      int word;
+      size_t end;
+      int m = one_of_match(t, &ctx->in, pos, ctx->partial, &word, &end);
+      if (m <= 0) {
+        more = m < 0;
+        goto fail;
+      }
+
+      one_of_push(L, t, &ctx->in, pos, word, end);
+      pos = end;
+      ip++;
+      continue;
+    }
+
+    case OP_CHOICE:
+    case OP_CALL:
+    case OP_MARK:
+    case OP_LABEL:
+      if (nframes == cap) {
+        // grown frames are a userdata under the values of this run, so an
+        // error raised further down leaves them to the collector
+        VMFrame *grown =
+            (VMFrame *)lua_newuserdata(L, sizeof(VMFrame) * cap * 2);
+        memcpy(grown, frames, sizeof(VMFrame) * cap);
+        if (anchor) {
+          lua_replace(L, base);
+        } else {
+          lua_insert(L, base + 1);
+          base++;
+          anchor = 1;
+          for (int i = 0; i < nframes; i++) {
+            if (grown[i].top >= 0)
+              grown[i].top++;
+          }
+        }
+        frames = grown;
+        cap *= 2;
+      }
+
+      if (ip->op == OP_CHOICE) {
+        frames[nframes].alt = ip->arg;
+        frames[nframes].top = lua_gettop(L);
+        frames[nframes].cut = ctx->cut;
+        frames[nframes].pos = pos;
+        nframes++;
+        ctx->cut = 0;
+        ip++;
+        continue;
+      }
+
+      if (ip->op == OP_MARK) {
+        frames[nframes].top = VM_MARK_FRAME;
+        frames[nframes].pos = pos;
+        nframes++;
+        ip++;
+        continue;
+      }
+
+      if (ip->op == OP_LABEL) {
+        frames[nframes].alt = (int)(ip - code);
+        frames[nframes].top = VM_LABEL_FRAME;
+        frames[nframes].cut = ctx->err.pos == pos ? ctx->err.n : 0;
+        frames[nframes].pos = pos;
+        nframes++;
+        ip++;
+        continue;
+      }
+
+      if (!lua_checkstack(L, prog->frame_slots))
+        luaL_error(L, "parser nesting too deep");
+
+      frames[nframes].alt = (int)(ip - code) + 1;
+      frames[nframes].top = VM_CALL_FRAME;
+      nframes++;
+      ip = code + ip->arg;
+      continue;
+
+    case OP_COMMIT:
+      nframes--;
+      ctx->cut |= frames[nframes].cut;
+      ip = code + ip->arg;
+      continue;
+
+    case OP_LOOP: {
+      // an iteration that consumed nothing would repeat forever
+      VMFrame *f = &frames[nframes - 1];
+      if (pos == f->pos) {
+        ctx->cut |= f->cut;
+        nframes--;
+        ip++;
+        continue;
+      }
+
+      f->pos = pos;
+      f->top = lua_gettop(L);
+      f->cut |= ctx->cut;
+      ctx->cut = 0;
+      ip = code + ip->arg;
+      continue;
+    }
+
+    case OP_JUMP:
+      ip = code + ip->arg;
+      continue;
+
+    case OP_SWITCH: {
+      if (ctx->partial && pos == len) {
+        more = 1;
+        goto fail;
+      }
+
+      int at = pos < len ? (unsigned char)s[pos] : 256;
+      ip = code + prog->switches[ip->aux].target[at];
+      continue;
+    }
+
+    case OP_FAIL:
+      goto fail;
+
+    case OP_RET:
+      nframes--;
+      ip = code + frames[nframes].alt;
+      continue;
+
+    case OP_NODE: {
+      ParseResult r = parser_run(prog->nodes[ip->aux], ctx, pos);
+      pos = r.pos;
+      if (!r.ok) {
+        more = r.more;
+        goto fail;
+      }
+
+      ip++;
+      continue;
+    }
+
+    case OP_MAP:
+      // like the tree interpreter, a failed callback fails where its node
+      // started
+      start = frames[--nframes].pos;
+      lua_rawgeti(L, LUA_REGISTRYINDEX, prog->funcs[ip->aux]);
+      lua_insert(L, -2);
+
+      if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+        vm_callback_error(L, OP_MAP);
+        pos = start;
+        goto fail;
+      }
+
+      ip++;
+      continue;
+
+    case OP_UNLABEL:
+      nframes--;
+      ip++;
+      continue;
+
+    case OP_CUT:
+      ctx->cut = 1;
+      if (ctx->memo)
+        memo_trim(ctx->memo, pos);
+      ip++;
+      continue;
+
+    case OP_SPAN:
+      start = frames[--nframes].pos;
+      if (!ip->flag)
+        lua_pop(L, 1);
+      lua_pushlstring(L, s + start, pos - start);
+      ip++;
+      continue;
+
+    case OP_PRED: {
+      start = frames[--nframes].pos;
+      lua_rawgeti(L, LUA_REGISTRYINDEX, prog->funcs[ip->aux]);
+      lua_pushvalue(L, -2);
+
+      if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+        vm_callback_error(L, OP_PRED);
+        pos = start;
+        goto fail;
+      }
+
+      int truthy = lua_toboolean(L, -1);
+      lua_pop(L, 1);
+      if (!truthy) {
+        pos = start;
+        goto fail;
+      }
+
+      ip++;
+      continue;
+    }
+
+    case OP_AND_THEN: {
+      start = frames[--nframes].pos;
+      lua_rawgeti(L, LUA_REGISTRYINDEX, prog->funcs[ip->aux]);
+      lua_insert(L, -2);
+
+      if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+        vm_callback_error(L, OP_AND_THEN);
+        pos = start;
+        goto fail;
+      }
+
+      Parser **next = (Parser **)luaL_testudata(L, -1, "Parser");
+      if (!next) {
+        pos = start;
+        goto fail;
+      }
+
+      Parser *q = *next;
+      parser_ref(q);
+      lua_pop(L, 1);
+
+      ParseResult r = parser_run(q, ctx, pos);
+      parser_unref(q);
+
+      pos = r.pos;
+      if (!r.ok) {
+        more = r.more;
+        goto fail;
+      }
+
+      ip++;
+      continue;
+    }
+
+    case OP_POP:
+      lua_pop(L, 1);
+      ip++;
+      continue;
+
+    case OP_NIP:
+      lua_remove(L, -2);
+      ip++;
+      continue;
+
+    case OP_PAIR:
+      lua_createtable(L, 2, 0);
+      lua_insert(L, -3);
+      lua_rawseti(L, -3, 2);
+      lua_rawseti(L, -2, 1);
+      ip++;
+      continue;
+
+    case OP_NEWTABLE:
+      lua_newtable(L);
+      ip++;
+      continue;
+
+    case OP_APPEND:
+      lua_rawseti(L, -2, (lua_Integer)lua_rawlen(L, -2) + 1);
+      ip++;
+      continue;
+
+    case OP_NONEMPTY:
+      if (lua_rawlen(L, -1) == 0)
+        goto fail;
+
+      ip++;
+      continue;
+
+    case OP_END:
+      if (anchor)
+        lua_remove(L, base);
+      return parse_ok(pos);
+    }
+
+  fail:
+    // ip is still the instruction that failed
+    if (!more && prog->origins[ip - code]) {
+      Parser *o = prog->origins[ip - code];
+      if (o->kind == P_OR_ELSE)
+        or_expect_skipped(ctx, pos, o);
+      else
+        parse_expect(ctx, pos, o);
+    }
+
+    if (more) {
+      lua_settop(L, base - anchor);
+      return parse_more(pos);
+    }
+
+    // unwind call, mark and label frames up to the nearest choice, past a
+    // cut none of the choices may be taken either
+    for (;;) {
+      while (nframes > 0 && frames[nframes - 1].top < 0) {
+        nframes--;
+        if (frames[nframes].top == VM_LABEL_FRAME)
+          vm_label_failed(ctx, prog, &frames[nframes]);
+      }
+      if (nframes == 0 || !ctx->cut)
+        break;
+      nframes--;
+    }
+
+    if (nframes == 0) {
+      lua_settop(L, base - anchor);
+      ParseResult r = parse_err(pos);
+      r.cut = ctx->cut;
+      return r;
+    }
+
+    nframes--;
+    lua_settop(L, frames[nframes].top);
+    ctx->cut = frames[nframes].cut;
+    pos = frames[nframes].pos;
+    ip = code + frames[nframes].alt;
+  }
+}
+
+static ParseResult compiled_parse(Parser *p, ParseContext *ctx, size_t pos) {
+  CompiledData *d = (CompiledData *)p->data;
+  return vm_run(&d->prog, ctx, pos);
+}
+
+static void compiled_destroy(Parser *p) {
+  CompiledData *d = (CompiledData *)p->data;
+  for (int i = 0; i < d->prog.nnodes; i++)
+    parser_release(p->arena, d->prog.nodes[i]);
+
+  free(d->prog.code);
+  free(d->prog.origins);
+  free(d->prog.consts);
+  free(d->prog.classes);
+  free(d->prog.nodes);
+  free(d->prog.funcs);
+  free(d->prog.switches);
+  free(d->prog.tries);
+  parser_release(p->arena, d->source);
+}
+
+/* inspector */
+
+static char *make_indent(int level) {
+  int n = level * 4;
+
+  if (n < 0)
+    n = 0;
+
+  if (n > 63)
+    n = 63;
+
+  char *idnt = malloc(n + 1);
+  memset(idnt, ' ', n);
+  idnt[n] = '\0';
+  return idnt;
+}
+
+static char *inspect_literal(Parser *p, int indent) {
+  LiteralData *d = (LiteralData *)p->data;
+  char *ind = make_indent(indent);
+  const char *templ = "%sliteral(\"%s\")";
+
+  int size = snprintf(NULL, 0, templ, ind, d->lit) + 1;
+  char *buff = malloc(size);
+
+  if (buff == NULL) {
+    free(ind);
+    return NULL;
+  }
+
+  snprintf(buff, size, templ, ind, d->lit);
+
+  return buff;
+}
+
+static char *inspect_any_char(Parser *p, int indent) {
+  (void)p;
+  char *ind = make_indent(indent);
+  int size = snprintf(NULL, 0, "%sany_char()", ind);
+  char *buff = malloc(size);
+
+  if (buff == NULL) {
+    free(ind);
+    return NULL;
+  }
+
+  return buff;
+}
+
+static char *inspect_binary(const char *name, Parser *left, Parser *right,
+                            int indent) {
+  char *ind = make_indent(indent);
+  char *left_str = inspect_parser(left, indent + 1);
+  char *right_str = inspect_parser(right, indent + 1);
+  const char *templ = "%s%s(\n%s\n%s\n%s)";
+
+  int size = snprintf(NULL, 0, templ, ind, name, left_str, right_str, ind) + 1;
+
+  char *buff = malloc(size);
+  snprintf(buff, size, templ, ind, name, left_str, right_str, ind);
+
+  free(ind);
+  free(left_str);
+  free(right_str);
+
+  return buff;
+}
+
+static char *inspect_pair(Parser *p, int indent) {
+  PairData *d = (PairData *)p->data;
+  return inspect_binary("pair", d->left, d->right, indent);
+}
+
+static char *inspect_unary(const char *name, Parser *inner, int indent) {
+  char *ind = make_indent(indent);
+  char *inner_str = inspect_parser(inner, indent + 1);
+  const char *templ = "%s%s(\n%s\n%s)";
+
+  int size = snprintf(NULL, 0, templ, ind, name, inner_str, ind) + 1;
+
+  char *buff = malloc(size);
+  if (!buff) {
+    free(ind);
+    free(inner_str);
+    return NULL;
+  }
+
+  snprintf(buff, size, templ, ind, name, inner_str, ind);
+
+  free(ind);
+  free(inner_str);
+
+  return buff;
+}
+
+static char *inspect_expr(Parser *p, int indent) {
+  ExprData *d = (ExprData *)p->data;
+  return inspect_unary("expr", d->atom, indent);
+}
+
+static char *inspect_recognize(Parser *p, int indent) {
+  SpanData *d = (SpanData *)p->data;
+  return inspect_unary("recognize", d->inner, indent);
+}
+
+static char *inspect_many_concat(Parser *p, int indent) {
+  SpanData *d = (SpanData *)p->data;
+  return inspect_unary(d->min ? "many1_concat" : "many_concat", d->inner,
+                       indent);
+}
+
+static char *inspect_sep_by(Parser *p, int indent) {
+  SepByData *d = (SepByData *)p->data;
+  return inspect_binary(d->min ? "sep_by1" : "sep_by", d->item, d->sep,
+                        indent);
+}
+
+static char *inspect_many_till(Parser *p, int indent) {
+  ManyTillData *d = (ManyTillData *)p->data;
+  return inspect_binary("many_till", d->inner, d->end, indent);
+}
+
+static char *inspect_take_after(Parser *p, int indent) {
+  TakeAfterData *d = (TakeAfterData *)p->data;
+  return inspect_binary("take_after", d->left, d->right, indent);
+}
+
+static char *inspect_drop_for(Parser *p, int indent) {
+  DropForData *d = (DropForData *)p->data;
+  return inspect_binary("drop_for", d->left, d->right, indent);
+}
+
+static char *inspect_or_else(Parser *p, int indent) {
+  OrData *d = (OrData *)p->data;
+  return inspect_binary("or_else", d->left, d->right, indent);
+}
+
+static char *inspect_one_or_more(Parser *p, int indent) {
+  RepData *d = (RepData *)p->data;
+
+  char *ind = make_indent(indent);
+  char *inner = inspect_parser(d->inner, indent + 1);
+  const char *templ = "%sone_or_more(\n%s\n%s)";
+
+  int size = snprintf(NULL, 0, templ, ind, inner, ind) + 1;
+
+  char *buff = malloc(size);
+  if (!buff) {
+    free(ind);
+    free(inner);
+    return NULL;
+  }
+  snprintf(buff, size, templ, ind, inner, ind);
+
+  free(ind);
+  free(inner);
+
+  return buff;
+}
+
+static char *inspect_zero_or_more(Parser *p, int indent) {
+  RepData *d = (RepData *)p->data;
+
+  char *ind = make_indent(indent);
+  char *inner = inspect_parser(d->inner, indent + 1);
+  const char *templ = "%szero_or_more(\n%s\n%s)";
+
+  int size = snprintf(NULL, 0, templ, ind, inner, ind) + 1;
+
+  char *buff = malloc(size);
+  if (!buff) {
+    free(ind);
+    free(inner);
+    return NULL;
+  }
+
+  snprintf(buff, size, templ, ind, inner, ind);
+
+  free(ind);
+  free(inner);
+
+  return buff;
+}
+
+static char *inspect_unary_with_func(const char *name, Parser *inner,
+                                     int indent) {
+  char *ind = make_indent(indent);
+  const char *templ = "%s%s(<function>\n%s%s\n)";
+  char *inner_str = inspect_parser(inner, indent + 1);
+
+  int size = snprintf(NULL, 0, templ, ind, name, ind, inner_str) + 1;
+  char *buff = malloc(size);
+  if (!buff) {
+    free(ind);
+    free(inner_str);
+    return NULL;
+  }
+
+  snprintf(buff, size, templ, ind, name, ind, inner_str);
+
+  free(ind);
+  free(inner_str);
+
+  return buff;
+  return strdup("mappp");
+}
+
+static char *inspect_pred(Parser *p, int indent) {
+  PredData *d = (PredData *)p->data;
+  return inspect_unary_with_func("pred", d->inner, indent);
+}
+
+static char *inspect_map(Parser *p, int indent) {
+  MapData *d = (MapData *)p->data;
+  return inspect_unary_with_func("map", d->inner, indent);
+}
+
+static char *inspect_and_then(Parser *p, int indent) {
+  AndThenData *d = (AndThenData *)p->data;
+  return inspect_unary_with_func("and_then", d->inner, indent);
+}
+
+static char *inspect_lazy(Parser *p, int indent) {
+  LazyData *d = (LazyData *)p->data;
+
+  char *ind = make_indent(indent);
+  const char *templ = "%slazy(<function>)\n";
+
+  int size = snprintf(NULL, 0, templ, ind) + 1;
+
+  char *buff = malloc(size);
+  if (!buff) {
+    free(ind);
+    return NULL;
+  }
+
+  snprintf(buff, size, templ, ind);
+  free(ind);
+
+  return buff;
+}
+
+static char *inspect_memo(Parser *p, int indent) {
+  MemoData *d = (MemoData *)p->data;
+
+  char *ind = make_indent(indent);
+  char *inner = inspect_parser(d->inner, indent + 1);
+  const char *templ = "%smemoize(\n%s\n%s)";
+
+  int size = snprintf(NULL, 0, templ, ind, inner, ind) + 1;
+
+  char *buff = malloc(size);
+  if (!buff) {
+    free(ind);
+    free(inner);
+    return NULL;
+  }
+
+  snprintf(buff, size, templ, ind, inner, ind);
+
+  free(ind);
+  free(inner);
+
+  return buff;
+}
+
+static char *inspect_char_class(Parser *p, int indent) {
+  CharClassData *d = (CharClassData *)p->data;
+  char *ind = make_indent(indent);
+  const char *templ = "%schar_class(\"%s\")";
+
+  int size = snprintf(NULL, 0, templ, ind, d->spec) + 1;
+  char *buff = malloc(size);
+  if (buff)
+    snprintf(buff, size, templ, ind, d->spec);
+
+  free(ind);
+  return buff;
+}
+
+static char *inspect_take_while(Parser *p, int indent) {
+  TakeWhileData *d = (TakeWhileData *)p->data;
+  char *ind = make_indent(indent);
+  const char *templ = "%stake_while(\"%s\", %zu)";
+
+  int size = snprintf(NULL, 0, templ, ind, d->spec, d->min) + 1;
+  char *buff = malloc(size);
+  if (buff)
+    snprintf(buff, size, templ, ind, d->spec, d->min);
+
+  free(ind);
+  return buff;
+}
+
+static char *inspect_take_until(Parser *p, int indent) {
+  TakeUntilData *d = (TakeUntilData *)p->data;
+  char *ind = make_indent(indent);
+  const char *templ = "%stake_until(\"%s\"%s)";
+  const char *incl = d->inclusive ? ", true" : "";
+
+  int size = snprintf(NULL, 0, templ, ind, d->mark, incl) + 1;
+  char *buff = malloc(size);
+  if (buff)
+    snprintf(buff, size, templ, ind, d->mark, incl);
+
+  free(ind);
+  return buff;
+}
+
+static char *inspect_one_of(Parser *p, int indent) {
+  OneOfData *d = (OneOfData *)p->data;
+  char *ind = make_indent(indent);
+  const char *templ = "%sone_of(<%d words>%s)";
+  const char *longest = d->longest ? "" : ", { longest = false }";
+
+  int size = snprintf(NULL, 0, templ, ind, d->nwords, longest) + 1;
+  char *buff = malloc(size);
+  if (buff)
+    snprintf(buff, size, templ, ind, d->nwords, longest);
+
+  free(ind);
+  return buff;
+}
+
+static char *inspect_label(Parser *p, int indent) {
+  LabelData *d = (LabelData *)p->data;
+  char *ind = make_indent(indent);
+  char *inner_str = inspect_parser(d->inner, indent + 1);
+  const char *templ = "%slabel(\"%s\",\n%s\n%s)";
+
+  int size = snprintf(NULL, 0, templ, ind, d->name, inner_str, ind) + 1;
+  char *buff = malloc(size);
+  if (buff)
+    snprintf(buff, size, templ, ind, d->name, inner_str, ind);
+
+  free(ind);
+  free(inner_str);
+  return buff;
+}
+
+static char *inspect_cut(Parser *p, int indent) {
+  CutData *d = (CutData *)p->data;
+  return inspect_unary("cut", d->inner, indent);
+}
+
+static char *inspect_compiled(Parser *p, int indent) {
+  CompiledData *d = (CompiledData *)p->data;
+
+  char *ind = make_indent(indent);
+  char *inner = inspect_parser(d->source, indent + 1);
+  const char *templ = "%scompiled(\n%s\n%s)";
+
+  int size = snprintf(NULL, 0, templ, ind, inner, ind) + 1;
+
+  char *buff = malloc(size);
+  if (buff)
+    snprintf(buff, size, templ, ind, inner, ind);
+
+  free(ind);
+  free(inner);
+
+  return buff;
+}
+
+static char *inspect_parser(Parser *p, int indent) {
+  // TODO: could crash if recursive combinators are used
+  // we don't detect cycles yet.
+
+  lua_State *L = p->L;
+  if (L && p->lua_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, p->lua_ref);
+
+    lua_getuservalue(L, -1);
+    lua_getfield(L, -1, "inspect");
+    if (!lua_isnil(L, -1)) {
+      const char *inspect_str = lua_tostring(L, -1);
+      char *ind = make_indent(indent);
+
+      int size = snprintf(NULL, 0, "%s%s", ind, inspect_str) + 1;
+      char *buff = malloc(size);
+      if (!buff) {
+        free(ind);
+      }
+
+      snprintf(buff, size, "%s%s", ind, inspect_str);
+      free(ind);
+
+      lua_pop(L, 3); // inspect, uservalue, userdata
+      return buff;
+    }
+    lua_pop(L, 3);
+  }
+
+  switch (p->kind) {
+  case P_LITERAL:
+    return inspect_literal(p, indent);
+  case P_ANY_CHAR:
+    return inspect_any_char(p, indent);
+
+  case P_PAIR:
+    return inspect_pair(p, indent);
+  case P_ONE_OF:
+    return inspect_one_of(p, indent);
+  case P_LABEL:
+    return inspect_label(p, indent);
+  case P_CUT:
+    return inspect_cut(p, indent);
+  case P_EXPR:
+    return inspect_expr(p, indent);
+  case P_RECOGNIZE:
+    return inspect_recognize(p, indent);
+  case P_MANY_CONCAT:
+    return inspect_many_concat(p, indent);
+  case P_SEP_BY:
+    return inspect_sep_by(p, indent);
+  case P_MANY_TILL:
+    return inspect_many_till(p, indent);
+  case P_OR_ELSE:
+    return inspect_or_else(p, indent);
+  case P_TAKE_AFTER:
+    return inspect_take_after(p, indent);
+  case P_DROP_FOR:
+    return inspect_drop_for(p, indent);
+
+  case P_MAP:
+    return inspect_map(p, indent);
+  case P_AND_THEN:
+    return inspect_and_then(p, indent);
+  case P_PRED:
+    return inspect_pred(p, indent);
+
+  case P_ONE_OR_MORE:
+    return inspect_one_or_more(p, indent);
+  case P_ZERO_OR_MORE:
+    return inspect_zero_or_more(p, indent);
+
+  case P_LAZY:
+    return inspect_lazy(p, indent);
+  case P_MEMO:
+    return inspect_memo(p, indent);
+  case P_CHAR_CLASS:
+    return inspect_char_class(p, indent);
+  case P_TAKE_WHILE:
+    return inspect_take_while(p, indent);
+  case P_TAKE_UNTIL:
+    return inspect_take_until(p, indent);
+  case P_COMPILED:
+    return inspect_compiled(p, indent);
+  default:
+    return strdup("unknow");
+  }
+}
+
+/* ---------------------------
+   Lua userdata helpers
+   --------------------------- */
+
+static Parser *check_parser_ud(lua_State *L, int idx) {
+  Parser **ud = (Parser **)luaL_checkudata(L, idx, "Parser");
+  if (!*ud)
+    luaL_error(L, "parser used after its arena was closed");
+  return *ud;
+}
+
+static void push_parser_ud(lua_State *L, Parser *p) {
+  Parser **ud = (Parser **)lua_newuserdata(L, sizeof(Parser *));
+  *ud = p;
+  // userdata owns a ref of parser
+  parser_ref(p); // increment for userdata owner
+  luaL_getmetatable(L, "Parser");
+  lua_setmetatable(L, -2);
+
+  // for custom lua user values
+  lua_newtable(L);
+  lua_setuservalue(L, -2);
+
+  lua_pushvalue(L, -1);
+  p->lua_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/* ---------------------------
+   Lua-exposed constructors / methods
+   --------------------------- */
+
+/* parser.literal(s) */
+static int l_parser_literal(lua_State *L) {
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  Parser *p = make_literal(L, s, len);
+  push_parser_ud(L, p);
+  // unref the initial creator reference: push_parser_ud already added one
+  parser_unref(p);
+  return 1;
+}
+
+/* parser.any_char() */
+static int l_parser_any_char(lua_State *L) {
+  Parser *p = make_any_char(L);
+  push_parser_ud(L, p);
+  parser_unref(p);
+  return 1;
+}
+
+/* p:map(function) */
+static int l_parser_map(lua_State *L) {
+  Parser *inner = check_parser_ud(L, 1);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_pushvalue(L, 2);
+  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  Parser *mp = make_map(L, inner, ref);
+  push_parser_ud(L, mp);
+  parser_unref(mp);
+  return 1;
+}
+
+/* p:and_then(function) -> function must return a Parser userdata */
+static int l_parser_and_then(lua_State *L) {
+  Parser *inner = check_parser_ud(L, 1);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_pushvalue(L, 2);
+  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  Parser *ap = make_and_then(L, inner, ref);
+  push_parser_ud(L, ap);
+  parser_unref(ap);
+  return 1;
+}
+
+/* p:or_else(q) */
+static int l_parser_or_else(lua_State *L) {
+  Parser *a = check_parser_ud(L, 1);
+  Parser *b = check_parser_ud(L, 2);
+  Parser *or_p = make_or(L, a, b);
+  push_parser_ud(L, or_p);
+  parser_unref(or_p);
+  return 1;
+}
+
+/* p:pred(function) */
+static int l_parser_pred(lua_State *L) {
+  Parser *inner = check_parser_ud(L, 1);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_pushvalue(L, 2);
+  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  Parser *pp = make_pred(L, inner, ref);
+  push_parser_ud(L, pp);
+  parser_unref(pp);
+  return 1;
+}
+
+/* p:one_or_more() */
+static int l_parser_one_or_more(lua_State *L) {
+  Parser *inner = check_parser_ud(L, 1);
+  Parser *rp = make_one_or_more(L, inner);
+  push_parser_ud(L, rp);
+  parser_unref(rp);
+  return 1;
+}
+
+/* p:zero_or_more() */
+static int l_parser_zero_or_more(lua_State *L) {
+  Parser *inner = check_parser_ud(L, 1);
+  Parser *rp = make_zero_or_more(L, inner);
+  push_parser_ud(L, rp);
+  parser_unref(rp);
+  return 1;
+}
+
+/* p:memoize() */
+static int l_parser_memoize(lua_State *L) {
+  Parser *inner = check_parser_ud(L, 1);
+  Parser *mp = make_memo(L, inner);
+  push_parser_ud(L, mp);
+  parser_unref(mp);
+  return 1;
+}
+
+/* parser.char_class(class) */
+static int l_parser_char_class(lua_State *L) {
+  size_t len;
+  const char *spec = luaL_checklstring(L, 1, &len);
+
+  CharSet set;
+  if (!charset_parse(&set, spec, len))
+    return luaL_error(L, "invalid character class '%s'", spec);
+
+  Parser *p = make_char_class(L, &set, spec);
+  push_parser_ud(L, p);
+  parser_unref(p);
+  return 1;
+}
+
+/* parser.take_while(class [, min]) */
+static int l_parser_take_while(lua_State *L) {
+  size_t len;
+  const char *spec = luaL_checklstring(L, 1, &len);
+  lua_Integer min = luaL_optinteger(L, 2, 0);
+  luaL_argcheck(L, min >= 0, 2, "minimum must not be negative");
+
+  CharSet set;
+  if (!charset_parse(&set, spec, len))
+    return luaL_error(L, "invalid character class '%s'", spec);
+
+  Parser *p = make_take_while(L, &set, spec, (size_t)min);
+  push_parser_ud(L, p);
+  parser_unref(p);
+  return 1;
+}
+
+/* parser.take_until(mark [, inclusive]) */
+static int l_parser_take_until(lua_State *L) {
+  size_t len;
+  const char *mark = luaL_checklstring(L, 1, &len);
+  int inclusive = lua_toboolean(L, 2);
+
+  Parser *p = make_take_until(L, mark, len, inclusive);
+  push_parser_ud(L, p);
+  parser_unref(p);
+  return 1;
+}
+
+/* parser.one_of(words [, opts]), words is a list of strings or a table
+   mapping each keyword to the value to return for it */
+static int l_parser_one_of(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+
+  int longest = 1;
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "longest");
+    if (!lua_isnil(L, -1))
+      longest = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  lua_settop(L, 1);
+
+  // check the words before anything is allocated
+  size_t count = (size_t)lua_rawlen(L, 1);
+  int mapped = count == 0;
+  if (mapped) {
+    lua_pushnil(L);
+    while (lua_next(L, 1)) {
+      if (lua_type(L, -2) != LUA_TSTRING)
+        return luaL_error(L, "one_of: keywords must be strings");
+      lua_pop(L, 1);
+      count++;
+    }
+  } else {
+    for (size_t i = 1; i <= count; i++) {
+      if (lua_rawgeti(L, 1, (lua_Integer)i) != LUA_TSTRING)
+        return luaL_error(L, "one_of: keywords must be strings");
+      lua_pop(L, 1);
+    }
+  }
+
+  if (count == 0)
+    return luaL_error(L, "one_of: needs at least one keyword");
+  if (count > INT_MAX / sizeof(TrieWord))
+    return luaL_error(L, "one_of: too many keywords");
+  int n = (int)count;
+
+  // a map comes in lua_next order, which changes from state to state, so
+  // it has no first keyword to prefer
+  if (mapped && !longest)
+    return luaL_error(L, "one_of: longest = false needs a list of keywords");
+
+  // the strings stay alive in the argument table while the trie is built
+  TrieWord *words = (TrieWord *)malloc(sizeof(TrieWord) * count);
+  if (!words) {
+    perror("malloc");
+    exit(1);
+  }
+
+  int values_ref = LUA_NOREF;
+  if (mapped) {
+    lua_createtable(L, n, 0);
+    int i = 0;
+    lua_pushnil(L);
+    while (lua_next(L, 1)) {
+      words[i].s = lua_tolstring(L, -2, &words[i].len);
+      words[i].id = i;
+      lua_rawseti(L, 2, ++i);
+    }
+    values_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  } else {
+    for (int i = 0; i < n; i++) {
+      lua_rawgeti(L, 1, i + 1);
+      words[i].s = lua_tolstring(L, -1, &words[i].len);
+      words[i].id = i;
+      lua_pop(L, 1);
+    }
+  }
+
+  Parser *p = make_one_of(L, words, n, longest, values_ref);
+  free(words);
+
+  push_parser_ud(L, p);
+  parser_unref(p);
+  return 1;
+}
+
+/* p:parse(input [, opts]) -> returns output (string or table or nil) , rest
+   (string). opts.memo turns on packrat mode for the whole call */
+static int l_parser_parse(lua_State *L) {
+  Parser *p = check_parser_ud(L, 1);
+  size_t len;
+  const char *input = luaL_checklstring(L, 2, &len);
+
+  ParseContext ctx = {L, {input, len}, 2, NULL, 0, 0, 0, {0}, NULL, 0};
+  if (lua_istable(L, 3)) {
+    lua_getfield(L, 3, "memo");
+    ctx.memo_all = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+
+  memo_reserve(&ctx);
+  ParseResult r = parser_run(p, &ctx, 0);
+  memo_release(&ctx);
+
+  return push_parse_results(L, &ctx, r);
+}
+
+// output, rest and on failure the ParseError, as p:parse returns them
+static int push_parse_results(lua_State *L, ParseContext *ctx, ParseResult r) {
+  const Input *in = &ctx->in;
+
+  // on success the output is already on top of the stack
+  if (r.ok) {
+    lua_pushlstring(L, in->base + r.pos, in->len - r.pos);
+    return 2;
+  }
+
+  lua_pushnil(L);
+  lua_pushlstring(L, in->base + r.pos, in->len - r.pos);
+  push_parse_error(L, ctx, ctx->input_idx);
+  return 3;
+}
+
+/* ---------------------------
+   frozen grammars
+   --------------------------- */
+
+static Parser *freeze_alloc(Frozen *f, ParserKind kind, size_t size) {
+  Parser *stub = (Parser *)calloc(1, sizeof(Parser) + size);
+  f->stubs = (Parser **)realloc(f->stubs, sizeof(Parser *) * (f->nstubs + 1));
+  if (!stub || !f->stubs) {
+    perror("calloc");
+    exit(1);
+  }
+  f->stubs[f->nstubs++] = stub;
+
+  stub->kind = kind;
+  stub->refcount = 1;
+  stub->lua_ref = LUA_NOREF;
+  return stub;
+}
+
+// the stand-in for what origin expects, a label carrying its description.
+// A dispatch failure in an or_else depends on the byte it saw (see
+// compile_switch), it becomes an or_else whose alternatives are the labels
+// of everything skipped on that byte, so it still expands the same way
+static Parser *freeze_stub(lua_State *L, FreezeMap *m, Parser *origin,
+                           int byte) {
+  if ((m->count + 1) * 2 > m->cap) {
+    size_t cap = m->cap ? m->cap * 2 : 64;
+    FreezeSlot *slots = (FreezeSlot *)calloc(cap, sizeof(FreezeSlot));
+    if (!slots) {
+      perror("calloc");
+      exit(1);
+    }
+
+    for (size_t i = 0; i < m->cap; i++) {
+      FreezeSlot *e = &m->slots[i];
+      if (!e->origin)
+        continue;
+      size_t j = memo_hash(e->origin, (size_t)e->byte) & (cap - 1);
+      while (slots[j].origin)
+        j = (j + 1) & (cap - 1);
+      slots[j] = *e;
+    }
+
+    free(m->slots);
+    m->slots = slots;
+    m->cap = cap;
+  }
+
+  size_t i = memo_hash(origin, (size_t)byte) & (m->cap - 1);
+  while (m->slots[i].origin &&
+         (m->slots[i].origin != origin || m->slots[i].byte != byte))
+    i = (i + 1) & (m->cap - 1);
+  if (m->slots[i].origin)
+    return m->slots[i].stub;
+
+  Parser *stub;
+  if (origin->kind == P_OR_ELSE) {
+    char c = (char)byte;
+    ParseContext tmp = {L, {&c, byte < 256}, 0, NULL, 0, 0, 0, {0}, NULL, 0};
+    or_expect_skipped(&tmp, 0, origin);
+
+    stub = freeze_alloc(m->f, P_OR_ELSE,
+                        sizeof(OrData) + sizeof(OrDispatch) +
+                            sizeof(Parser *) * EXPECT_MAX);
+    OrData *d = (OrData *)stub->data;
+    OrDispatch *t = (OrDispatch *)(d + 1);
+    t->alts = (Parser **)(t + 1);
+    t->masks = freeze_no_masks;
+    d->dispatch = t;
+
+    // the lookups below may move the slots
+    for (int k = 0; k < tmp.err.n; k++)
+      t->alts[t->n++] = freeze_stub(L, m, tmp.err.expected[k], 0);
+
+    i = memo_hash(origin, (size_t)byte) & (m->cap - 1);
+    while (m->slots[i].origin)
+      i = (i + 1) & (m->cap - 1);
+  } else {
+    expect_describe(L, origin);
+    size_t len;
+    const char *name = lua_tolstring(L, -1, &len);
+
+    stub = freeze_alloc(m->f, P_LABEL, sizeof(LabelData) + len + 1);
+    memcpy(((LabelData *)stub->data)->name, name, len + 1);
+    lua_pop(L, 1);
+  }
+
+  m->slots[i].origin = origin;
+  m->slots[i].byte = byte;
+  m->slots[i].stub = stub;
+  m->count++;
+  return stub;
+}
+
+// NULL if the grammar needs the building state, why tells what in it does.
+// With callbacks set, callback refs are kept and stay the source's
+static Frozen *freeze_program(lua_State *L, Parser *root, int callbacks,
+                              const char **why) {
+  if (root->kind == P_COMPILED)
+    root = ((CompiledData *)root->data)->source;
+
+  Parser *cp = compile_parser(L, root);
+  CompiledData *d = (CompiledData *)cp->data;
+  Program *prog = &d->prog;
+
+  // whatever still needs the building state stays out
+  *why = NULL;
+  if (prog->nnodes > 0)
+    *why = parser_kind_name(prog->nodes[0]);
+  else if (prog->nfuncs > 0 && !callbacks)
+    *why = "callback";
+  for (int i = 0; !*why && i < prog->ntries; i++) {
+    if (prog->tries[i]->values_ref != LUA_NOREF)
+      *why = "one_of with values";
+  }
+  if (*why) {
+    parser_unref(cp);
+    return NULL;
+  }
+
+  Frozen *f = (Frozen *)calloc(1, sizeof(Frozen));
+  if (!f) {
+    perror("calloc");
+    exit(1);
+  }
+  atomic_init(&f->refcount, 1);
+
+  // the program is taken over, the compiled node gives up its arrays
+  f->prog = *prog;
+  memset(prog, 0, sizeof(Program));
+
+  // tries are copied out of their nodes
+  f->trie_blobs = (OneOfData **)calloc(f->prog.ntries + 1, sizeof(OneOfData *));
+  if (!f->trie_blobs) {
+    perror("calloc");
+    exit(1);
+  }
+  for (int i = 0; i < f->prog.ntries; i++) {
+    const OneOfData *t = f->prog.tries[i];
+    OneOfData *copy = (OneOfData *)malloc(ONE_OF_SIZE(t));
+    if (!copy) {
+      perror("malloc");
+      exit(1);
+    }
+    memcpy(copy, t, ONE_OF_SIZE(t));
+    f->trie_blobs[i] = copy;
+    f->prog.tries[i] = copy;
+  }
+
+  FreezeMap m;
+  memset(&m, 0, sizeof(FreezeMap));
+  m.f = f;
+  luaL_checkstack(L, 4, NULL);
+  for (int i = 0; i < f->prog.ncode; i++) {
+    if (f->prog.origins[i])
+      f->prog.origins[i] = freeze_stub(
+          L, &m, f->prog.origins[i],
+          f->prog.code[i].op == OP_FAIL ? f->prog.code[i].arg : 0);
+  }
+  free(m.slots);
+
+  parser_unref(cp);
+  return f;
+}
+
+static void frozen_release(Frozen *f) {
+  if (atomic_fetch_sub_explicit(&f->refcount, 1, memory_order_acq_rel) != 1)
+    return;
+
+  if (f->owner) {
+    for (int i = 0; i < f->prog.nfuncs; i++)
+      luaL_unref(f->owner, LUA_REGISTRYINDEX, f->prog.funcs[i]);
+  }
+
+  // only origins, tries and funcs were allocated next to an image
+  if (f->image) {
+    free(f->prog.origins);
+    free(f->prog.tries);
+    free(f->prog.funcs);
+    free(f->stub_block);
+    free(f->stubs);
+    if (f->mapped)
+      munmap(f->image, f->image_len);
+    else
+      free(f->image);
+    free(f);
+    return;
+  }
+
+  free(f->prog.code);
+  free(f->prog.origins);
+  free(f->prog.funcs);
+  free(f->prog.consts);
+  free(f->prog.classes);
+  free(f->prog.switches);
+  free(f->prog.tries);
+  for (int i = 0; i < f->prog.ntries; i++)
+    free(f->trie_blobs[i]);
+  free(f->trie_blobs);
+  for (int i = 0; i < f->nstubs; i++)
+    free(f->stubs[i]);
+  free(f->stubs);
+  free(f);
+}
+
+static Frozen *check_frozen(lua_State *L, int idx) {
+  Frozen **ud = (Frozen **)luaL_checkudata(L, idx, "ParserFrozen");
+  return *ud;
+}
+
+// takes over a reference the caller holds
+static void push_frozen(lua_State *L, Frozen *f) {
+  Frozen **ud = (Frozen **)lua_newuserdata(L, sizeof(Frozen *));
+  *ud = f;
+  luaL_getmetatable(L, "ParserFrozen");
+  lua_setmetatable(L, -2);
+}
+
+/* p:freeze() */
+static int l_parser_freeze(lua_State *L) {
+  Parser *p = check_parser_ud(L, 1);
+  const char *why;
+  Frozen *f = freeze_program(L, p, 0, &why);
+  if (!f)
+    return luaL_error(L, "cannot freeze a parser using %s", why);
+
+  push_frozen(L, f);
+  return 1;
+}
+
+/* frozen:parse(input) */
+static int l_frozen_parse(lua_State *L) {
+  Frozen *f = check_frozen(L, 1);
+  size_t len;
+  const char *input = luaL_checklstring(L, 2, &len);
+
+  ParseContext ctx = {L, {input, len}, 2, NULL, 0, 0, 0, {0}, NULL, 0};
+  ParseResult r = vm_run(&f->prog, &ctx, 0);
+
+  return push_parse_results(L, &ctx, r);
+}
+
+static pthread_mutex_t share_lock = PTHREAD_MUTEX_INITIALIZER;
+static ShareTicket *share_tickets; // not adopted yet
+
+/* frozen:share() -> token for parser.adopt in any state, on any thread.
+   Every token holds a reference until it is adopted exactly once */
+static int l_frozen_share(lua_State *L) {
+  Frozen *f = check_frozen(L, 1);
+  if (f->owner)
+    return luaL_error(L, "cannot share a grammar with callbacks");
+
+  ShareTicket *t = (ShareTicket *)malloc(sizeof(ShareTicket));
+  if (!t) {
+    perror("malloc");
+    exit(1);
+  }
+  atomic_fetch_add_explicit(&f->refcount, 1, memory_order_relaxed);
+  t->f = f;
+
+  pthread_mutex_lock(&share_lock);
+  t->next = share_tickets;
+  share_tickets = t;
+  pthread_mutex_unlock(&share_lock);
+
+  lua_pushlightuserdata(L, t);
+  return 1;
+}
+
+static int l_frozen_gc(lua_State *L) {
+  Frozen **ud = (Frozen **)luaL_checkudata(L, 1, "ParserFrozen");
+  if (*ud) {
+    frozen_release(*ud);
+    *ud = NULL;
+  }
+  return 0;
+}
+
+/* parser.adopt(token) */
+static int l_parser_adopt(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+  void *token = lua_touserdata(L, 1);
+
+  // the token is only compared until it is found among the tickets
+  ShareTicket *t = NULL;
+  pthread_mutex_lock(&share_lock);
+  for (ShareTicket **at = &share_tickets; *at; at = &(*at)->next) {
+    if (*at == token) {
+      t = *at;
+      *at = t->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&share_lock);
+
+  if (!t)
+    return luaL_error(L, "not a share token, or adopted already");
+
+  Frozen *f = t->f;
+  free(t);
+  push_frozen(L, f);
+  return 1;
+}
+
+/* ---------------------------
+   grammar dumps
+   --------------------------- */
+
+static void dump_sizes(uint16_t sizes[6]) {
+  sizes[0] = sizeof(Instr);
+  sizes[1] = sizeof(VMClass);
+  sizes[2] = sizeof(VMSwitch);
+  sizes[3] = sizeof(OneOfData);
+  sizes[4] = sizeof(TrieNode);
+  sizes[5] = sizeof(TrieEdge);
+}
+
+static int dump_stub_cmp(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t)((const DumpStubIndex *)a)->stub;
+  uintptr_t y = (uintptr_t)((const DumpStubIndex *)b)->stub;
+  return x < y ? -1 : x > y;
+}
+
+static int dump_stub_index(const DumpStubIndex *idx, int n, const Parser *p) {
+  DumpStubIndex key = {p, 0};
+  const DumpStubIndex *hit = (const DumpStubIndex *)bsearch(
+      &key, idx, (size_t)n, sizeof(DumpStubIndex), dump_stub_cmp);
+  return hit->index;
+}
+
+#define DUMP_ROUND(n) (((n) + DUMP_ALIGN - 1) & ~(size_t)(DUMP_ALIGN - 1))
+
+/* p:dump([callbacks]), callbacks names every callback as { name = f } */
+static int l_parser_dump(lua_State *L) {
+  Parser *p = check_parser_ud(L, 1);
+  if (!lua_isnoneornil(L, 2))
+    luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+
+  const char *why;
+  Frozen *f = freeze_program(L, p, 1, &why);
+  if (!f)
+    return luaL_error(L, "cannot dump a parser using %s", why);
+  // collected on any error below
+  push_frozen(L, f);
+  Program *prog = &f->prog;
+
+  // callbacks are found by identity, written by name
+  lua_newtable(L);
+  int names = lua_gettop(L);
+  if (lua_istable(L, 2)) {
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+      if (lua_type(L, -2) == LUA_TSTRING) {
+        lua_pushvalue(L, -1);
+        lua_pushvalue(L, -3);
+        lua_rawset(L, names);
+      }
+      lua_pop(L, 1);
+    }
+  }
+
+  size_t strings = 0;
+  for (int i = 0; i < prog->nfuncs; i++) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, prog->funcs[i]);
+    lua_rawget(L, names);
+    if (!lua_isstring(L, -1))
+      return luaL_error(L, "callback %d has no name in the callbacks table",
+                        i + 1);
+    strings += lua_rawlen(L, -1) + 1;
+    lua_pop(L, 1);
+  }
+
+  DumpStubIndex *idx = (DumpStubIndex *)lua_newuserdata(
+      L, sizeof(DumpStubIndex) * (f->nstubs + 1));
+  size_t members = 0;
+  for (int i = 0; i < f->nstubs; i++) {
+    Parser *stub = f->stubs[i];
+    idx[i].stub = stub;
+    idx[i].index = i;
+    if (stub->kind == P_LABEL)
+      strings += strlen(((LabelData *)stub->data)->name) + 1;
+    else
+      members += (size_t)((OrData *)stub->data)->dispatch->n;
+  }
+  qsort(idx, (size_t)f->nstubs, sizeof(DumpStubIndex), dump_stub_cmp);
+
+  size_t tries = sizeof(uint64_t) * prog->ntries;
+  for (int i = 0; i < prog->ntries; i++)
+    tries = DUMP_ROUND(tries) + ONE_OF_SIZE(prog->tries[i]);
+
+  DumpHeader h;
+  memset(&h, 0, sizeof(DumpHeader));
+  memcpy(h.magic, DUMP_MAGIC, 4);
+  h.version = DUMP_VERSION;
+  h.byte_order = 0x01020304;
+  dump_sizes(h.sizes);
+  h.ncode = prog->ncode;
+  h.nclasses = prog->nclasses;
+  h.nswitches = prog->nswitches;
+  h.ntries = prog->ntries;
+  h.nfuncs = prog->nfuncs;
+  h.nstubs = f->nstubs;
+  h.frame_slots = prog->frame_slots;
+  h.len[DUMP_CODE] = sizeof(Instr) * prog->ncode;
+  h.len[DUMP_ORIGINS] = sizeof(int32_t) * prog->ncode;
+  h.len[DUMP_CONSTS] = prog->nconsts;
+  h.len[DUMP_CLASSES] = sizeof(VMClass) * prog->nclasses;
+  h.len[DUMP_SWITCHES] = sizeof(VMSwitch) * prog->nswitches;
+  h.len[DUMP_TRIES] = tries;
+  h.len[DUMP_FUNCS] = sizeof(DumpName) * prog->nfuncs;
+  h.len[DUMP_STUBS] = sizeof(DumpStub) * f->nstubs;
+  h.len[DUMP_MEMBERS] = sizeof(int32_t) * members;
+  h.len[DUMP_STRINGS] = strings;
+
+  size_t total = DUMP_ROUND(sizeof(DumpHeader));
+  for (int i = 0; i < DUMP_NSECTIONS; i++) {
+    h.off[i] = total;
+    total = DUMP_ROUND(total + h.len[i]);
+  }
+
+  char *out = (char *)lua_newuserdata(L, total);
+  memset(out, 0, total);
+  memcpy(out, &h, sizeof(DumpHeader));
+
+  memcpy(out + h.off[DUMP_CODE], prog->code, h.len[DUMP_CODE]);
+  if (prog->nconsts)
+    memcpy(out + h.off[DUMP_CONSTS], prog->consts, prog->nconsts);
+  if (prog->nclasses)
+    memcpy(out + h.off[DUMP_CLASSES], prog->classes, h.len[DUMP_CLASSES]);
+  if (prog->nswitches)
+    memcpy(out + h.off[DUMP_SWITCHES], prog->switches, h.len[DUMP_SWITCHES]);
+
+  int32_t *origins = (int32_t *)(out + h.off[DUMP_ORIGINS]);
+  for (int i = 0; i < prog->ncode; i++) {
+    origins[i] = prog->origins[i]
+                     ? dump_stub_index(idx, f->nstubs, prog->origins[i])
+                     : -1;
+  }
+
+  char *tp = out + h.off[DUMP_TRIES];
+  size_t at = sizeof(uint64_t) * prog->ntries;
+  for (int i = 0; i < prog->ntries; i++) {
+    at = DUMP_ROUND(at);
+    uint64_t o = at;
+    memcpy(tp + sizeof(uint64_t) * i, &o, sizeof(uint64_t));
+    memcpy(tp + at, prog->tries[i], ONE_OF_SIZE(prog->tries[i]));
+    at += ONE_OF_SIZE(prog->tries[i]);
+  }
+
+  char *sp = out + h.off[DUMP_STRINGS];
+  size_t used = 0;
+  DumpName *fn = (DumpName *)(out + h.off[DUMP_FUNCS]);
+  for (int i = 0; i < prog->nfuncs; i++) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, prog->funcs[i]);
+    lua_rawget(L, names);
+    size_t len;
+    const char *name = lua_tolstring(L, -1, &len);
+    fn[i].at = (uint32_t)used;
+    fn[i].len = (uint32_t)len;
+    memcpy(sp + used, name, len + 1);
+    used += len + 1;
+    lua_pop(L, 1);
+  }
+
+  DumpStub *ds = (DumpStub *)(out + h.off[DUMP_STUBS]);
+  int32_t *mp = (int32_t *)(out + h.off[DUMP_MEMBERS]);
+  size_t nmembers = 0;
+  for (int i = 0; i < f->nstubs; i++) {
+    Parser *stub = f->stubs[i];
+    ds[i].kind = stub->kind;
+    if (stub->kind == P_LABEL) {
+      const char *name = ((LabelData *)stub->data)->name;
+      size_t len = strlen(name);
+      ds[i].n = (int32_t)len;
+      ds[i].at = (uint32_t)used;
+      memcpy(sp + used, name, len + 1);
+      used += len + 1;
+    } else {
+      OrDispatch *t = ((OrData *)stub->data)->dispatch;
+      ds[i].n = t->n;
+      ds[i].at = (uint32_t)nmembers;
+      for (int k = 0; k < t->n; k++)
+        mp[nmembers++] = dump_stub_index(idx, f->nstubs, t->alts[k]);
+    }
+  }
+
+  lua_pushlstring(L, out, total);
+  return 1;
+}
+
+static int dump_in(const DumpHeader *h, int s, size_t len) {
+  return h->off[s] % DUMP_ALIGN == 0 && h->off[s] <= len &&
+         h->len[s] <= len - h->off[s];
+}
+
+static int verify_same(const VerifyCell *a, const VerifyCell *b) {
+  while (a != b) {
+    if (!a || !b || a->kind != b->kind || a->depth != b->depth)
+      return 0;
+    a = a->next;
+    b = b->next;
+  }
+  return 1;
+}
+
+// 0 if the instruction was reached before in another state
+static int verify_reach(VerifyState *states, int *work, int *nwork, int at,
+                        const VerifyState *s) {
+  VerifyState *t = &states[at];
+  if (t->sub < 0) {
+    *t = *s;
+    work[(*nwork)++] = at;
+    return 1;
+  }
+
+  return t->sub == s->sub && t->depth == s->depth &&
+         verify_same(t->values, s->values) &&
+         verify_same(t->frames, s->frames);
+}
+
+// follows every path vm_run can take and requires each instruction to be
+// reached with the same values and frames whichever way it comes. Frames are
+// only dropped by the instruction that pushed their kind, values are never
+// popped from under the top frame, and subroutines and the program leave
+// exactly one value. Each instruction is walked once, so it uses one cell at
+// most.
+static const char *dump_verify(const DumpHeader *h, const Instr *code,
+                               const VMSwitch *sw) {
+  int n = h->ncode;
+  VerifyState *states = (VerifyState *)malloc(sizeof(VerifyState) * n);
+  VerifyCell *cells = (VerifyCell *)malloc(sizeof(VerifyCell) * n);
+  int *work = (int *)malloc(sizeof(int) * n);
+  if (!states || !cells || !work) {
+    perror("malloc");
+    exit(1);
+  }
+
+  for (int i = 0; i < n; i++)
+    states[i].sub = -1;
+
+  // the program itself runs as subroutine n, which no call can name
+  VerifyState s = {n, 0, NULL, NULL};
+  int nwork = 0;
+  int ncells = 0;
+  verify_reach(states, work, &nwork, 0, &s);
+
+  // vm_run keeps the rest of frame_slots for callback arguments
+  int limit = h->frame_slots - 4;
+  int ok = 1;
+
+  while (ok && nwork > 0) {
+    int at = work[--nwork];
+    const Instr *ip = &code[at];
+    s = states[at];
+
+    int next = at + 1; // -1 if control does not fall through
+    int need = 0;      // the kind of frame the instruction drops
+    int frame = 0;     // the kind it pushes
+    int pops = 0;
+    int push = 0;
+    int table = 0; // the pushed value is a table
+    int keep = 0;  // the pushed value is the popped top
+
+    switch ((OpCode)ip->op) {
+    case OP_LITERAL:
+    case OP_ANY_CHAR:
+    case OP_CHAR_CLASS:
+    case OP_TAKE_WHILE:
+    case OP_TAKE_UNTIL:
+    case OP_ONE_OF:
+      push = 1;
+      break;
+
+    case OP_CHOICE:
+      ok = verify_reach(states, work, &nwork, ip->arg, &s);
+      frame = OP_CHOICE;
+      break;
+
+    case OP_MARK:
+    case OP_LABEL:
+      frame = ip->op;
+      break;
+
+    case OP_COMMIT:
+      need = OP_CHOICE;
+      next = ip->arg;
+      break;
+
+    case OP_LOOP:
+      // the entry moves forward, its alternative must see the same values
+      ok = s.frames && s.frames->kind == OP_CHOICE &&
+           s.frames->depth == s.depth &&
+           verify_reach(states, work, &nwork, ip->arg, &s);
+      need = OP_CHOICE;
+      break;
+
+    case OP_JUMP:
+      next = ip->arg;
+      break;
+
+    case OP_SWITCH:
+      for (int b = 0; b < 257 && ok; b++)
+        ok = verify_reach(states, work, &nwork, sw[ip->aux].target[b], &s);
+      next = -1;
+      break;
+
+    case OP_FAIL:
+      next = -1;
+      break;
+
+    case OP_CALL: {
+      VerifyState entry = {ip->arg, 0, NULL, NULL};
+      ok = verify_reach(states, work, &nwork, ip->arg, &entry);
+      push = 1;
+      break;
+    }
+
+    case OP_RET:
+      ok = s.sub != n && !s.frames && s.depth == 1;
+      next = -1;
+      break;
+
+    case OP_END:
+      ok = s.sub == n && !s.frames && s.depth == 1;
+      next = -1;
+      break;
+
+    case OP_MAP:
+    case OP_AND_THEN:
+      need = OP_MARK;
+      pops = 1;
+      push = 1;
+      break;
+
+    case OP_PRED:
+      need = OP_MARK;
+      pops = 1;
+      push = 1;
+      keep = 1;
+      break;
+
+    case OP_SPAN:
+      need = OP_MARK;
+      pops = !ip->flag;
+      push = 1;
+      break;
+
+    case OP_UNLABEL:
+      need = OP_LABEL;
+      break;
+
+    case OP_POP:
+      pops = 1;
+      break;
+
+    case OP_NIP:
+      pops = 2;
+      push = 1;
+      keep = 1;
+      break;
+
+    case OP_PAIR:
+      pops = 2;
+      push = 1;
+      table = 1;
+      break;
+
+    case OP_NEWTABLE:
+      push = 1;
+      table = 1;
+      break;
+
+    case OP_APPEND:
+      ok = s.depth >= 2 && s.values->next->kind;
+      pops = 1;
+      break;
+
+    case OP_NONEMPTY:
+      ok = s.depth >= 1;
+      break;
+
+    case OP_CUT:
+      break;
+
+    default:
+      ok = 0;
+    }
+
+    if (need) {
+      ok = ok && s.frames && s.frames->kind == need;
+      if (ok)
+        s.frames = s.frames->next;
+    }
+
+    int floor = s.frames ? s.frames->depth : 0;
+    ok = ok && s.depth - pops >= floor;
+    if (!ok)
+      break;
+
+    if (keep)
+      table = s.values->kind;
+    for (int k = 0; k < pops; k++)
+      s.values = s.values->next;
+    s.depth -= pops;
+
+    if (push) {
+      VerifyCell *v = &cells[ncells++];
+      v->next = s.values;
+      v->kind = table;
+      v->depth = 0;
+      s.values = v;
+      s.depth++;
+    }
+    if (frame) {
+      VerifyCell *f = &cells[ncells++];
+      f->next = s.frames;
+      f->kind = frame;
+      f->depth = s.depth;
+      s.frames = f;
+    }
+
+    ok = s.depth <= limit &&
+         (next < 0 || verify_reach(states, work, &nwork, next, &s));
+  }
+
+  free(states);
+  free(cells);
+  free(work);
+  return ok ? NULL : "corrupt dump code";
+}
+
+// NULL if the image holds a program that is safe to run, checking every
+// index an instruction, stub or trie follows and how the code uses the
+// stack and frames
+static const char *dump_check(const DumpHeader *h, const char *image,
+                              size_t len) {
+  uint16_t sizes[6];
+  dump_sizes(sizes);
+  if (memcmp(h->magic, DUMP_MAGIC, 4) != 0)
+    return "not a grammar dump";
+  if (h->version != DUMP_VERSION)
+    return "unsupported dump version";
+  if (h->byte_order != 0x01020304 || memcmp(h->sizes, sizes, sizeof(sizes)))
+    return "dump written for another platform";
+
+  if (h->ncode < 1 || h->nclasses < 0 || h->nswitches < 0 || h->ntries < 0 ||
+      h->nfuncs < 0 || h->nstubs < 0 || h->frame_slots < 1 ||
+      h->frame_slots > 1000000)
+    return "corrupt dump header";
+  for (int s = 0; s < DUMP_NSECTIONS; s++) {
+    if (!dump_in(h, s, len))
+      return "truncated dump";
+  }
+  if (h->len[DUMP_CODE] != sizeof(Instr) * h->ncode ||
+      h->len[DUMP_ORIGINS] != sizeof(int32_t) * h->ncode ||
+      h->len[DUMP_CLASSES] != sizeof(VMClass) * h->nclasses ||
+      h->len[DUMP_SWITCHES] != sizeof(VMSwitch) * h->nswitches ||
+      h->len[DUMP_TRIES] < sizeof(uint64_t) * h->ntries ||
+      h->len[DUMP_FUNCS] != sizeof(DumpName) * h->nfuncs ||
+      h->len[DUMP_STUBS] != sizeof(DumpStub) * h->nstubs ||
+      h->len[DUMP_MEMBERS] % sizeof(int32_t) != 0)
+    return "corrupt dump header";
+
+  const Instr *code = (const Instr *)(image + h->off[DUMP_CODE]);
+  if (code[h->ncode - 1].op != OP_END)
+    return "corrupt dump code";
+  for (int i = 0; i < h->ncode; i++) {
+    const Instr *ip = &code[i];
+    int ok = 1;
+    switch (ip->op) {
+    case OP_LITERAL:
+    case OP_TAKE_UNTIL:
+      ok = ip->aux >= 0 && ip->arg >= 0 &&
+           (uint64_t)ip->aux + (uint64_t)ip->arg <= h->len[DUMP_CONSTS];
+      break;
+    case OP_CHAR_CLASS:
+    case OP_TAKE_WHILE:
+      ok = ip->aux >= 0 && ip->aux < h->nclasses;
+      break;
+    case OP_CHOICE:
+    case OP_COMMIT:
+    case OP_LOOP:
+    case OP_JUMP:
+    case OP_CALL:
+      ok = ip->arg >= 0 && ip->arg < h->ncode;
+      break;
+    case OP_SWITCH:
+      ok = ip->aux >= 0 && ip->aux < h->nswitches;
+      break;
+    case OP_ONE_OF:
+      ok = ip->aux >= 0 && ip->aux < h->ntries && !ip->flag;
+      break;
+    case OP_MAP:
+    case OP_PRED:
+    case OP_AND_THEN:
+      ok = ip->aux >= 0 && ip->aux < h->nfuncs;
+      break;
+    case OP_NODE:
+      ok = 0;
+      break;
+    default:
+      ok = ip->op <= OP_END;
+    }
+    if (!ok)
+      return "corrupt dump code";
+  }
+
+  const VMSwitch *sw = (const VMSwitch *)(image + h->off[DUMP_SWITCHES]);
+  for (int i = 0; i < h->nswitches; i++) {
+    for (int b = 0; b < 257; b++) {
+      if (sw[i].target[b] < 0 || sw[i].target[b] >= h->ncode)
+        return "corrupt dump code";
+    }
+  }
+
+  // the vector kernels keep SCAN_MAX_RANGES ranges on their stack
+  const VMClass *classes = (const VMClass *)(image + h->off[DUMP_CLASSES]);
+  for (int i = 0; i < h->nclasses; i++) {
+    const ScanPlan *plan = &classes[i].plan;
+    if (plan->nranges < 0 || plan->nranges > SCAN_MAX_RANGES ||
+        (plan->negate != 0 && plan->negate != 1))
+      return "corrupt dump classes";
+  }
+
+  const char *bad = dump_verify(h, code, sw);
+  if (bad)
+    return bad;
+
+  const int32_t *origins = (const int32_t *)(image + h->off[DUMP_ORIGINS]);
+  for (int i = 0; i < h->ncode; i++) {
+    // a failing label always reports itself
+    if (origins[i] < -1 || origins[i] >= h->nstubs ||
+        (code[i].op == OP_LABEL && origins[i] < 0))
+      return "corrupt dump origins";
+  }
+
+  const char *strings = image + h->off[DUMP_STRINGS];
+  size_t nstrings = h->len[DUMP_STRINGS];
+  const DumpName *fn = (const DumpName *)(image + h->off[DUMP_FUNCS]);
+  for (int i = 0; i < h->nfuncs; i++) {
+    if ((uint64_t)fn[i].at + fn[i].len >= nstrings ||
+        strings[fn[i].at + fn[i].len] != '\0')
+      return "corrupt dump names";
+  }
+
+  const DumpStub *ds = (const DumpStub *)(image + h->off[DUMP_STUBS]);
+  const int32_t *members = (const int32_t *)(image + h->off[DUMP_MEMBERS]);
+  size_t nmembers = h->len[DUMP_MEMBERS] / sizeof(int32_t);
+  for (int i = 0; i < h->nstubs; i++) {
+    if (ds[i].n < 0)
+      return "corrupt dump stubs";
+    if (ds[i].kind == P_LABEL) {
+      if ((uint64_t)ds[i].at + (uint64_t)ds[i].n >= nstrings ||
+          strings[ds[i].at + ds[i].n] != '\0')
+        return "corrupt dump stubs";
+      continue;
+    }
+    if (ds[i].kind != P_OR_ELSE || ds[i].n > EXPECT_MAX ||
+        (uint64_t)ds[i].at + (uint64_t)ds[i].n > nmembers)
+      return "corrupt dump stubs";
+    for (int k = 0; k < ds[i].n; k++) {
+      int32_t m = members[ds[i].at + k];
+      if (m < 0 || m >= h->nstubs || ds[m].kind != P_LABEL)
+        return "corrupt dump stubs";
+    }
+  }
+
+  const char *tp = image + h->off[DUMP_TRIES];
+  size_t ntp = h->len[DUMP_TRIES];
+  for (int i = 0; i < h->ntries; i++) {
+    uint64_t o;
+    memcpy(&o, tp + sizeof(uint64_t) * i, sizeof(uint64_t));
+    if (o % 8 != 0 || o > ntp || ntp - o < sizeof(OneOfData))
+      return "corrupt dump tries";
+
+    const OneOfData *t = (const OneOfData *)(tp + o);
+    if (t->nnodes < 1 || t->nedges < 0 || t->nwords < 0 ||
+        t->values_ref != LUA_NOREF ||
+        (uint64_t)t->nnodes > ntp || (uint64_t)t->nedges > ntp ||
+        ONE_OF_SIZE(t) > ntp - o)
+      return "corrupt dump tries";
+
+    const TrieEdge *edges = ONE_OF_EDGES(t);
+    for (int n = 0; n < t->nnodes; n++) {
+      const TrieNode *node = &t->nodes[n];
+      if (node->first_edge < 0 || node->nedges < 0 ||
+          (int64_t)node->first_edge + node->nedges > t->nedges ||
+          node->word < -1 || node->word >= t->nwords)
+        return "corrupt dump tries";
+    }
+    for (int e = 0; e < t->nedges; e++) {
+      if (edges[e].child < 0 || edges[e].child >= t->nnodes)
+        return "corrupt dump tries";
+    }
+  }
+
+  return NULL;
+}
+
+// takes over the image, releasing it on errors too. callbacks is the index
+// of the table the named callbacks are bound from, 0 for none
+static Frozen *dump_load(lua_State *L, void *image, size_t len, int mapped,
+                         int callbacks) {
+  const DumpHeader *h = (const DumpHeader *)image;
+  const char *err = len < sizeof(DumpHeader) ? "truncated dump"
+                                             : dump_check(h, image, len);
+
+  // every name has to be bound before anything is allocated
+  const DumpName *fn = NULL;
+  const char *strings = NULL;
+  if (!err) {
+    fn = (const DumpName *)((char *)image + h->off[DUMP_FUNCS]);
+    strings = (char *)image + h->off[DUMP_STRINGS];
+    for (int i = 0; i < h->nfuncs && !err; i++) {
+      if (callbacks)
+        lua_getfield(L, callbacks, strings + fn[i].at);
+      else
+        lua_pushnil(L);
+      if (!lua_isfunction(L, -1)) {
+        lua_pushfstring(L, "no callback named %s", strings + fn[i].at);
+        err = lua_tostring(L, -1);
+      }
+      lua_pop(L, err ? 0 : 1);
+    }
+  }
+  if (err) {
+    if (mapped)
+      munmap(image, len);
+    else
+      free(image);
+    luaL_error(L, "cannot load grammar: %s", err);
+    return NULL;
+  }
+
+  Frozen *f = (Frozen *)calloc(1, sizeof(Frozen));
+  if (!f) {
+    perror("calloc");
+    exit(1);
+  }
+  atomic_init(&f->refcount, 1);
+  f->image = image;
+  f->image_len = len;
+  f->mapped = mapped;
+
+  char *base = (char *)image;
+  Program *prog = &f->prog;
+  prog->code = (Instr *)(base + h->off[DUMP_CODE]);
+  prog->ncode = h->ncode;
+  prog->consts = base + h->off[DUMP_CONSTS];
+  prog->nconsts = h->len[DUMP_CONSTS];
+  prog->classes = (VMClass *)(base + h->off[DUMP_CLASSES]);
+  prog->nclasses = h->nclasses;
+  prog->switches = (VMSwitch *)(base + h->off[DUMP_SWITCHES]);
+  prog->nswitches = h->nswitches;
+  prog->frame_slots = h->frame_slots;
+
+  prog->origins = (Parser **)calloc(h->ncode, sizeof(Parser *));
+  prog->tries = (const OneOfData **)calloc(h->ntries + 1, sizeof(OneOfData *));
+  prog->funcs = (int *)calloc(h->nfuncs + 1, sizeof(int));
+  f->stubs = (Parser **)calloc(h->nstubs + 1, sizeof(Parser *));
+  if (!prog->origins || !prog->tries || !prog->funcs || !f->stubs) {
+    perror("calloc");
+    exit(1);
+  }
+
+  const char *tp = base + h->off[DUMP_TRIES];
+  for (int i = 0; i < h->ntries; i++) {
+    uint64_t o;
+    memcpy(&o, tp + sizeof(uint64_t) * i, sizeof(uint64_t));
+    prog->tries[i] = (const OneOfData *)(tp + o);
+  }
+  prog->ntries = h->ntries;
+
+  for (int i = 0; i < h->nfuncs; i++) {
+    lua_getfield(L, callbacks, strings + fn[i].at);
+    prog->funcs[i] = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  prog->nfuncs = h->nfuncs;
+  if (h->nfuncs > 0)
+    f->owner = L;
+
+  // the stubs, labels first so the or_else ones can point at them
+  const DumpStub *ds = (const DumpStub *)(base + h->off[DUMP_STUBS]);
+  const int32_t *members = (const int32_t *)(base + h->off[DUMP_MEMBERS]);
+  size_t align = sizeof(max_align_t);
+  size_t total = 0;
+  for (int i = 0; i < h->nstubs; i++) {
+    size_t size = sizeof(Parser) + (ds[i].kind == P_LABEL
+                                         ? sizeof(LabelData) + ds[i].n + 1
+                                         : sizeof(OrData) + sizeof(OrDispatch) +
+                                               sizeof(Parser *) * ds[i].n);
+    total += (size + align - 1) / align * align;
+  }
+  f->stub_block = (Parser *)calloc(1, total + 1);
+  if (!f->stub_block) {
+    perror("calloc");
+    exit(1);
+  }
+
+  char *at = (char *)f->stub_block;
+  for (int i = 0; i < h->nstubs; i++) {
+    Parser *stub = (Parser *)at;
+    stub->kind = (ParserKind)ds[i].kind;
+    stub->refcount = 1;
+    stub->lua_ref = LUA_NOREF;
+    f->stubs[i] = stub;
+
+    size_t size = sizeof(Parser);
+    if (ds[i].kind == P_LABEL) {
+      memcpy(((LabelData *)stub->data)->name, strings + ds[i].at,
+             (size_t)ds[i].n + 1);
+      size += sizeof(LabelData) + ds[i].n + 1;
+    } else {
+      size += sizeof(OrData) + sizeof(OrDispatch) + sizeof(Parser *) * ds[i].n;
+    }
+    at += (size + align - 1) / align * align;
+  }
+  f->nstubs = h->nstubs;
+
+  for (int i = 0; i < h->nstubs; i++) {
+    if (ds[i].kind == P_LABEL)
+      continue;
+    OrData *d = (OrData *)f->stubs[i]->data;
+    OrDispatch *t = (OrDispatch *)(d + 1);
+    t->alts = (Parser **)(t + 1);
+    t->masks = freeze_no_masks;
+    for (int k = 0; k < ds[i].n; k++)
+      t->alts[t->n++] = f->stubs[members[ds[i].at + k]];
+    d->dispatch = t;
+  }
+
+  const int32_t *origins = (const int32_t *)(base + h->off[DUMP_ORIGINS]);
+  for (int i = 0; i < h->ncode; i++)
+    prog->origins[i] = origins[i] >= 0 ? f->stubs[origins[i]] : NULL;
+
+  return f;
+}
+
+/* parser.load(bytes [, callbacks]) */
+static int l_parser_load(lua_State *L) {
+  size_t len;
+  const char *bytes = luaL_checklstring(L, 1, &len);
+  int callbacks = lua_istable(L, 2) ? 2 : 0;
+
+  // one aligned copy the program runs from
+  void *image = NULL;
+  if (posix_memalign(&image, DUMP_ALIGN, len ? len : 1) != 0) {
+    perror("posix_memalign");
+    exit(1);
+  }
+  memcpy(image, bytes, len);
+
+  push_frozen(L, dump_load(L, image, len, 0, callbacks));
+  return 1;
+}
+
+/* parser.load_file(path [, callbacks]) */
+static int l_parser_load_file(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  int callbacks = lua_istable(L, 2) ? 2 : 0;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return luaL_error(L, "cannot open %s: %s", path, strerror(errno));
+
+  struct stat sb;
+  if (fstat(fd, &sb) != 0) {
+    int err = errno;
+    close(fd);
+    return luaL_error(L, "cannot stat %s: %s", path, strerror(err));
+  }
+
+  size_t len = (size_t)sb.st_size;
+  if (len < sizeof(DumpHeader)) {
+    close(fd);
+    return luaL_error(L, "cannot load grammar: truncated dump");
+  }
+
+  void *image = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (image == MAP_FAILED) {
+    int err = errno;
+    close(fd);
+    return luaL_error(L, "cannot map %s: %s", path, strerror(err));
+  }
+  close(fd);
+
+  push_frozen(L, dump_load(L, image, len, 1, callbacks));
+  return 1;
+}
+
+/* ---------------------------
+   parallel records
+   --------------------------- */
+
+// parses one record on L, leaving the output on top if it succeeds. A record
+// has to be consumed whole
+static int record_parse(lua_State *L, Parser *p, Program *prog,
+                        const char *input, size_t len, int input_idx,
+                        ParseError *err) {
+  ParseContext ctx = {L, {input, len}, input_idx, NULL, 0, 0, 0, {0}, NULL, 0};
+  memo_reserve(&ctx);
+  ParseResult r = prog ? vm_run(prog, &ctx, 0) : parser_run(p, &ctx, 0);
+  memo_release(&ctx);
+
+  *err = ctx.err;
+  if (r.ok && r.pos == len)
+    return 1;
+
+  if (r.ok) {
+    lua_pop(L, 1);
+    // nothing got further than where the parse stopped short
+    if (err->pos < r.pos) {
+      err->pos = r.pos;
+      err->n = 0;
+    }
+  }
+  return 0;
+}
+
+static void ir_put(RecordBuf *b, const void *src, size_t n) {
+  if (b->len + n > b->cap) {
+    size_t cap = b->cap ? b->cap * 2 : 4096;
+    while (cap < b->len + n)
+      cap *= 2;
+    b->data = (char *)realloc(b->data, cap);
+    if (!b->data) {
+      perror("realloc");
+      exit(1);
+    }
+    b->cap = cap;
+  }
+
+  memcpy(b->data + b->len, src, n);
+  b->len += n;
+}
+
+static void ir_encode(lua_State *W, int idx, RecordBuf *b) {
+  idx = lua_absindex(W, idx);
+  unsigned char tag;
+
+  switch (lua_type(W, idx)) {
+  case LUA_TBOOLEAN:
+    tag = lua_toboolean(W, idx) ? IR_TRUE : IR_FALSE;
+    ir_put(b, &tag, 1);
+    break;
+
+  case LUA_TNUMBER:
+    if (lua_isinteger(W, idx)) {
+      lua_Integer i = lua_tointeger(W, idx);
+      tag = IR_INT;
+      ir_put(b, &tag, 1);
+      ir_put(b, &i, sizeof(i));
+    } else {
+      lua_Number n = lua_tonumber(W, idx);
+      tag = IR_NUM;
+      ir_put(b, &tag, 1);
+      ir_put(b, &n, sizeof(n));
+    }
+    break;
+
+  case LUA_TSTRING: {
+    size_t len;
+    const char *str = lua_tolstring(W, idx, &len);
+    tag = IR_STR;
+    ir_put(b, &tag, 1);
+    ir_put(b, &len, sizeof(len));
+    ir_put(b, str, len);
+    break;
+  }
+
+  case LUA_TTABLE: {
+    luaL_checkstack(W, 3, NULL);
+
+    // outputs are nearly always sequences, those keep their array part
+    size_t n = (size_t)lua_rawlen(W, idx);
+    size_t count = 0;
+    lua_pushnil(W);
+    while (lua_next(W, idx)) {
+      count++;
+      lua_pop(W, 1);
+    }
+
+    if (count == n) {
+      tag = IR_LIST;
+      ir_put(b, &tag, 1);
+      ir_put(b, &n, sizeof(n));
+      for (size_t i = 1; i <= n; i++) {
+        lua_rawgeti(W, idx, (lua_Integer)i);
+        ir_encode(W, -1, b);
+        lua_pop(W, 1);
+      }
+      break;
+    }
+
+    tag = IR_MAP;
+    ir_put(b, &tag, 1);
+    ir_put(b, &count, sizeof(count));
+    lua_pushnil(W);
+    while (lua_next(W, idx)) {
+      ir_encode(W, -2, b);
+      ir_encode(W, -1, b);
+      lua_pop(W, 1);
+    }
+    break;
+  }
+
+  default:
+    // a frozen grammar produces nothing else
+    tag = IR_NIL;
+    ir_put(b, &tag, 1);
+  }
+}
+
+static void ir_decode(lua_State *L, const char **s) {
+  luaL_checkstack(L, 3, NULL);
+  unsigned char tag = (unsigned char)*(*s)++;
+  size_t n;
+
+  switch (tag) {
+  case IR_FALSE:
+  case IR_TRUE:
+    lua_pushboolean(L, tag == IR_TRUE);
+    break;
+
+  case IR_INT: {
+    lua_Integer i;
+    memcpy(&i, *s, sizeof(i));
+    *s += sizeof(i);
+    lua_pushinteger(L, i);
+    break;
+  }
+
+  case IR_NUM: {
+    lua_Number num;
+    memcpy(&num, *s, sizeof(num));
+    *s += sizeof(num);
+    lua_pushnumber(L, num);
+    break;
+  }
+
+  case IR_STR:
+    memcpy(&n, *s, sizeof(n));
+    *s += sizeof(n);
+    lua_pushlstring(L, *s, n);
+    *s += n;
+    break;
+
+  case IR_LIST:
+    memcpy(&n, *s, sizeof(n));
+    *s += sizeof(n);
+    lua_createtable(L, n < INT_MAX ? (int)n : 0, 0);
+    for (size_t i = 1; i <= n; i++) {
+      ir_decode(L, s);
+      lua_rawseti(L, -2, (lua_Integer)i);
+    }
+    break;
+
+  case IR_MAP:
+    memcpy(&n, *s, sizeof(n));
+    *s += sizeof(n);
+    lua_createtable(L, 0, n < INT_MAX ? (int)n : 0);
+    for (size_t i = 0; i < n; i++) {
+      ir_decode(L, s);
+      ir_decode(L, s);
+      lua_rawset(L, -3);
+    }
+    break;
+
+  default:
+    lua_pushnil(L);
+  }
+}
+
+// parses and encodes one record under lua_pcall, an error it raises goes
+// back to the calling thread instead of the worker state's panic handler
+static int records_step(lua_State *W) {
+  RecordWorker *w = (RecordWorker *)lua_touserdata(W, 1);
+  RecordJob *job = w->job;
+  RecordBuf *b = &job->bufs[w->id];
+  Record *rec = &job->records[w->at];
+
+  ParseError err;
+  rec->worker = w->id;
+  rec->out = b->len;
+  rec->ok = record_parse(W, NULL, job->prog, job->input + rec->start,
+                         rec->len, 0, &err);
+  if (rec->ok)
+    ir_encode(W, -1, b);
+  else
+    ir_put(b, &err, sizeof(err));
+  return 0;
+}
+
+// records are claimed in order, so the first error a worker meets is the
+// first among the records it would parse and it stops there
+static void records_fail(RecordWorker *w, size_t at, const char *msg) {
+  w->first = at;
+  w->error = strdup(msg ? msg : "(error object is not a string)");
+  if (!w->error) {
+    perror("strdup");
+    exit(1);
+  }
+}
+
+static void *records_worker(void *arg) {
+  RecordWorker *w = (RecordWorker *)arg;
+  RecordJob *job = w->job;
+
+  // values only ever live here long enough to be encoded
+  lua_State *W = luaL_newstate();
+  if (!W) {
+    records_fail(w, 0, "parse_records: cannot create a worker state");
+    return NULL;
+  }
+
+  for (;;) {
+    size_t first = atomic_fetch_add_explicit(&job->next, RECORDS_BATCH,
+                                             memory_order_relaxed);
+    if (first >= job->nrecords)
+      break;
+
+    size_t last = first + RECORDS_BATCH;
+    if (last > job->nrecords)
+      last = job->nrecords;
+
+    for (size_t i = first; i < last; i++) {
+      w->at = i;
+      lua_pushcfunction(W, records_step);
+      lua_pushlightuserdata(W, w);
+      if (lua_pcall(W, 1, 0, 0) != LUA_OK) {
+        records_fail(w, i, lua_tostring(W, -1));
+        lua_close(W);
+        return NULL;
+      }
+      lua_settop(W, 0);
+    }
+  }
+
+  lua_close(W);
+  return NULL;
+}
+
+// fills job->records if it is set, returns the number of records. An empty
+// record after the last separator does not count
+static size_t records_split(RecordJob *job, const char *input, size_t len,
+                            char sep) {
+  size_t n = 0;
+  size_t start = 0;
+  while (start < len) {
+    const char *end = memchr(input + start, sep, len - start);
+    size_t stop = end ? (size_t)(end - input) : len;
+    if (job->records) {
+      job->records[n].start = start;
+      job->records[n].len = stop - start;
+    }
+    n++;
+    start = stop + 1;
+  }
+  return n;
+}
 
-  // for custom lua user values
+// a ParseError for one record, positions count from the record's start
+static void records_push_error(lua_State *L, const char *rec, size_t len,
+                               const ParseError *err) {
+  lua_pushlstring(L, rec, len);
+  ParseContext ctx = {L, {rec, len}, lua_gettop(L), NULL, 0, 0, 0, *err, NULL, 0};
+  push_parse_error(L, &ctx, ctx.input_idx);
+  lua_remove(L, -2);
+}
+
+static void records_free(RecordJob *job) {
+  for (int i = 0; job->bufs && i < job->nworkers; i++)
+    free(job->bufs[i].data);
+  for (int i = 0; job->workers && i < job->nworkers; i++)
+    free(job->workers[i].error);
+  free(job->bufs);
+  free(job->workers);
+  free(job->records);
+  job->bufs = NULL;
+  job->workers = NULL;
+  job->records = NULL;
+}
+
+static int records_gc(lua_State *L) {
+  records_free((RecordJob *)luaL_checkudata(L, 1, "ParserRecords"));
+  return 0;
+}
+
+/* parser.parse_records(p, input [, opts]), opts.sep is the separator byte,
+   "\n" by default, opts.threads how many threads parse, all cores by
+   default */
+static int l_parser_parse_records(lua_State *L) {
+  Parser *p = NULL;
+  Frozen *f = NULL;
+  if (luaL_testudata(L, 1, "ParserFrozen"))
+    f = check_frozen(L, 1);
+  else
+    p = check_parser_ud(L, 1);
+
+  size_t len;
+  const char *input = luaL_checklstring(L, 2, &len);
+
+  char sep = '\n';
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  lua_Integer threads = cores > 0 ? cores : 1;
+  if (lua_istable(L, 3)) {
+    lua_getfield(L, 3, "sep");
+    if (!lua_isnil(L, -1)) {
+      size_t n;
+      const char *s = luaL_checklstring(L, -1, &n);
+      if (n != 1)
+        return luaL_error(L, "parse_records: sep must be a single byte");
+      sep = s[0];
+    }
+    lua_getfield(L, 3, "threads");
+    if (!lua_isnil(L, -1)) {
+      threads = luaL_checkinteger(L, -1);
+      luaL_argcheck(L, threads >= 1, 3, "threads must be at least 1");
+    }
+    lua_pop(L, 2);
+  }
+  lua_settop(L, 2);
+
+  RecordJob *job = (RecordJob *)lua_newuserdata(L, sizeof(RecordJob));
+  memset(job, 0, sizeof(RecordJob));
+  luaL_getmetatable(L, "ParserRecords");
+  lua_setmetatable(L, -2);
+
+  size_t n = records_split(job, input, len, sep);
+  size_t nbatches = (n + RECORDS_BATCH - 1) / RECORDS_BATCH;
+  if ((size_t)threads > nbatches)
+    threads = (lua_Integer)nbatches;
+
+  // the grammar has to be frozen to run elsewhere, what cannot be frozen
+  // is parsed here
+  if (p && threads > 1) {
+    const char *why;
+    f = freeze_program(L, p, 0, &why);
+    if (f)
+      push_frozen(L, f);
+  }
+
+  lua_createtable(L, n < INT_MAX ? (int)n : 0, 0);
+  int outs = lua_gettop(L);
+  lua_newtable(L);
+  int errs = lua_gettop(L);
+
+  if (!f || f->owner || threads <= 1) {
+    size_t start = 0;
+    for (size_t i = 1; start < len; i++) {
+      const char *end = memchr(input + start, sep, len - start);
+      size_t stop = end ? (size_t)(end - input) : len;
+
+      // the record doubles as the input a custom parser may ask for
+      lua_pushlstring(L, input + start, stop - start);
+      ParseError err;
+      if (record_parse(L, p, f ? &f->prog : NULL, input + start, stop - start,
+                       lua_gettop(L), &err)) {
+        lua_rawseti(L, outs, (lua_Integer)i);
+      } else {
+        lua_pushboolean(L, 0);
+        lua_rawseti(L, outs, (lua_Integer)i);
+        records_push_error(L, input + start, stop - start, &err);
+        lua_rawseti(L, errs, (lua_Integer)i);
+      }
+      lua_settop(L, errs);
+      start = stop + 1;
+    }
+    return 2;
+  }
+
+  job->prog = &f->prog;
+  job->input = input;
+  job->nrecords = n;
+  job->nworkers = (int)threads;
+  job->records = (Record *)malloc(sizeof(Record) * n);
+  job->bufs = (RecordBuf *)calloc(job->nworkers, sizeof(RecordBuf));
+  job->workers = (RecordWorker *)calloc(job->nworkers, sizeof(RecordWorker));
+  if (!job->records || !job->bufs || !job->workers) {
+    perror("malloc");
+    exit(1);
+  }
+  atomic_init(&job->next, 0);
+  records_split(job, input, len, sep);
+
+  // the calling thread is worker 0, whoever could not be started leaves
+  // more for the rest
+  pthread_t *tids = (pthread_t *)calloc(job->nworkers, sizeof(pthread_t));
+  int *started = (int *)calloc(job->nworkers, sizeof(int));
+  if (!tids || !started) {
+    perror("calloc");
+    exit(1);
+  }
+  for (int i = 0; i < job->nworkers; i++) {
+    job->workers[i].job = job;
+    job->workers[i].id = i;
+    if (i > 0)
+      started[i] = pthread_create(&tids[i], NULL, records_worker,
+                                  &job->workers[i]) == 0;
+  }
+  records_worker(&job->workers[0]);
+  for (int i = 1; i < job->nworkers; i++) {
+    if (started[i])
+      pthread_join(tids[i], NULL);
+  }
+  free(tids);
+  free(started);
+
+  // raised where parsing the records in order would have raised
+  RecordWorker *failed = NULL;
+  for (int i = 0; i < job->nworkers; i++) {
+    RecordWorker *w = &job->workers[i];
+    if (w->error && (!failed || w->first < failed->first))
+      failed = w;
+  }
+  if (failed) {
+    lua_pushstring(L, failed->error);
+    records_free(job);
+    return lua_error(L);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    Record *rec = &job->records[i];
+    const char *s = job->bufs[rec->worker].data + rec->out;
+    if (rec->ok) {
+      ir_decode(L, &s);
+      lua_rawseti(L, outs, (lua_Integer)i + 1);
+      continue;
+    }
+
+    ParseError err;
+    memcpy(&err, s, sizeof(err));
+    lua_pushboolean(L, 0);
+    lua_rawseti(L, outs, (lua_Integer)i + 1);
+    records_push_error(L, input + rec->start, rec->len, &err);
+    lua_rawseti(L, errs, (lua_Integer)i + 1);
+  }
+
+  // the buffers can go before the collector gets to the job
+  records_free(job);
+  return 2;
+}
+
+/* ---------------------------
+   profiling
+   --------------------------- */
+
+static double profile_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static ProfileEntry *profile_entry(Profile *prof, Parser *p) {
+  if (p->kind == P_COMPILED)
+    p = ((CompiledData *)p->data)->source;
+
+  if ((prof->count + 1) * 2 > prof->cap) {
+    size_t cap = prof->cap ? prof->cap * 2 : 64;
+    ProfileEntry *entries = (ProfileEntry *)calloc(cap, sizeof(ProfileEntry));
+    if (!entries) {
+      perror("calloc");
+      exit(1);
+    }
+
+    for (size_t i = 0; i < prof->cap; i++) {
+      ProfileEntry *e = &prof->entries[i];
+      if (!e->node)
+        continue;
+      size_t j = memo_hash(e->node, 0) & (cap - 1);
+      while (entries[j].node)
+        j = (j + 1) & (cap - 1);
+      entries[j] = *e;
+    }
+
+    free(prof->entries);
+    prof->entries = entries;
+    prof->cap = cap;
+  }
+
+  size_t i = memo_hash(p, 0) & (prof->cap - 1);
+  while (prof->entries[i].node && prof->entries[i].node != p)
+    i = (i + 1) & (prof->cap - 1);
+
+  ProfileEntry *e = &prof->entries[i];
+  if (!e->node) {
+    e->node = p;
+    prof->count++;
+  }
+  return e;
+}
+
+static ParseResult profile_run(Parser *p, ParseContext *ctx, size_t pos) {
+  Profile *prof = ctx->prof;
+
+  // the VM would hide every node below it
+  if (p->kind == P_COMPILED)
+    p = ((CompiledData *)p->data)->source;
+
+  double outer = prof->child;
+  prof->child = 0;
+  double start = profile_now();
+
+  ParseResult r;
+  if (ctx->memo_all && p->kind != P_LITERAL && p->kind != P_ANY_CHAR &&
+      p->kind != P_ONE_OF && p->kind != P_MEMO)
+    r = memo_run(p, ctx, pos);
+  else
+    r = p->parse(p, ctx, pos);
+
+  double took = profile_now() - start;
+
+  // looked up after the run, nested calls may have grown the table
+  ProfileEntry *e = profile_entry(prof, p);
+  e->calls++;
+  if (r.ok) {
+    e->ok++;
+    e->bytes += r.pos - pos;
+  } else {
+    e->fail++;
+  }
+  e->time += took;
+  e->self += took - prof->child;
+
+  prof->child = outer + took;
+  return r;
+}
+
+static void profile_count(lua_State *L, const char *field, size_t n) {
+  lua_getfield(L, -1, field);
+  lua_pushinteger(L, lua_tointeger(L, -1) + (lua_Integer)n);
+  lua_setfield(L, -3, field);
+  lua_pop(L, 1);
+}
+
+static void profile_time(lua_State *L, const char *field, double t) {
+  lua_getfield(L, -1, field);
+  lua_pushnumber(L, lua_tonumber(L, -1) + t);
+  lua_setfield(L, -3, field);
+  lua_pop(L, 1);
+}
+
+// one row per label, nodes sharing a label are added up. Nodes without one
+// get a row each, named after their kind and numbered
+static void profile_push_report(lua_State *L, Profile *prof) {
   lua_newtable(L);
+  int unnamed = 0;
+
+  for (size_t i = 0; i < prof->cap; i++) {
+    ProfileEntry *e = &prof->entries[i];
+    if (!e->node)
+      continue;
+
+    int named = 0;
+    if (e->node->lua_ref != LUA_NOREF) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, e->node->lua_ref);
+      lua_getuservalue(L, -1);
+      lua_getfield(L, -1, "inspect");
+      named = lua_isstring(L, -1);
+      if (named) {
+        lua_replace(L, -3);
+        lua_pop(L, 1);
+      } else {
+        lua_pop(L, 3);
+      }
+    }
+    if (!named)
+      lua_pushfstring(L, "%s#%d", parser_kind_name(e->node), ++unnamed);
+
+    // report[label], created on first use
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      lua_createtable(L, 0, 7);
+      lua_pushvalue(L, -2);
+      lua_pushvalue(L, -2);
+      lua_rawset(L, -5);
+    }
+
+    profile_count(L, "calls", e->calls);
+    profile_count(L, "ok", e->ok);
+    profile_count(L, "fail", e->fail);
+    profile_count(L, "bytes", e->bytes);
+    profile_count(L, "backtracks", e->backtracks);
+    profile_time(L, "time", e->time);
+    profile_time(L, "self", e->self);
+    lua_pop(L, 2); // row, label
+  }
+}
+
+static int profile_gc(lua_State *L) {
+  Profile *prof = (Profile *)luaL_checkudata(L, 1, "ParserProfile");
+  free(prof->entries);
+  prof->entries = NULL;
+  return 0;
+}
+
+static int l_parser_profile(lua_State *L) {
+  Parser *p = check_parser_ud(L, 1);
+  size_t len;
+  const char *input = luaL_checklstring(L, 2, &len);
+
+  int memo_all = 0;
+  if (lua_istable(L, 3)) {
+    lua_getfield(L, 3, "memo");
+    memo_all = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  lua_settop(L, 3);
+
+  // in slot 4, the counters go with it if the parse raises
+  Profile *prof = (Profile *)lua_newuserdata(L, sizeof(Profile));
+  memset(prof, 0, sizeof(Profile));
+  luaL_setmetatable(L, "ParserProfile");
+
+  ParseContext ctx = {L, {input, len}, 2, NULL, memo_all, 0, 0, {0}, prof, 0};
+  memo_reserve(&ctx);
+  ParseResult r = parser_run(p, &ctx, 0);
+  memo_release(&ctx);
+
+  if (!r.ok)
+    lua_pushnil(L);
+  lua_pushlstring(L, input + r.pos, len - r.pos);
+
+  profile_push_report(L, prof);
+  free(prof->entries);
+  prof->entries = NULL;
+
+  lua_insert(L, -3);
+  return 3;
+}
+
+/* ---------------------------
+   parse errors
+   --------------------------- */
+
+// the keywords of a one_of trie, in byte order
+static void one_of_describe(luaL_Buffer *b, OneOfData *d, int node, char *path,
+                            size_t depth, int *count) {
+  const TrieNode *n = &d->nodes[node];
+  if (n->word >= 0) {
+    luaL_addstring(b, (*count)++ ? ", \"" : "one of \"");
+    luaL_addlstring(b, path, depth);
+    luaL_addchar(b, '"');
+  }
+
+  if (depth == 64) // enough to tell which keywords were meant
+    return;
+
+  for (int i = 0; i < n->nedges; i++) {
+    const TrieEdge *e = &ONE_OF_EDGES(d)[n->first_edge + i];
+    path[depth] = (char)e->byte;
+    one_of_describe(b, d, e->child, path, depth + 1, count);
+  }
+}
+
+// pushes how an expected parser reads in an error message, its inspect
+// string if it was given one
+static void expect_describe(lua_State *L, Parser *p) {
+  if (p->lua_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, p->lua_ref);
+    lua_getuservalue(L, -1);
+    lua_getfield(L, -1, "inspect");
+    if (lua_isstring(L, -1)) {
+      lua_replace(L, -3);
+      lua_pop(L, 1);
+      return;
+    }
+    lua_pop(L, 3);
+  }
+
+  switch (p->kind) {
+  case P_LITERAL:
+    lua_pushfstring(L, "\"%s\"", ((LiteralData *)p->data)->lit);
+    break;
+  case P_ANY_CHAR:
+    lua_pushliteral(L, "any character");
+    break;
+  case P_CHAR_CLASS:
+    lua_pushstring(L, ((CharClassData *)p->data)->spec);
+    break;
+  case P_TAKE_WHILE:
+    lua_pushstring(L, ((TakeWhileData *)p->data)->spec);
+    break;
+  case P_TAKE_UNTIL:
+    lua_pushfstring(L, "\"%s\"", ((TakeUntilData *)p->data)->mark);
+    break;
+  case P_ONE_OF: {
+    luaL_Buffer b;
+    char path[64];
+    int count = 0;
+    luaL_buffinit(L, &b);
+    one_of_describe(&b, (OneOfData *)p->data, 0, path, 0, &count);
+    luaL_pushresult(&b);
+    break;
+  }
+  case P_LABEL:
+    lua_pushstring(L, ((LabelData *)p->data)->name);
+    break;
+  default:
+    lua_pushliteral(L, "?");
+  }
+}
+
+static void push_parse_error(lua_State *L, ParseContext *ctx, int input_idx) {
+  input_idx = lua_absindex(L, input_idx);
+  luaL_checkstack(L, 6, NULL);
+
+  ParseErrorUD *e = (ParseErrorUD *)lua_newuserdata(L, sizeof(ParseErrorUD));
+  e->pos = ctx->err.pos;
+  e->line = 0;
+  e->column = 0;
+  luaL_getmetatable(L, "ParseError");
+  lua_setmetatable(L, -2);
+
+  // the input stays around for line and column
+  lua_createtable(L, 0, 2);
+  lua_pushvalue(L, input_idx);
+  lua_setfield(L, -2, "input");
+
+  lua_createtable(L, ctx->err.n, 0);
+  for (int i = 0; i < ctx->err.n; i++) {
+    expect_describe(L, ctx->err.expected[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "expected");
+
   lua_setuservalue(L, -2);
+}
 
-  lua_pushvalue(L, -1);
-  p->lua_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+// counted once, on first use
+static void parse_error_locate(lua_State *L, ParseErrorUD *e) {
+  if (e->line > 0)
+    return;
+
+  lua_getuservalue(L, 1);
+  lua_getfield(L, -1, "input");
+  size_t len;
+  const char *s = lua_tolstring(L, -1, &len);
+  size_t end = e->pos < len ? e->pos : len;
+
+  size_t line = 1;
+  size_t start = 0;
+  const char *nl;
+  while ((nl = memchr(s + start, '\n', end - start)) != NULL) {
+    line++;
+    start = (size_t)(nl - s) + 1;
+  }
+
+  e->line = line;
+  e->column = end - start + 1;
+  lua_pop(L, 2);
+}
+
+/* err.pos (1-based), err.line, err.column, err.expected */
+static int parse_error_index(lua_State *L) {
+  ParseErrorUD *e = (ParseErrorUD *)luaL_checkudata(L, 1, "ParseError");
+  const char *key = luaL_checkstring(L, 2);
+
+  if (strcmp(key, "pos") == 0) {
+    lua_pushinteger(L, (lua_Integer)e->pos + 1);
+  } else if (strcmp(key, "line") == 0) {
+    parse_error_locate(L, e);
+    lua_pushinteger(L, (lua_Integer)e->line);
+  } else if (strcmp(key, "column") == 0) {
+    parse_error_locate(L, e);
+    lua_pushinteger(L, (lua_Integer)e->column);
+  } else if (strcmp(key, "expected") == 0) {
+    lua_getuservalue(L, 1);
+    lua_getfield(L, -1, "expected");
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+/* "line 3, column 7: expected "," or "}"" */
+static int parse_error_tostring(lua_State *L) {
+  ParseErrorUD *e = (ParseErrorUD *)luaL_checkudata(L, 1, "ParseError");
+  parse_error_locate(L, e);
+
+  lua_getuservalue(L, 1);
+  lua_getfield(L, 2, "expected");
+  int n = (int)lua_rawlen(L, 3);
+
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  lua_pushfstring(L, "line %I, column %I", (lua_Integer)e->line,
+                  (lua_Integer)e->column);
+  luaL_addvalue(&b);
+
+  for (int i = 1; i <= n; i++) {
+    luaL_addstring(&b, i == 1 ? ": expected " : i == n ? " or " : ", ");
+    lua_rawgeti(L, 3, i);
+    luaL_addvalue(&b);
+  }
+
+  luaL_pushresult(&b);
+  return 1;
+}
+
+// runs under lua_pcall so parse_file gets to unmap the file on errors too
+static int parse_file_run(lua_State *L) {
+  Parser *p = check_parser_ud(L, 1);
+  const char *base = (const char *)lua_touserdata(L, 2);
+  size_t len = (size_t)lua_tointeger(L, 3);
+  int memo_all = lua_toboolean(L, 4);
+
+  // slot 2 becomes the input as a Lua string if a custom parser wants it
+  lua_settop(L, 1);
+  lua_pushnil(L);
+
+  ParseContext ctx = {L, {base, len}, 2, NULL, memo_all, 0, 0, {0}, NULL, 0};
+  memo_reserve(&ctx);
+  ParseResult r = parser_run(p, &ctx, 0);
+  memo_release(&ctx);
+
+  if (!r.ok)
+    lua_pushnil(L);
+
+  lua_pushinteger(L, (lua_Integer)r.pos + 1);
+  return 2;
+}
+
+/* parser.parse_file(p, path [, opts]) -> output (or nil), position where the
+   rest of the file starts (1-based). The file is mapped read-only and parsed
+   in place, opts are the same as for p:parse */
+static int l_parser_parse_file(lua_State *L) {
+  check_parser_ud(L, 1);
+  const char *path = luaL_checkstring(L, 2);
+
+  int memo_all = 0;
+  if (lua_istable(L, 3)) {
+    lua_getfield(L, 3, "memo");
+    memo_all = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return luaL_error(L, "cannot open %s: %s", path, strerror(errno));
+
+  struct stat sb;
+  if (fstat(fd, &sb) != 0) {
+    int err = errno;
+    close(fd);
+    return luaL_error(L, "cannot stat %s: %s", path, strerror(err));
+  }
+
+  // mmap refuses empty mappings, an empty file is just empty input
+  size_t len = (size_t)sb.st_size;
+  void *base = (void *)"";
+  if (len > 0) {
+    base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+      int err = errno;
+      close(fd);
+      return luaL_error(L, "cannot map %s: %s", path, strerror(err));
+    }
+    madvise(base, len, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  lua_pushcfunction(L, parse_file_run);
+  lua_pushvalue(L, 1);
+  lua_pushlightuserdata(L, base);
+  lua_pushinteger(L, (lua_Integer)len);
+  lua_pushboolean(L, memo_all);
+  int status = lua_pcall(L, 4, 2, 0);
+
+  if (len > 0)
+    munmap(base, len);
+
+  if (status != LUA_OK)
+    return lua_error(L);
+
+  return 2;
+}
+
+/* ---------------------------
+   streaming
+   --------------------------- */
+
+// appends the next chunk from the reader, returns 0 once it is exhausted
+static int stream_fill(lua_State *L, StreamState *st, int source) {
+  // drop what earlier matches consumed before making room
+  if (st->start > 0) {
+    memmove(st->buf, st->buf + st->start, st->len - st->start);
+    st->len -= st->start;
+    st->offset += st->start;
+    st->start = 0;
+  }
+
+  if (lua_isfunction(L, source)) {
+    lua_pushvalue(L, source);
+    lua_pushinteger(L, (lua_Integer)st->chunk);
+    lua_call(L, 1, 1);
+  } else {
+    // a file handle, or anything else with a read method
+    lua_getfield(L, source, "read");
+    lua_pushvalue(L, source);
+    lua_pushinteger(L, (lua_Integer)st->chunk);
+    lua_call(L, 2, 1);
+  }
+
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+
+  size_t n;
+  const char *chunk = lua_tolstring(L, -1, &n);
+  if (!chunk)
+    return luaL_error(L, "stream reader must return a string or nil");
+
+  // an empty chunk would only make us ask again
+  if (n == 0) {
+    lua_pop(L, 1);
+    return 0;
+  }
+
+  if (st->len + n > st->cap) {
+    size_t cap = st->cap ? st->cap * 2 : st->chunk;
+    while (cap < st->len + n)
+      cap *= 2;
+
+    char *buf = (char *)realloc(st->buf, cap);
+    if (!buf) {
+      perror("realloc");
+      exit(1);
+    }
+    st->buf = buf;
+    st->cap = cap;
+  }
+
+  memcpy(st->buf + st->len, chunk, n);
+  st->len += n;
+  lua_pop(L, 1);
+
+  return 1;
+}
+
+// iterator: returns the 1-based stream offset of the next match and its
+// output, nothing once the input is used up
+static int stream_next(lua_State *L) {
+  Parser *p = check_parser_ud(L, lua_upvalueindex(1));
+  int source = lua_upvalueindex(2);
+  StreamState *st = (StreamState *)lua_touserdata(L, lua_upvalueindex(3));
+
+  // slot 1 is the input as a Lua string, made on demand by custom parsers
+  lua_settop(L, 0);
+  lua_pushnil(L);
+
+  for (;;) {
+    if (st->start == st->len) {
+      if (st->eof)
+        return 0;
+      st->eof = !stream_fill(L, st, source);
+      continue;
+    }
+
+    ParseContext ctx = {L, {st->buf + st->start, st->len - st->start},
+                        1, NULL, 0, !st->eof, 0, {0}, NULL, 0};
+    memo_reserve(&ctx);
+    ParseResult r = parser_run(p, &ctx, 0);
+    memo_release(&ctx);
+
+    // the match ran into the end of the buffer, retry it with more
+    if (r.more) {
+      st->eof = !stream_fill(L, st, source);
+      lua_pushnil(L);
+      lua_replace(L, 1);
+      continue;
+    }
+
+    lua_Integer at = (lua_Integer)(st->offset + st->start) + 1;
+    if (!r.ok)
+      return luaL_error(L, "stream: no match at byte %I", at);
+    if (r.pos == 0)
+      return luaL_error(L, "stream: parser matched nothing at byte %I", at);
+
+    st->start += r.pos;
+
+    lua_pushinteger(L, at);
+    lua_insert(L, -2);
+    return 2;
+  }
+}
+
+static int stream_gc(lua_State *L) {
+  StreamState *st = (StreamState *)luaL_checkudata(L, 1, "ParserStream");
+  free(st->buf);
+  st->buf = NULL;
+  return 0;
+}
+
+/* parser.stream(p, reader | file [, opts]), opts.chunk is how many bytes to
+   ask the reader for at a time */
+static int l_parser_stream(lua_State *L) {
+  check_parser_ud(L, 1);
+  luaL_argcheck(L, lua_isfunction(L, 2) || lua_isuserdata(L, 2) ||
+                       lua_istable(L, 2),
+                2, "expected a reader function or a file");
+
+  lua_Integer chunk = 65536;
+  if (lua_istable(L, 3)) {
+    lua_getfield(L, 3, "chunk");
+    if (!lua_isnil(L, -1)) {
+      int isnum;
+      chunk = lua_tointegerx(L, -1, &isnum);
+      luaL_argcheck(L, isnum && chunk > 0, 3,
+                    "chunk must be a positive integer");
+    }
+    lua_pop(L, 1);
+  }
+
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, 2);
+
+  StreamState *st = (StreamState *)lua_newuserdata(L, sizeof(StreamState));
+  memset(st, 0, sizeof(StreamState));
+  st->chunk = (size_t)chunk;
+  luaL_setmetatable(L, "ParserStream");
+
+  lua_pushcclosure(L, stream_next, 3);
+  return 1;
+}
+
+static int l_parser_take_after(lua_State *L) {
+  Parser *left = check_parser_ud(L, 1);
+  Parser *right = check_parser_ud(L, 2);
+
+  Parser *p = make_take_after(L, left, right);
+  push_parser_ud(L, p);
+  parser_unref(p);
+
+  return 1;
+}
+
+static int l_parser_drop_for(lua_State *L) {
+  Parser *left = check_parser_ud(L, 1);
+  Parser *right = check_parser_ud(L, 2);
+
+  Parser *p = make_drop_for(L, left, right);
+  push_parser_ud(L, p);
+  parser_unref(p);
+
+  return 1;
 }
 
-/* ---------------------------
-   Lua-exposed constructors / methods
-   --------------------------- */
+static int l_parser_pair(lua_State *L) {
+  Parser *left = check_parser_ud(L, 1);
+  Parser *right = check_parser_ud(L, 2);
 
-/* parser.literal(s) */
-static int l_parser_literal(lua_State *L) {
-  const char *s = luaL_checkstring(L, 1);
-  Parser *p = make_literal(L, s);
+  Parser *p = make_pair(L, left, right);
   push_parser_ud(L, p);
-  // unref the initial creator reference: push_parser_ud already added one
   parser_unref(p);
+
   return 1;
 }
 
-/* parser.any_char() */
-static int l_parser_any_char(lua_State *L) {
-  Parser *p = make_any_char(L);
+/* p:many_concat(), p:many1_concat() */
+static int l_parser_many_concat(lua_State *L) {
+  Parser *inner = check_parser_ud(L, 1);
+  Parser *p = make_many_concat(L, inner, 0);
   push_parser_ud(L, p);
   parser_unref(p);
   return 1;
 }
 
-/* p:map(function) */
-static int l_parser_map(lua_State *L) {
+static int l_parser_many1_concat(lua_State *L) {
   Parser *inner = check_parser_ud(L, 1);
-  luaL_checktype(L, 2, LUA_TFUNCTION);
-  lua_pushvalue(L, 2);
-  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-  Parser *mp = make_map(L, inner, ref);
-  push_parser_ud(L, mp);
-  parser_unref(mp);
+  Parser *p = make_many_concat(L, inner, 1);
+  push_parser_ud(L, p);
+  parser_unref(p);
   return 1;
 }
 
-/* p:and_then(function) -> function must return a Parser userdata */
-static int l_parser_and_then(lua_State *L) {
+/* p:recognize() */
+static int l_parser_recognize(lua_State *L) {
   Parser *inner = check_parser_ud(L, 1);
-  luaL_checktype(L, 2, LUA_TFUNCTION);
-  lua_pushvalue(L, 2);
-  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-  Parser *ap = make_and_then(L, inner, ref);
-  push_parser_ud(L, ap);
-  parser_unref(ap);
+  Parser *p = make_recognize(L, inner);
+  push_parser_ud(L, p);
+  parser_unref(p);
   return 1;
 }
 
-/* p:or_else(q) */
-static int l_parser_or_else(lua_State *L) {
-  Parser *a = check_parser_ud(L, 1);
-  Parser *b = check_parser_ud(L, 2);
-  Parser *or_p = make_or(L, a, b);
-  push_parser_ud(L, or_p);
-  parser_unref(or_p);
+/* p:label(name) */
+static int l_parser_label(lua_State *L) {
+  Parser *inner = check_parser_ud(L, 1);
+  size_t len;
+  const char *name = luaL_checklstring(L, 2, &len);
+
+  Parser *p = make_label(L, inner, name, len);
+  push_parser_ud(L, p);
+  parser_unref(p);
   return 1;
 }
 
-/* p:pred(function) */
-static int l_parser_pred(lua_State *L) {
+/* p:cut() */
+static int l_parser_cut(lua_State *L) {
   Parser *inner = check_parser_ud(L, 1);
-  luaL_checktype(L, 2, LUA_TFUNCTION);
-  lua_pushvalue(L, 2);
-  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
-  Parser *pp = make_pred(L, inner, ref);
-  push_parser_ud(L, pp);
-  parser_unref(pp);
+  Parser *p = make_cut(L, inner);
+  push_parser_ud(L, p);
+  parser_unref(p);
   return 1;
 }
 
-/* p:one_or_more() */
-static int l_parser_one_or_more(lua_State *L) {
-  Parser *inner = check_parser_ud(L, 1);
-  Parser *rp = make_one_or_more(L, inner);
-  push_parser_ud(L, rp);
-  parser_unref(rp);
+/* p:sep_by(sep) */
+static int l_parser_sep_by(lua_State *L) {
+  Parser *item = check_parser_ud(L, 1);
+  Parser *sep = check_parser_ud(L, 2);
+
+  Parser *p = make_sep_by(L, item, sep, 0);
+  push_parser_ud(L, p);
+  parser_unref(p);
+
   return 1;
 }
 
-/* p:zero_or_more() */
-static int l_parser_zero_or_more(lua_State *L) {
+/* p:sep_by1(sep) */
+static int l_parser_sep_by1(lua_State *L) {
+  Parser *item = check_parser_ud(L, 1);
+  Parser *sep = check_parser_ud(L, 2);
+
+  Parser *p = make_sep_by(L, item, sep, 1);
+  push_parser_ud(L, p);
+  parser_unref(p);
+
+  return 1;
+}
+
+/* p:many_till(end) */
+static int l_parser_many_till(lua_State *L) {
   Parser *inner = check_parser_ud(L, 1);
-  Parser *rp = make_zero_or_more(L, inner);
-  push_parser_ud(L, rp);
-  parser_unref(rp);
+  Parser *end = check_parser_ud(L, 2);
+
+  Parser *p = make_many_till(L, inner, end);
+  push_parser_ud(L, p);
+  parser_unref(p);
+
   return 1;
 }
 
-/* p:parse(input) -> returns output (string or table or nil) , rest (string) */
-static int l_parser_parse(lua_State *L) {
+/* p:compile() */
+static int l_parser_compile(lua_State *L) {
   Parser *p = check_parser_ud(L, 1);
-  const char *input = luaL_checkstring(L, 2);
-  ParseResult r = p->parse(p, input);
-  if (r.ok) {
 
-    if (r.lua_ref != LUA_NOREF)
-      lua_rawgeti(L, LUA_REGISTRYINDEX, r.lua_ref);
-    else
-      lua_pushnil(L);
-
-    lua_pushstring(L, r.rest ? r.rest : "");
-    return 2;
-  } else {
-    lua_pushnil(L);
-    lua_pushstring(L, r.rest ? r.rest : "");
-    return 2;
+  // compiling twice would only wrap the same program again
+  if (p->kind == P_COMPILED) {
+    lua_settop(L, 1);
+    return 1;
   }
+
+  Parser *cp = compile_parser(L, p);
+  push_parser_ud(L, cp);
+  parser_unref(cp);
+
+  return 1;
 }
 
-static int l_parser_take_after(lua_State *L) {
-  Parser *left = check_parser_ud(L, 1);
-  Parser *right = check_parser_ud(L, 2);
+/* parser.lazy(function [, opts]), opts.once = false re-runs the thunk on
+   every parse */
+static int l_parser_lazy(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+
+  int once = 1;
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "once");
+    if (!lua_isnil(L, -1))
+      once = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+
+  lua_pushvalue(L, 1);
+  int func_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  Parser *p = make_lazy(L, func_ref, once);
 
-  Parser *p = make_take_after(L, left, right);
   push_parser_ud(L, p);
   parser_unref(p);
 
   return 1;
 }
 
-static int l_parser_drop_for(lua_State *L) {
-  Parser *left = check_parser_ud(L, 1);
-  Parser *right = check_parser_ud(L, 2);
+// reads a field by name, or by position for the short row syntax
+static int expr_field(lua_State *L, int row, const char *name, int idx) {
+  lua_getfield(L, row, name);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_rawgeti(L, row, idx);
+  }
+  return lua_type(L, -1);
+}
 
-  Parser *p = make_drop_for(L, left, right);
-  push_parser_ud(L, p);
-  parser_unref(p);
+// checks one operator table and returns how many operators it holds. With
+// a target each operator is stored there as well
+static int expr_rows(lua_State *L, int spec, const char *key, int fixity,
+                     Parser *target) {
+  int n = 0;
 
-  return 1;
+  lua_getfield(L, spec, key);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  if (!lua_istable(L, -1))
+    luaL_error(L, "expr: %s must be a table", key);
+
+  int rows = lua_gettop(L);
+  int nrows = (int)lua_rawlen(L, rows);
+  for (int r = 1; r <= nrows; r++) {
+    lua_rawgeti(L, rows, r);
+    if (!lua_istable(L, -1))
+      luaL_error(L, "expr: %s[%d] must be a table", key, r);
+    int row = lua_gettop(L);
+
+    // { ops, assoc, prec } for infix, { ops, prec } otherwise
+    int right = 0;
+    if (fixity == EXPR_INFIX) {
+      if (expr_field(L, row, "assoc", 2) != LUA_TNIL) {
+        const char *assoc = lua_tostring(L, -1);
+        if (!assoc || (strcmp(assoc, "left") && strcmp(assoc, "right")))
+          luaL_error(L, "expr: %s[%d] assoc must be 'left' or 'right'", key,
+                     r);
+        right = assoc[0] == 'r';
+      }
+      lua_pop(L, 1);
+    }
+
+    expr_field(L, row, "prec", fixity == EXPR_INFIX ? 3 : 2);
+    if (!lua_isnumber(L, -1))
+      luaL_error(L, "expr: %s[%d] needs a numeric prec", key, r);
+    int prec = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    // a parser, a literal, or a list of either
+    expr_field(L, row, "ops", 1);
+    int list = lua_istable(L, -1);
+    int nops = list ? (int)lua_rawlen(L, -1) : 1;
+    for (int i = 1; i <= nops; i++) {
+      if (list)
+        lua_rawgeti(L, -1, i);
+      else
+        lua_pushvalue(L, -1);
+
+      Parser **ud = (Parser **)luaL_testudata(L, -1, "Parser");
+      if (ud && !*ud)
+        luaL_error(L, "parser used after its arena was closed");
+      if (!ud && !lua_isstring(L, -1))
+        luaL_error(L, "expr: %s[%d] ops must be parsers or strings", key, r);
+
+      if (target) {
+        ExprData *d = (ExprData *)target->data;
+        ExprOp *op = &d->ops[d->nops++];
+
+        if (ud) {
+          op->op = *ud;
+          parser_hold(target->arena, op->op);
+        } else {
+          size_t len;
+          const char *lit = lua_tolstring(L, -1, &len);
+          op->op = make_literal(L, lit, len);
+          parser_hold(target->arena, op->op);
+          parser_unref(op->op); // the creator's
+        }
+        op->fixity = fixity;
+        op->prec = prec;
+        op->right = right;
+      }
+
+      lua_pop(L, 1);
+      n++;
+    }
+
+    lua_pop(L, 2); // ops, row
+  }
+
+  lua_pop(L, 1);
+  return n;
 }
 
-static int l_parser_pair(lua_State *L) {
-  Parser *left = check_parser_ud(L, 1);
-  Parser *right = check_parser_ud(L, 2);
+/* parser.expr{ atom = p, infix = {...}, prefix = {...}, postfix = {...},
+                fold = function(lhs, op, rhs) } */
+static int l_parser_expr(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+
+  lua_getfield(L, 1, "atom");
+  Parser **atom = (Parser **)luaL_testudata(L, -1, "Parser");
+  if (!atom || !*atom)
+    return luaL_error(L, "expr: atom must be a parser");
+  lua_pop(L, 1);
+
+  lua_getfield(L, 1, "fold");
+  if (!lua_isnil(L, -1) && !lua_isfunction(L, -1))
+    return luaL_error(L, "expr: fold must be a function");
+  lua_pop(L, 1);
+
+  // validate everything first, nothing can fail once the node exists
+  int nops = expr_rows(L, 1, "prefix", EXPR_PREFIX, NULL) +
+             expr_rows(L, 1, "infix", EXPR_INFIX, NULL) +
+             expr_rows(L, 1, "postfix", EXPR_POSTFIX, NULL);
+
+  int fold_ref = LUA_NOREF;
+  lua_getfield(L, 1, "fold");
+  if (lua_isnil(L, -1))
+    lua_pop(L, 1);
+  else
+    fold_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  Parser *p = make_expr(L, *atom, fold_ref, nops);
+
+  // postfix goes before infix, so an operator that is both acts as postfix
+  expr_rows(L, 1, "prefix", EXPR_PREFIX, p);
+  expr_rows(L, 1, "postfix", EXPR_POSTFIX, p);
+  expr_rows(L, 1, "infix", EXPR_INFIX, p);
 
-  Parser *p = make_pair(L, left, right);
   push_parser_ud(L, p);
   parser_unref(p);
+  return 1;
+}
+
+/* parser.arena() */
+static int l_parser_arena(lua_State *L) {
+  Arena *a = (Arena *)calloc(1, sizeof(Arena));
+  if (!a) {
+    perror("calloc");
+    exit(1);
+  }
+  a->refcount = 1; // the handle's
+
+  Arena **ud = (Arena **)lua_newuserdata(L, sizeof(Arena *));
+  *ud = a;
+  luaL_setmetatable(L, "ParserArena");
 
   return 1;
 }
 
-static int l_parser_lazy(lua_State *L) {
-  luaL_checktype(L, 1, LUA_TFUNCTION);
+static Arena *check_arena(lua_State *L, int idx) {
+  Arena **ud = (Arena **)luaL_checkudata(L, idx, "ParserArena");
+  if (!*ud)
+    luaL_error(L, "arena is closed");
+  return *ud;
+}
+
+/* arena:run(fn, ...), parsers built while fn runs are allocated in the
+   arena. Returns the results of fn */
+static int l_arena_run(lua_State *L) {
+  Arena *a = check_arena(L, 1);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  int nargs = lua_gettop(L) - 2;
+
+  // runs nest, the previous arena is put back afterwards
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &arena_key);
+  lua_insert(L, 1);
+
+  lua_pushlightuserdata(L, a);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &arena_key);
+
+  a->running++;
+  int status = lua_pcall(L, nargs, LUA_MULTRET, 0);
+  a->running--;
 
   lua_pushvalue(L, 1);
-  int func_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &arena_key);
 
-  Parser *p = make_lazy(L, func_ref);
+  if (status != LUA_OK)
+    return lua_error(L);
 
-  push_parser_ud(L, p);
+  // stack: previous arena, arena, results
+  return lua_gettop(L) - 2;
+}
+
+/* arena:close(), detaches every parser handle built in the arena and frees
+   it once no parser outside still holds one of its nodes */
+static int l_arena_close(lua_State *L) {
+  Arena **ud = (Arena **)luaL_checkudata(L, 1, "ParserArena");
+  Arena *a = *ud;
+  if (!a)
+    return 0;
+
+  if (a->running)
+    return luaL_error(L, "arena closed from inside its own run");
+
+  *ud = NULL;
+  a->closed = 1;
+  a->refcount++; // keeps it alive while the handles go
+
+  for (Parser *p = a->nodes; p; p = p->arena_next) {
+    if (p->lua_ref == LUA_NOREF)
+      continue;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, p->lua_ref);
+    Parser **pud = (Parser **)lua_touserdata(L, -1);
+    if (pud && *pud == p) {
+      *pud = NULL;
+      a->refcount--;
+    }
+    lua_pop(L, 1);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, p->lua_ref);
+    p->lua_ref = LUA_NOREF;
+  }
+
+  // the handle's ref and ours
+  a->refcount -= 2;
+  if (a->refcount <= 0)
+    arena_destroy(a);
+
+  return 0;
+}
+
+/* arena:stats() -> { nodes = n, bytes = n } */
+static int l_arena_stats(lua_State *L) {
+  Arena *a = check_arena(L, 1);
+
+  lua_createtable(L, 0, 2);
+  lua_pushinteger(L, (lua_Integer)a->nnodes);
+  lua_setfield(L, -2, "nodes");
+  lua_pushinteger(L, (lua_Integer)a->bytes);
+  lua_setfield(L, -2, "bytes");
 
   return 1;
 }
 
+/* __gc of an arena handle that was never closed, its parsers stay valid */
+static int l_arena_gc(lua_State *L) {
+  Arena **ud = (Arena **)luaL_checkudata(L, 1, "ParserArena");
+  Arena *a = *ud;
+  if (a) {
+    *ud = NULL;
+    if (--a->refcount == 0)
+      arena_destroy(a);
+  }
+  return 0;
+}
+
+/* parser.with_arena(fn, ...) -> arena, fn results */
+static int l_parser_with_arena(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+
+  l_parser_arena(L);
+  lua_insert(L, 1);
+
+  // leaves the previous arena below the arena and the results
+  int nres = l_arena_run(L);
+  return nres + 1;
+}
+
 static int l_parser_inspect(lua_State *L) {
   Parser *inner = check_parser_ud(L, 1);
   int ident = luaL_checkinteger(L, 2);
@@ -1125,52 +6556,81 @@ static int l_parser_gc(lua_State *L) {
 }
 
 /* __tostring for debug */
-static int l_parser_tostring(lua_State *L) {
-  Parser *p = check_parser_ud(L, 1);
-  const char *kind;
+static const char *parser_kind_name(const Parser *p) {
   switch (p->kind) {
   case P_LITERAL:
-    kind = "literal";
-    break;
+    return "literal";
   case P_ANY_CHAR:
-    kind = "any_char";
-    break;
+    return "any_char";
   case P_MAP:
-    kind = "map";
-    break;
+    return "map";
   case P_AND_THEN:
-    kind = "and_then";
-    break;
+    return "and_then";
   case P_OR_ELSE:
-    kind = "or_else";
-    break;
+    return "or_else";
   case P_PRED:
-    kind = "pred";
-    break;
+    return "pred";
   case P_ONE_OR_MORE:
-    kind = "one_or_more";
-    break;
+    return "one_or_more";
   case P_ZERO_OR_MORE:
-    kind = "zero_or_more";
-    break;
+    return "zero_or_more";
   case P_TAKE_AFTER:
-    kind = "take_after";
-    break;
+    return "take_after";
   case P_DROP_FOR:
-    kind = "drop_for";
-    break;
+    return "drop_for";
   case P_PAIR:
-    kind = "pair";
-    break;
+    return "pair";
+  case P_ONE_OF:
+    return "one_of";
+  case P_LABEL:
+    return "label";
+  case P_CUT:
+    return "cut";
+  case P_EXPR:
+    return "expr";
+  case P_RECOGNIZE:
+    return "recognize";
+  case P_MANY_CONCAT:
+    return "many_concat";
+  case P_SEP_BY:
+    return "sep_by";
+  case P_MANY_TILL:
+    return "many_till";
 
   case P_LAZY:
-    kind = "lazy";
-    break;
+    return "lazy";
+
+  case P_CUSTOM:
+    return "custom";
+
+  case P_MEMO:
+    return "memoize";
+
+  case P_CHAR_CLASS:
+    return "char_class";
+
+  case P_TAKE_WHILE:
+    return "take_while";
+
+  case P_TAKE_UNTIL:
+    return "take_until";
+
+  case P_COMPILED:
+    return "compiled";
 
   default:
-    kind = "parser";
+    return "parser";
+  }
+}
+
+static int l_parser_tostring(lua_State *L) {
+  Parser **ud = (Parser **)luaL_checkudata(L, 1, "Parser");
+  if (!*ud) {
+    lua_pushliteral(L, "Parser(closed)");
+    return 1;
   }
-  lua_pushfstring(L, "<Parser:%s>", kind);
+
+  lua_pushfstring(L, "<Parser:%s>", parser_kind_name(*ud));
   return 1;
 }
 
@@ -1188,6 +6648,18 @@ static const luaL_Reg parser_methods[] = {
     {"take_after", l_parser_take_after},
     {"drop_for", l_parser_drop_for},
     {"pair", l_parser_pair},
+    {"many_concat", l_parser_many_concat},
+    {"many1_concat", l_parser_many1_concat},
+    {"recognize", l_parser_recognize},
+    {"label", l_parser_label},
+    {"cut", l_parser_cut},
+    {"sep_by", l_parser_sep_by},
+    {"sep_by1", l_parser_sep_by1},
+    {"many_till", l_parser_many_till},
+    {"memoize", l_parser_memoize},
+    {"compile", l_parser_compile},
+    {"freeze", l_parser_freeze},
+    {"dump", l_parser_dump},
     {"parse", l_parser_parse},
     {NULL, NULL}};
 
@@ -1225,8 +6697,23 @@ static int l_parser_custom(lua_State *L) {
   lua_pushvalue(L, 1);
   int func_ref = luaL_ref(L, LUA_REGISTRYINDEX);
 
-  Parser *p = make_custom(L, func_ref);
+  Parser *p = make_custom(L, func_ref, 0);
+  push_parser_ud(L, p);
+  parser_unref(p);
+
+  return 1;
+}
+
+/* parser.custom(function(input, position) -> value, new_position) */
+static int l_parser_custom_at(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+
+  lua_pushvalue(L, 1);
+  int func_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  Parser *p = make_custom(L, func_ref, 1);
   push_parser_ud(L, p);
+  parser_unref(p);
 
   return 1;
 }
@@ -1258,6 +6745,64 @@ int luaopen_parser_core(lua_State *L) {
   // pop metatable
   lua_pop(L, 1);
 
+  // counters of a running parser.profile
+  luaL_newmetatable(L, "ParserProfile");
+  lua_pushcfunction(L, profile_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  // packrat tables of a running parse
+  luaL_newmetatable(L, "ParserMemo");
+  lua_pushcfunction(L, memo_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  // buffers owned by parser.stream iterators
+  luaL_newmetatable(L, "ParserStream");
+  lua_pushcfunction(L, stream_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  // third result of a failed p:parse
+  luaL_newmetatable(L, "ParseError");
+  lua_pushcfunction(L, parse_error_index);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, parse_error_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pop(L, 1);
+
+  // grammars returned by p:freeze
+  luaL_newmetatable(L, "ParserFrozen");
+  lua_newtable(L);
+  lua_pushcfunction(L, l_frozen_parse);
+  lua_setfield(L, -2, "parse");
+  lua_pushcfunction(L, l_frozen_share);
+  lua_setfield(L, -2, "share");
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, l_frozen_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  // scratch state of a parser.parse_records call
+  luaL_newmetatable(L, "ParserRecords");
+  lua_pushcfunction(L, records_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  // handles returned by parser.arena
+  luaL_newmetatable(L, "ParserArena");
+  lua_newtable(L);
+  lua_pushcfunction(L, l_arena_run);
+  lua_setfield(L, -2, "run");
+  lua_pushcfunction(L, l_arena_close);
+  lua_setfield(L, -2, "close");
+  lua_pushcfunction(L, l_arena_stats);
+  lua_setfield(L, -2, "stats");
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, l_arena_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
   // module table
   lua_newtable(L);
   lua_pushcfunction(L, l_parser_literal);
@@ -1270,6 +6815,36 @@ int luaopen_parser_core(lua_State *L) {
   lua_setfield(L, -2, "inspect");
   lua_pushcfunction(L, l_parser_custom);
   lua_setfield(L, -2, "new");
+  lua_pushcfunction(L, l_parser_custom_at);
+  lua_setfield(L, -2, "custom");
+  lua_pushcfunction(L, l_parser_char_class);
+  lua_setfield(L, -2, "char_class");
+  lua_pushcfunction(L, l_parser_take_while);
+  lua_setfield(L, -2, "take_while");
+  lua_pushcfunction(L, l_parser_take_until);
+  lua_setfield(L, -2, "take_until");
+  lua_pushcfunction(L, l_parser_stream);
+  lua_setfield(L, -2, "stream");
+  lua_pushcfunction(L, l_parser_parse_file);
+  lua_setfield(L, -2, "parse_file");
+  lua_pushcfunction(L, l_parser_one_of);
+  lua_setfield(L, -2, "one_of");
+  lua_pushcfunction(L, l_parser_profile);
+  lua_setfield(L, -2, "profile");
+  lua_pushcfunction(L, l_parser_expr);
+  lua_setfield(L, -2, "expr");
+  lua_pushcfunction(L, l_parser_arena);
+  lua_setfield(L, -2, "arena");
+  lua_pushcfunction(L, l_parser_with_arena);
+  lua_setfield(L, -2, "with_arena");
+  lua_pushcfunction(L, l_parser_adopt);
+  lua_setfield(L, -2, "adopt");
+  lua_pushcfunction(L, l_parser_load);
+  lua_setfield(L, -2, "load");
+  lua_pushcfunction(L, l_parser_load_file);
+  lua_setfield(L, -2, "load_file");
+  lua_pushcfunction(L, l_parser_parse_records);
+  lua_setfield(L, -2, "parse_records");
 
   return 1;
 }
@@ -6,22 +6,143 @@
 
 #include <lauxlib.h>
 #include <lua.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 
+#include "scan.h"
+
+/* a successful parse leaves exactly one output value on top of the Lua
+   stack, a failed one leaves the stack as it found it */
 typedef struct {
-  int ok;           // 1 success, 0 failure
-  const char *rest; // pointer into original input (not owned)
-  int lua_ref;      // store the result in the register
+  int ok;     // 1 success, 0 failure
+  int more;   // failed only because a partial input ran out, see partial
+  int cut;    // failed past a cut, no enclosing choice may try another way
+  size_t pos; // byte offset where the rest of the input starts
 } ParseResult;
 
-static ParseResult parse_ok(const char *rest, int lua_ref);
-static ParseResult parse_err(const char *input);
+static ParseResult parse_ok(size_t pos);
+static ParseResult parse_err(size_t pos);
+static ParseResult parse_more(size_t pos);
+
+typedef struct Parser Parser;
+
+/* ---------------------------
+   Grammar arenas
+   parsers built inside arena:run(fn) are bump-allocated together with their
+   data and share the arena's refcount, links between nodes of the same
+   arena are not counted. arena:close() detaches the Lua handles so the
+   whole grammar is freed at once when nothing outside still holds it.
+   --------------------------- */
+
+typedef struct ArenaChunk {
+  struct ArenaChunk *next;
+  size_t used;
+  size_t cap;
+  alignas(max_align_t) unsigned char data[];
+} ArenaChunk;
+
+typedef struct {
+  ArenaChunk *chunks;
+  Parser *nodes; // every node in the arena, linked through arena_next
+  size_t nnodes;
+  size_t bytes;
+  int refcount; // handle, userdata and outside holders
+  int closed;
+  int running; // nesting depth of arena:run on this arena
+} Arena;
+
+static Arena *arena_current(lua_State *L);
+static void *arena_alloc(Arena *a, size_t size);
+static void arena_destroy(Arena *a);
+
+// a ref held by a node (in holder, NULL for the heap) on one of its children
+static void parser_hold(Arena *holder, Parser *child);
+static void parser_release(Arena *holder, Parser *child);
+
+/* ---------------------------
+   Packrat memo table
+   keyed by (parser, byte offset), lives for a single parse call. It is a
+   userdata in a stack slot the parse reserves, the memoized values are its
+   user value, so a parse that raises leaves both to the collector
+   --------------------------- */
+
+typedef struct {
+  Parser *parser; // NULL marks an empty slot
+  size_t offset;
+  int ok;
+  int cut; // the parser got past a cut
+  size_t pos;
+  int value_ref; // ref into the memo values table, LUA_NOREF on failure
+} MemoEntry;
+
+typedef struct {
+  MemoEntry *entries;
+  size_t cap; // always a power of two
+  size_t count;
+  lua_State *L;
+  int idx;        // stack slot of the userdata, its user value holds the
+                  // memoized values
+  size_t trim_at; // entry count at which a cut next drops old entries
+} MemoTable;
+
+#define MEMO_TRIM_MIN 4096
+
+/* ---------------------------
+   Per-call parse context
+   parsers see the input as (base, len) plus the offset they are called at,
+   the input is bounded by len and may contain NUL bytes
+   --------------------------- */
+
+typedef struct {
+  const char *base; // start of the input (not owned)
+  size_t len;       // input length in bytes
+} Input;
+
+/* the furthest offset any parser failed at and what was expected there,
+   leaves (and labels) record themselves when they fail */
+#define EXPECT_MAX 8
+#define EXPECT_MAX_DEPTH 16 // how far skipped alternatives are looked into
+
+typedef struct {
+  size_t pos;
+  int n;
+  Parser *expected[EXPECT_MAX]; // borrowed from the grammar being run
+} ParseError;
+
+typedef struct Profile Profile;
+
+typedef struct {
+  lua_State *L; // state running the parse, outputs are pushed here
+  Input in;
+  int input_idx;   // stack index of the input as a Lua string
+  MemoTable *memo; // created on first use, NULL until then
+  int memo_all;    // packrat mode: memoize every non-leaf parser
+  int partial;     // more input may follow, running into the end of it
+                   // fails with more set instead of deciding
+  int cut;         // a cut was passed since the innermost choice started
+  ParseError err;
+  Profile *prof; // per-node counters, NULL unless parser.profile runs
+  int memo_idx;  // stack slot memo_get anchors the memo table in
+} ParseContext;
+
+static void parse_expect(ParseContext *ctx, size_t pos, Parser *p);
+static void parse_expect_first(ParseContext *ctx, size_t pos, Parser *p,
+                               int depth);
+
+static void memo_reserve(ParseContext *ctx);
+static MemoTable *memo_get(ParseContext *ctx);
+static void memo_release(ParseContext *ctx);
+static int memo_gc(lua_State *L);
+static ParseResult memo_run(Parser *p, ParseContext *ctx, size_t pos);
+static void memo_trim(MemoTable *m, size_t offset);
 
 /* ---------------------------
    Parser type + refcount
    --------------------------- */
 
-typedef struct Parser Parser;
-typedef ParseResult (*parse_fn_t)(Parser *p, const char *input);
+typedef ParseResult (*parse_fn_t)(Parser *p, ParseContext *ctx, size_t pos);
 typedef void (*destroy_fn_t)(Parser *p);
 
 typedef enum {
@@ -37,48 +158,73 @@ typedef enum {
   P_DROP_FOR,
   P_PAIR,
   P_LAZY,
-  P_CUSTOM
+  P_CUSTOM,
+  P_MEMO,
+  P_CHAR_CLASS,
+  P_TAKE_WHILE,
+  P_TAKE_UNTIL,
+  P_COMPILED,
+  P_SEP_BY,
+  P_MANY_TILL,
+  P_RECOGNIZE,
+  P_MANY_CONCAT,
+  P_EXPR,
+  P_ONE_OF,
+  P_LABEL,
+  P_CUT
 } ParserKind;
 
 struct Parser {
   ParserKind kind;
   parse_fn_t parse;
   destroy_fn_t destroy;
-  void *data;
   int refcount;
   // store pointer to lua_State used to register callbacks (not owned)
   lua_State *L;
   int lua_ref;
+  Arena *arena;       // NULL for heap nodes
+  Parser *arena_next; // next node of the same arena
+  // the kind's *Data struct lives inline right after the header, so a parse
+  // step reads it from the node's own cache line instead of chasing a pointer
+  alignas(max_align_t) unsigned char data[];
 };
 
+// size is the bytes of payload after the header, zeroed; destroy may be NULL
 static Parser *parser_new(ParserKind k, parse_fn_t parse, destroy_fn_t destroy,
-                          void *data, lua_State *L);
+                          size_t size, lua_State *L);
 
 static void parser_ref(Parser *p);
 static void parser_unref(Parser *p);
 
+// run a child parser, every combinator goes through here
+static ParseResult parser_run(Parser *p, ParseContext *ctx, size_t pos);
+
+// run a child whose failure the caller would catch and try something else,
+// a failure past a cut inside it comes back with cut set instead
+static ParseResult parser_try(Parser *p, ParseContext *ctx, size_t pos);
+
+// fills out with the direct children of p (at most 2) and returns how many
+// there are, lazy nodes only report their target once it is resolved
+static int parser_children(Parser *p, Parser **out);
+
 /* ---------------------------
    Literal parser
    --------------------------- */
 
 typedef struct {
-  char *lit; // malloc'd
+  size_t len;
+  char lit[]; // inline, NUL terminated
 } LiteralData;
 
-static ParseResult literal_parse(Parser *p, const char *input);
-static void literal_destroy(Parser *p);
-static Parser *make_literal(lua_State *L, const char *s);
+static ParseResult literal_parse(Parser *p, ParseContext *ctx, size_t pos);
+static Parser *make_literal(lua_State *L, const char *s, size_t len);
 
 /* ---------------------------
    any_char parser
+   no payload
    --------------------------- */
 
-typedef struct {
-  int dummy;
-} AnyCharData;
-
-static ParseResult any_char_parse(Parser *p, const char *input);
-static void any_char_destroy(Parser *p);
+static ParseResult any_char_parse(Parser *p, ParseContext *ctx, size_t pos);
 static Parser *make_any_char(lua_State *L);
 
 /* ---------------------------
@@ -91,7 +237,7 @@ typedef struct {
   int func_ref; // registry ref to Lua function
 } MapData;
 
-static ParseResult map_parse(Parser *p, const char *input);
+static ParseResult map_parse(Parser *p, ParseContext *ctx, size_t pos);
 static void map_destroy(Parser *p);
 static Parser *make_map(lua_State *L, Parser *inner, int func_ref);
 
@@ -105,22 +251,170 @@ typedef struct {
   int func_ref; // lua function: (string) -> parser userdata
 } AndThenData;
 
-static ParseResult and_then_parse(Parser *p, const char *input);
+static ParseResult and_then_parse(Parser *p, ParseContext *ctx, size_t pos);
 static void and_then_destroy(Parser *p);
 static Parser *make_and_then(lua_State *L, Parser *inner, int func_ref);
 
+/* ---------------------------
+   keyword trie
+   one_of matches a set of keywords in a single pass over the input, the
+   trie is built from the sorted words and stored inline in the node
+   --------------------------- */
+
+typedef struct {
+  int first_edge;
+  int nedges; // edges are sorted by byte
+  int word;   // id of the keyword ending here, -1 if none
+} TrieNode;
+
+typedef struct {
+  unsigned char byte;
+  int child;
+} TrieEdge;
+
+typedef struct {
+  int nwords;
+  int nnodes;
+  int nedges;
+  int longest;    // longest match instead of the earliest declared
+  int values_ref; // table of mapped values by id + 1, LUA_NOREF for none
+  TrieNode nodes[]; // followed by the edges, see ONE_OF_EDGES
+} OneOfData;
+
+// no pointer inside, a trie can be copied or mapped as it is
+#define ONE_OF_EDGES(d) ((const TrieEdge *)((d)->nodes + (d)->nnodes))
+#define ONE_OF_SIZE(d)                                                         \
+  (sizeof(OneOfData) + sizeof(TrieNode) * (d)->nnodes +                        \
+   sizeof(TrieEdge) * (d)->nedges)
+
+typedef struct {
+  const char *s;
+  size_t len;
+  int id; // position in the declaration
+} TrieWord;
+
+typedef struct {
+  TrieWord *words;
+  TrieNode *nodes;
+  TrieEdge *edges;
+  int nnodes;
+  int nedges;
+} TrieBuild;
+
+static int one_of_match(const OneOfData *d, const Input *in, size_t pos,
+                        int partial, int *word, size_t *end);
+static void one_of_push(lua_State *L, const OneOfData *d, const Input *in,
+                        size_t pos, int word, size_t end);
+static ParseResult one_of_parse(Parser *p, ParseContext *ctx, size_t pos);
+static void one_of_destroy(Parser *p);
+static int trie_word_cmp(const void *a, const void *b);
+static int trie_build(TrieBuild *b, int lo, int hi, size_t depth);
+static Parser *make_one_of(lua_State *L, TrieWord *words, int nwords,
+                           int longest, int values_ref);
+
+/* ---------------------------
+   cut
+   p:cut() commits to the way the parse went once p succeeds: a later
+   failure is not caught by any enclosing or_else or repetition, it fails
+   the whole parse. Memo entries before the cut are dropped as well
+   --------------------------- */
+
+typedef struct {
+  Parser *inner;
+} CutData;
+
+static ParseResult cut_parse(Parser *p, ParseContext *ctx, size_t pos);
+static void cut_destroy(Parser *p);
+static Parser *make_cut(lua_State *L, Parser *inner);
+
+/* ---------------------------
+   label
+   p:label(name) names what p expects in parse errors, in place of
+   whatever p's own parsers expected where it started
+   --------------------------- */
+
+typedef struct {
+  Parser *inner;
+  char name[]; // inline, NUL terminated
+} LabelData;
+
+static ParseResult label_parse(Parser *p, ParseContext *ctx, size_t pos);
+static void label_destroy(Parser *p);
+static Parser *make_label(lua_State *L, Parser *inner, const char *name,
+                          size_t len);
+
+/* ---------------------------
+   expression parser
+   precedence climbing over an atom and operator parsers, every operator
+   application is folded by one Lua call (or into a {lhs, op, rhs} table)
+   --------------------------- */
+
+enum { EXPR_PREFIX, EXPR_INFIX, EXPR_POSTFIX };
+
+typedef struct {
+  Parser *op;
+  int fixity;
+  int prec;  // higher binds tighter
+  int right; // right associative infix
+} ExprOp;
+
+typedef struct {
+  Parser *atom;
+  int fold_ref; // LUA_NOREF builds tables
+  int nops;
+  ExprOp ops[]; // prefix, then postfix, then infix, each in declared order
+} ExprData;
+
+static int expr_match(ExprData *d, ParseContext *ctx, size_t pos, int prefix,
+                      ParseResult *r);
+static int expr_fold(ExprData *d, lua_State *L);
+static ParseResult expr_climb(Parser *p, ParseContext *ctx, size_t pos,
+                              int min_prec);
+static ParseResult expr_parse(Parser *p, ParseContext *ctx, size_t pos);
+static void expr_destroy(Parser *p);
+static Parser *make_expr(lua_State *L, Parser *atom, int fold_ref, int nops);
+
+/* ---------------------------
+   FIRST sets
+   the bytes a parser can start a successful match with, used to skip
+   or_else alternatives that can't match the next byte
+   --------------------------- */
+
+typedef enum {
+  FIRST_CONSUMES, // only succeeds by consuming a byte from the set
+  FIRST_NULLABLE, // may also succeed without consuming anything
+  FIRST_UNKNOWN   // depends on Lua code (custom, and_then, ...)
+} FirstKind;
+
+static FirstKind first_set(Parser *p, lua_State *L, CharSet *out, int depth);
+
 /* ---------------------------
    or_else combinator
    data: left Parser*, right Parser*
+   a chain of or_else nodes is flattened into its alternatives and a
+   256-entry table giving, for the next byte, which of them are worth trying
    --------------------------- */
 
+#define OR_MAX_ALTS 64
+
+typedef struct {
+  int n;           // alternatives, 0 if no alternative can ever be skipped
+  Parser **alts;   // borrowed from the chain
+  uint64_t *masks; // 257 entries, one per byte plus one for end of input
+} OrDispatch;
+
 typedef struct {
   Parser *left;
   Parser *right;
+  OrDispatch *dispatch; // built on first use
 } OrData;
 
-static ParseResult or_parse(Parser *p, const char *input);
+static OrDispatch *or_dispatch_build(Parser *p, lua_State *L);
+static void or_dispatch_free(OrDispatch *t);
+
+static ParseResult or_parse(Parser *p, ParseContext *ctx, size_t pos);
 static void or_destroy(Parser *p);
+static void or_expect_skipped(ParseContext *ctx, size_t pos, Parser *p);
 static Parser *make_or(lua_State *L, Parser *a, Parser *b);
 
 /* ---------------------------
@@ -133,7 +427,7 @@ typedef struct {
   int func_ref; // lua function: (string) -> boolean
 } PredData;
 
-static ParseResult pred_parse(Parser *p, const char *input);
+static ParseResult pred_parse(Parser *p, ParseContext *ctx, size_t pos);
 static void pred_destroy(Parser *p);
 static Parser *make_pred(lua_State *L, Parser *inner, int func_ref);
 
@@ -147,7 +441,7 @@ typedef struct {
   Parser *right;
 } TakeAfterData;
 
-static ParseResult take_after_parse(Parser *p, const char *input);
+static ParseResult take_after_parse(Parser *p, ParseContext *ctx, size_t pos);
 static void take_after_destroy(Parser *p);
 static Parser *make_take_after(lua_State *L, Parser *left, Parser *right);
 
@@ -161,7 +455,7 @@ typedef struct {
   Parser *right;
 } DropForData;
 
-static ParseResult drop_for_parse(Parser *p, const char *input);
+static ParseResult drop_for_parse(Parser *p, ParseContext *ctx, size_t pos);
 static void drop_for_destroy(Parser *p);
 static Parser *make_drop_for(lua_State *L, Parser *left, Parser *right);
 
@@ -175,12 +469,29 @@ typedef struct {
   Parser *inner;
 } RepData;
 
-static ParseResult one_or_more_parse(Parser *p, const char *input);
-static ParseResult zero_or_more_parse(Parser *p, const char *input);
+static ParseResult one_or_more_parse(Parser *p, ParseContext *ctx, size_t pos);
+static ParseResult zero_or_more_parse(Parser *p, ParseContext *ctx, size_t pos);
 static void rep_destroy(Parser *p);
 static Parser *make_one_or_more(lua_State *L, Parser *inner);
 static Parser *make_zero_or_more(lua_State *L, Parser *inner);
 
+/* ---------------------------
+   span combinators
+   recognize and many_concat return the input their inner parser consumed
+   as one string and drop the values it built
+   --------------------------- */
+
+typedef struct {
+  Parser *inner;
+  int min; // many_concat only, 1 for many1_concat
+} SpanData;
+
+static ParseResult many_concat_parse(Parser *p, ParseContext *ctx, size_t pos);
+static ParseResult recognize_parse(Parser *p, ParseContext *ctx, size_t pos);
+static void span_destroy(Parser *p);
+static Parser *make_many_concat(lua_State *L, Parser *inner, int min);
+static Parser *make_recognize(lua_State *L, Parser *inner);
+
 /* ---------------------------
    pair combinator
    returns a table contating the result from both parsers
@@ -191,25 +502,247 @@ typedef struct {
   Parser *right;
 } PairData;
 
-static ParseResult pair_parse(Parser *p, const char *input);
+static ParseResult pair_parse(Parser *p, ParseContext *ctx, size_t pos);
 static void pair_destroy(Parser *p);
 static Parser *make_pair(lua_State *L, Parser *left, Parser *right);
 
+/* ---------------------------
+   list combinators
+   sep_by collects item (sep item)* and many_till collects inner until end
+   matches, both straight into one table presized from the longest list
+   the node has built so far
+   --------------------------- */
+
+#define LIST_HINT_MAX 1024
+
+typedef struct {
+  Parser *item;
+  Parser *sep;
+  int min;  // 1 for sep_by1
+  int hint; // array slots to preallocate
+} SepByData;
+
+typedef struct {
+  Parser *inner;
+  Parser *end; // its value is dropped
+  int hint;
+} ManyTillData;
+
+static void list_hint(int *hint, int count);
+
+static ParseResult sep_by_parse(Parser *p, ParseContext *ctx, size_t pos);
+static void sep_by_destroy(Parser *p);
+static Parser *make_sep_by(lua_State *L, Parser *item, Parser *sep, int min);
+
+static ParseResult many_till_parse(Parser *p, ParseContext *ctx, size_t pos);
+static void many_till_destroy(Parser *p);
+static Parser *make_many_till(lua_State *L, Parser *inner, Parser *end);
+
+/* ---------------------------
+   lazy combinator
+   the thunk runs on first use and the parser it returns is kept, unless
+   once is off and the thunk should run every time
+   --------------------------- */
+
 typedef struct {
   int func_ref;
+  int once;       // cache the resolved parser
+  Parser *target; // owned ref once resolved, NULL before
 } LazyData;
 
-static ParseResult lazy_parse(Parser *p, const char *input);
+static Parser *lazy_resolve(Parser *p, lua_State *L);
+static ParseResult lazy_parse(Parser *p, ParseContext *ctx, size_t pos);
 static void lazy_destroy(Parser *p);
-static Parser *make_lazy(lua_State *L, int func_ref);
+static Parser *make_lazy(lua_State *L, int func_ref, int once);
+
+/* ---------------------------
+   custom parsers
+   the original protocol gets a copy of the remaining input and returns
+   (value, rest); the positional one gets the whole input plus a 1-based
+   position and returns (value, new_position) without any copying
+   --------------------------- */
 
 typedef struct {
   int func_ref;
+  int positional; // 1 for the (input, position) protocol
 } CustomData;
 
-static ParseResult custom_parse(Parser *p, const char *input);
+static ParseResult custom_parse(Parser *p, ParseContext *ctx, size_t pos);
 static void custom_destroy(Parser *p);
-static Parser *make_custom(lua_State *L, int func_ref);
+static Parser *make_custom(lua_State *L, int func_ref, int positional);
+
+/* ---------------------------
+   memoize combinator
+   caches the inner parser's result per input offset
+   --------------------------- */
+
+typedef struct {
+  Parser *inner;
+} MemoData;
+
+static ParseResult memo_parse(Parser *p, ParseContext *ctx, size_t pos);
+static void memo_destroy(Parser *p);
+static Parser *make_memo(lua_State *L, Parser *inner);
+
+/* ---------------------------
+   character classes
+   a 256-bit byte set built once from a Lua pattern style class such as
+   "%d", "[%w_]" or "[^\"]"
+   --------------------------- */
+
+static int charset_parse(CharSet *cs, const char *spec, size_t len);
+
+typedef struct {
+  CharSet set;
+  char spec[]; // inline, kept for inspect
+} CharClassData;
+
+static ParseResult char_class_parse(Parser *p, ParseContext *ctx, size_t pos);
+static Parser *make_char_class(lua_State *L, const CharSet *set,
+                               const char *spec);
+
+/* ---------------------------
+   take_while
+   consumes the longest run of bytes in a class and returns it as one string
+   --------------------------- */
+
+typedef struct {
+  CharSet set;
+  ScanPlan plan;
+  size_t min;  // fewest bytes accepted
+  char spec[]; // inline, kept for inspect
+} TakeWhileData;
+
+static ParseResult take_while_parse(Parser *p, ParseContext *ctx, size_t pos);
+static Parser *make_take_while(lua_State *L, const CharSet *set,
+                               const char *spec, size_t min);
+
+/* ---------------------------
+   take_until
+   consumes everything before the first occurrence of a marker, optionally
+   including the marker itself; fails if the marker never shows up
+   --------------------------- */
+
+typedef struct {
+  size_t len;
+  int inclusive; // 1 to consume and return the marker as well
+  char mark[];   // inline, NUL terminated
+} TakeUntilData;
+
+static ParseResult take_until_parse(Parser *p, ParseContext *ctx, size_t pos);
+static Parser *make_take_until(lua_State *L, const char *mark, size_t len,
+                               int inclusive);
+
+/* ---------------------------
+   grammar compiler + VM
+   p:compile() flattens a parser tree into an instruction array run by a
+   dispatch loop with an explicit backtrack stack (the LPeg design). Outputs
+   still live on the Lua stack: every compiled subtree pushes exactly one
+   value when it succeeds, a failure rewinds the stack to the last choice.
+   Nodes with Lua-side behaviour the VM can't see through (custom, memoize,
+   dynamic lazy) are run by the tree interpreter from inside the VM.
+   --------------------------- */
+
+typedef enum {
+  OP_LITERAL,    // aux: offset in consts, arg: length
+  OP_ANY_CHAR,   //
+  OP_CHAR_CLASS, // aux: class index
+  OP_TAKE_WHILE, // aux: class index
+  OP_TAKE_UNTIL, // aux: offset in consts, arg: length, flag: inclusive
+  OP_CHOICE,     // arg: alternative, pushes a backtrack entry
+  OP_COMMIT,     // arg: target, drops the top backtrack entry
+  OP_LOOP,       // arg: loop body, moves the top entry forward or exits
+  OP_JUMP,       // arg: target
+  OP_SWITCH,     // aux: switch index, jumps on the next byte
+  OP_FAIL,       //
+  OP_CALL,       // arg: subroutine
+  OP_RET,        //
+  OP_MARK,       // remembers where a callback node started
+  OP_NODE,       // aux: node index, runs the tree interpreter
+  OP_MAP,        // aux: func index, pops the mark
+  OP_PRED,       // aux: func index, pops the mark
+  OP_AND_THEN,   // aux: func index, pops the mark
+  OP_POP,        // drops the top value
+  OP_NIP,        // drops the value under the top
+  OP_PAIR,       // {a, b} from the two top values
+  OP_NEWTABLE,   //
+  OP_APPEND,     // appends the top value to the table under it
+  OP_NONEMPTY,   // fails if the table on top is empty
+  OP_SPAN,       // pops the mark, replaces the top value with the input
+                 // consumed since it (flag: pushes instead)
+  OP_CUT,        // commits to every choice entered so far
+  OP_ONE_OF,     // aux: trie index, flag: pushes mapped values
+  OP_LABEL,      // pushes a label frame, see label_parse
+  OP_UNLABEL,    // drops it once the labeled parser succeeded
+  OP_END
+} OpCode;
+
+typedef struct {
+  unsigned char op;
+  unsigned char flag;
+  int aux;
+  int arg;
+} Instr;
+
+typedef struct {
+  CharSet set;
+  ScanPlan plan;
+  size_t min;
+} VMClass;
+
+typedef struct {
+  int target[257]; // per next byte, the last entry is end of input
+} VMSwitch;
+
+typedef struct {
+  Instr *code;
+  int ncode;
+  char *consts; // literal and marker bytes
+  size_t nconsts;
+  VMClass *classes;
+  int nclasses;
+  Parser **origins; // per instruction, the leaf (or or_else) it reports
+                    // as expected when it fails, NULL for the rest
+  Parser **nodes;   // fallback nodes, the program holds a ref on each
+  int nnodes;
+  int *funcs; // callback refs, owned by the source tree
+  int nfuncs;
+  VMSwitch *switches;
+  int nswitches;
+  const OneOfData **tries; // borrowed from the source tree
+  int ntries;
+  int frame_slots; // Lua stack slots a subroutine body may need
+} Program;
+
+typedef struct {
+  Parser *source;
+  Program prog;
+} CompiledData;
+
+static Parser *compile_parser(lua_State *L, Parser *root);
+static ParseResult vm_run(Program *prog, ParseContext *ctx, size_t pos);
+static ParseResult compiled_parse(Parser *p, ParseContext *ctx, size_t pos);
+static void compiled_destroy(Parser *p);
+
+/* ---------------------------
+   streaming
+   parser.stream feeds chunks from a reader into a buffer and parses one
+   top-level match at a time, only the unconsumed tail stays buffered
+   --------------------------- */
+
+typedef struct {
+  char *buf;     // malloc'd
+  size_t start;  // first unconsumed byte
+  size_t len;    // bytes buffered, consumed ones included
+  size_t cap;
+  size_t offset; // stream offset of buf[0]
+  size_t chunk;  // bytes asked from the reader at a time
+  int eof;
+} StreamState;
+
+static int stream_fill(lua_State *L, StreamState *st, int source);
+static int stream_next(lua_State *L);
+static int stream_gc(lua_State *L);
 
 /* ---------------------------
    Lua userdata helpers
@@ -249,9 +782,362 @@ static int l_parser_one_or_more(lua_State *L);
 /* p:zero_or_more() */
 static int l_parser_zero_or_more(lua_State *L);
 
-/* p:parse(input) -> returns output (string or nil) , rest (string) */
+/* p:memoize() */
+static int l_parser_memoize(lua_State *L);
+
+/* p:many_concat(), p:many1_concat() */
+static int l_parser_many_concat(lua_State *L);
+static int l_parser_many1_concat(lua_State *L);
+
+/* p:recognize() */
+static int l_parser_recognize(lua_State *L);
+
+/* p:sep_by(sep), p:sep_by1(sep) */
+static int l_parser_sep_by(lua_State *L);
+static int l_parser_sep_by1(lua_State *L);
+
+/* p:many_till(end) */
+static int l_parser_many_till(lua_State *L);
+
+/* parser.char_class(class) */
+static int l_parser_char_class(lua_State *L);
+
+/* parser.take_while(class [, min]) */
+static int l_parser_take_while(lua_State *L);
+
+/* parser.take_until(mark [, inclusive]) */
+static int l_parser_take_until(lua_State *L);
+
+/* parser.stream(p, reader | file [, opts]) */
+static int l_parser_stream(lua_State *L);
+
+/* parser.arena(), arena:run(fn, ...), arena:close(), arena:stats() */
+static int l_parser_arena(lua_State *L);
+static int l_arena_run(lua_State *L);
+static int l_arena_close(lua_State *L);
+static int l_arena_stats(lua_State *L);
+static int l_arena_gc(lua_State *L);
+
+/* parser.with_arena(fn, ...) -> arena, fn results */
+static int l_parser_with_arena(lua_State *L);
+
+/* parser.one_of(words [, opts]) */
+static int l_parser_one_of(lua_State *L);
+
+/* p:label(name) */
+static int l_parser_label(lua_State *L);
+
+/* p:cut() */
+static int l_parser_cut(lua_State *L);
+
+/* parser.expr{ atom, infix, prefix, postfix, fold } */
+static int expr_field(lua_State *L, int row, const char *name, int idx);
+static int expr_rows(lua_State *L, int spec, const char *key, int fixity,
+                     Parser *target);
+static int l_parser_expr(lua_State *L);
+
+/* p:compile() */
+static int l_parser_compile(lua_State *L);
+
+/* parser.lazy(function [, opts]) */
+static int l_parser_lazy(lua_State *L);
+
+/* parser.parse_file(p, path [, opts]) */
+static int parse_file_run(lua_State *L);
+static int l_parser_parse_file(lua_State *L);
+
+/* p:parse(input [, opts]) -> returns output (string or nil) , rest (string)
+   and on failure a ParseError */
 static int l_parser_parse(lua_State *L);
 
+/* ---------------------------
+   parse errors
+   the third result of a failed p:parse, line and column are only counted
+   when asked for
+   --------------------------- */
+
+typedef struct {
+  size_t pos;  // 0-based offset of the furthest failure
+  size_t line; // 0 until computed
+  size_t column;
+} ParseErrorUD;
+
+static void expect_describe(lua_State *L, Parser *p);
+static void push_parse_error(lua_State *L, ParseContext *ctx, int input_idx);
+static int push_parse_results(lua_State *L, ParseContext *ctx, ParseResult r);
+static int parse_error_index(lua_State *L);
+static int parse_error_tostring(lua_State *L);
+
+/* ---------------------------
+   profiling
+   parser.profile runs a parse that counts calls, outcomes, bytes and time
+   for every node on the way. It goes through the tree interpreter, so a
+   compiled parser is profiled as its source
+   --------------------------- */
+
+typedef struct {
+  Parser *node; // NULL marks an empty slot
+  size_t calls;
+  size_t ok;
+  size_t fail;
+  size_t bytes;      // consumed by successful calls
+  size_t backtracks; // failures an enclosing choice went on from
+  double time;       // seconds, children included
+  double self;       // seconds, children excluded
+} ProfileEntry;
+
+struct Profile {
+  ProfileEntry *entries;
+  size_t cap; // always a power of two
+  size_t count;
+  double child; // time the children of the running node took so far
+};
+
+static ProfileEntry *profile_entry(Profile *prof, Parser *p);
+static ParseResult profile_run(Parser *p, ParseContext *ctx, size_t pos);
+static void profile_push_report(lua_State *L, Profile *prof);
+static int profile_gc(lua_State *L);
+
+/* parser.profile(p, input [, opts]) -> report, output, rest */
+static int l_parser_profile(lua_State *L);
+
+/* ---------------------------
+   frozen grammars
+   p:freeze() compiles a grammar into a program that holds no Parser or Lua
+   references, what it reports as expected is described up front. Nothing
+   in it changes while parsing, so any number of lua_States on any threads
+   may run it at once. share() and parser.adopt hand it to another state
+   --------------------------- */
+
+typedef struct {
+  atomic_int refcount;
+  Program prog;   // owns its arrays, tries point into trie_blobs
+  Parser **stubs; // stand-ins for the expected origins, see freeze_stub
+  int nstubs;
+  OneOfData **trie_blobs;
+  // a loaded dump, most of the program points into it. Its stubs share one
+  // allocation and only origins, tries and funcs are allocated on their own
+  void *image;
+  size_t image_len;
+  int mapped; // image is a mapping of the file
+  Parser *stub_block;
+  // callbacks bound by parser.load are refs in this state, which owns them.
+  // Such a grammar cannot be shared
+  lua_State *owner;
+} Frozen;
+
+typedef struct {
+  Parser *origin; // of the source program, NULL marks an empty slot
+  int byte;       // the byte an or_else dispatch failed on, 0 otherwise
+  Parser *stub;
+} FreezeSlot;
+
+typedef struct {
+  FreezeSlot *slots;
+  size_t cap; // always a power of two
+  size_t count;
+  Frozen *f;
+} FreezeMap;
+
+// a token from share(), it holds a reference until parser.adopt claims it.
+// Outstanding tickets are kept in one list so that adopt only follows
+// pointers it handed out itself
+typedef struct ShareTicket {
+  Frozen *f;
+  struct ShareTicket *next;
+} ShareTicket;
+
+// the masks of a stand-in or_else, every alternative counts as skipped
+static uint64_t freeze_no_masks[257];
+
+static Parser *freeze_alloc(Frozen *f, ParserKind kind, size_t size);
+static Parser *freeze_stub(lua_State *L, FreezeMap *m, Parser *origin,
+                           int byte);
+static Frozen *freeze_program(lua_State *L, Parser *root, int callbacks,
+                              const char **why);
+static void frozen_release(Frozen *f);
+static Frozen *check_frozen(lua_State *L, int idx);
+static void push_frozen(lua_State *L, Frozen *f);
+
+/* p:freeze() */
+static int l_parser_freeze(lua_State *L);
+
+/* frozen:parse(input), frozen:share() -> token, parser.adopt(token) */
+static int l_frozen_parse(lua_State *L);
+static int l_frozen_share(lua_State *L);
+static int l_frozen_gc(lua_State *L);
+static int l_parser_adopt(lua_State *L);
+
+/* ---------------------------
+   grammar dumps
+   p:dump() writes the program p:freeze() would build, callbacks by name, as
+   one image of aligned sections. parser.load copies it into a single
+   allocation and parser.load_file maps it, the program then runs straight
+   from the image
+   --------------------------- */
+
+#define DUMP_MAGIC "PGRM"
+#define DUMP_VERSION 1
+#define DUMP_ALIGN 16
+
+enum {
+  DUMP_CODE,     // Instr per instruction
+  DUMP_ORIGINS,  // int32_t stub index per instruction, -1 for none
+  DUMP_CONSTS,   // literal and marker bytes
+  DUMP_CLASSES,  // VMClass
+  DUMP_SWITCHES, // VMSwitch
+  DUMP_TRIES,    // uint64_t offset per trie, then the OneOfData images
+  DUMP_FUNCS,    // DumpName per callback
+  DUMP_STUBS,    // DumpStub
+  DUMP_MEMBERS,  // int32_t stub indices of the or_else stubs
+  DUMP_STRINGS,  // names, NUL terminated
+  DUMP_NSECTIONS
+};
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order; // 0x01020304 as written
+  uint16_t sizes[6];   // of the structs the sections hold, see dump_sizes
+  int32_t ncode;
+  int32_t nclasses;
+  int32_t nswitches;
+  int32_t ntries;
+  int32_t nfuncs;
+  int32_t nstubs;
+  int32_t frame_slots;
+  uint64_t off[DUMP_NSECTIONS];
+  uint64_t len[DUMP_NSECTIONS];
+} DumpHeader;
+
+typedef struct {
+  uint32_t at; // in DUMP_STRINGS
+  uint32_t len;
+} DumpName;
+
+typedef struct {
+  int32_t kind; // P_LABEL or P_OR_ELSE
+  int32_t n;    // name length, or member count
+  uint32_t at;  // name in DUMP_STRINGS, or first member in DUMP_MEMBERS
+} DumpStub;
+
+typedef struct {
+  const Parser *stub;
+  int index;
+} DumpStubIndex;
+
+// what dump_verify knows about a value or a frame at an instruction
+typedef struct VerifyCell {
+  const struct VerifyCell *next; // the one under it
+  int kind;                      // 1 for a table, or the opcode of a frame
+  int depth;                     // values held when the frame was pushed
+} VerifyCell;
+
+typedef struct {
+  int sub; // entry of the subroutine the instruction runs in, -1 if unseen
+  int depth;
+  const VerifyCell *values;
+  const VerifyCell *frames;
+} VerifyState;
+
+static void dump_sizes(uint16_t sizes[6]);
+static int dump_in(const DumpHeader *h, int s, size_t len);
+static int dump_stub_cmp(const void *a, const void *b);
+static int dump_stub_index(const DumpStubIndex *idx, int n, const Parser *p);
+static int verify_same(const VerifyCell *a, const VerifyCell *b);
+static int verify_reach(VerifyState *states, int *work, int *nwork, int at,
+                        const VerifyState *s);
+static const char *dump_verify(const DumpHeader *h, const Instr *code,
+                               const VMSwitch *sw);
+static const char *dump_check(const DumpHeader *h, const char *image,
+                              size_t len);
+static Frozen *dump_load(lua_State *L, void *image, size_t len, int mapped,
+                         int callbacks);
+
+/* p:dump([callbacks]) -> string */
+static int l_parser_dump(lua_State *L);
+
+/* parser.load(bytes [, callbacks]), parser.load_file(path [, callbacks]) */
+static int l_parser_load(lua_State *L);
+static int l_parser_load_file(lua_State *L);
+
+/* ---------------------------
+   parallel records
+   parser.parse_records splits its input at a separator byte and parses the
+   records with a frozen grammar on a pool of threads. Workers run a bare
+   lua_State each and flatten every output into a byte encoding the calling
+   state turns back into values, in record order
+   --------------------------- */
+
+#define RECORDS_BATCH 64 // records a worker claims at a time
+
+typedef struct {
+  size_t start; // of the record in the input
+  size_t len;
+  size_t out; // offset of the encoded output, or the ParseError, in the
+              // worker's buffer
+  int worker;
+  int ok;
+} Record;
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} RecordBuf;
+
+// how outputs are flattened, each value is a tag byte and its payload
+enum {
+  IR_NIL,
+  IR_FALSE,
+  IR_TRUE,
+  IR_INT,  // lua_Integer
+  IR_NUM,  // lua_Number
+  IR_STR,  // size_t length, bytes
+  IR_LIST, // size_t count, values
+  IR_MAP   // size_t count, key and value pairs
+};
+
+typedef struct RecordJob RecordJob;
+
+typedef struct {
+  RecordJob *job;
+  int id;
+  size_t at;    // the record being parsed
+  size_t first; // that raised an error, only set with error
+  char *error;  // its message, the worker stops there
+} RecordWorker;
+
+struct RecordJob {
+  Program *prog; // read only
+  const char *input;
+  Record *records;
+  size_t nrecords;
+  atomic_size_t next; // first record no worker claimed yet
+  RecordBuf *bufs;    // one per worker
+  RecordWorker *workers;
+  int nworkers;
+};
+
+static int record_parse(lua_State *L, Parser *p, Program *prog,
+                        const char *input, size_t len, int input_idx,
+                        ParseError *err);
+static void ir_put(RecordBuf *b, const void *src, size_t n);
+static void ir_encode(lua_State *W, int idx, RecordBuf *b);
+static void ir_decode(lua_State *L, const char **s);
+static int records_step(lua_State *W);
+static void records_fail(RecordWorker *w, size_t at, const char *msg);
+static void *records_worker(void *arg);
+static size_t records_split(RecordJob *job, const char *input, size_t len,
+                            char sep);
+static void records_push_error(lua_State *L, const char *rec, size_t len,
+                               const ParseError *err);
+static void records_free(RecordJob *job);
+static int records_gc(lua_State *L);
+
+/* parser.parse_records(p, input [, opts]) -> outputs, errors */
+static int l_parser_parse_records(lua_State *L);
+
 static char *inspect_literal(Parser *p, int indent);
 static char *inspect_any_char(Parser *p, int indent);
 
@@ -261,6 +1147,12 @@ static char *inspect_binary(const char *name, Parser *left, Parser *right,
 static char *inspect_pair(Parser *p, int indent);
 static char *inspect_take_after(Parser *p, int indent);
 static char *inspect_drop_for(Parser *p, int indent);
+static char *inspect_unary(const char *name, Parser *inner, int indent);
+static char *inspect_expr(Parser *p, int indent);
+static char *inspect_recognize(Parser *p, int indent);
+static char *inspect_many_concat(Parser *p, int indent);
+static char *inspect_sep_by(Parser *p, int indent);
+static char *inspect_many_till(Parser *p, int indent);
 static char *inspect_or_else(Parser *p, int indnet);
 
 static char *inspect_one_or_more(Parser *p, int indent);
@@ -273,8 +1165,17 @@ static char *inspect_map(Parser *p, int indent);
 static char *inspect_and_then(Parser *p, int indent);
 
 static char *inspect_lazy(Parser *p, int indent);
+static char *inspect_memo(Parser *p, int indent);
+static char *inspect_char_class(Parser *p, int indent);
+static char *inspect_take_while(Parser *p, int indent);
+static char *inspect_take_until(Parser *p, int indent);
+static char *inspect_one_of(Parser *p, int indent);
+static char *inspect_label(Parser *p, int indent);
+static char *inspect_cut(Parser *p, int indent);
+static char *inspect_compiled(Parser *p, int indent);
 
 static char *inspect_parser(Parser *p, int ident);
+static const char *parser_kind_name(const Parser *p);
 
 int luaopen_parser_core(lua_State *L);
 
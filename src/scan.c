@@ -0,0 +1,275 @@
+// Bulk byte scanners used by take_while / take_until.
+// On x86-64 the kernels use SSE2 (always available there) or AVX2 when the
+// CPU has it, picked once at runtime by whichever thread scans first.
+// Everything else uses the scalar loops.
+
+#include "scan.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SCAN_X86 1
+#include <immintrin.h>
+#include <pthread.h>
+#endif
+
+/* ---------------------------
+   scan plans
+   --------------------------- */
+
+// collects the ranges of bytes whose membership equals `want`, returns the
+// number of ranges or -1 if there are more than SCAN_MAX_RANGES
+static int collect_ranges(const CharSet *set, int want, unsigned char *lo,
+                          unsigned char *width) {
+  int n = 0;
+  int c = 0;
+
+  while (c < 256) {
+    if ((charset_has(set, (unsigned char)c) != 0) != want) {
+      c++;
+      continue;
+    }
+
+    int start = c;
+    while (c < 256 && (charset_has(set, (unsigned char)c) != 0) == want)
+      c++;
+
+    if (n == SCAN_MAX_RANGES)
+      return -1;
+    lo[n] = (unsigned char)start;
+    width[n] = (unsigned char)(c - 1 - start);
+    n++;
+  }
+
+  return n;
+}
+
+void scan_plan(ScanPlan *plan, const CharSet *set) {
+  memset(plan, 0, sizeof(ScanPlan));
+
+  int n = collect_ranges(set, 1, plan->lo, plan->width);
+  if (n > 0) {
+    plan->nranges = n;
+    return;
+  }
+
+  // negated sets like [^"] are cheaper to describe by their stop bytes
+  n = collect_ranges(set, 0, plan->lo, plan->width);
+  if (n > 0) {
+    plan->nranges = n;
+    plan->negate = 1;
+    return;
+  }
+
+  plan->nranges = 0;
+}
+
+/* ---------------------------
+   vector kernels
+   each returns how many leading bytes it could vouch for, the caller
+   finishes the tail with the scalar loop
+   --------------------------- */
+
+#ifdef SCAN_X86
+
+static size_t while_sse2(const ScanPlan *plan, const unsigned char *s,
+                         size_t len) {
+  __m128i lo[SCAN_MAX_RANGES], width[SCAN_MAX_RANGES];
+  for (int r = 0; r < plan->nranges; r++) {
+    lo[r] = _mm_set1_epi8((char)plan->lo[r]);
+    width[r] = _mm_set1_epi8((char)plan->width[r]);
+  }
+
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i hit = zero;
+
+    // v - lo <= width (unsigned) iff the saturating difference is zero
+    for (int r = 0; r < plan->nranges; r++) {
+      __m128i d = _mm_subs_epu8(_mm_sub_epi8(v, lo[r]), width[r]);
+      hit = _mm_or_si128(hit, _mm_cmpeq_epi8(d, zero));
+    }
+
+    unsigned int in = (unsigned int)_mm_movemask_epi8(hit);
+    if (plan->negate)
+      in = ~in & 0xFFFFu;
+
+    if (in != 0xFFFFu)
+      return i + (size_t)__builtin_ctz(~in);
+  }
+
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+while_avx2(const ScanPlan *plan, const unsigned char *s, size_t len) {
+  __m256i lo[SCAN_MAX_RANGES], width[SCAN_MAX_RANGES];
+  for (int r = 0; r < plan->nranges; r++) {
+    lo[r] = _mm256_set1_epi8((char)plan->lo[r]);
+    width[r] = _mm256_set1_epi8((char)plan->width[r]);
+  }
+
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i hit = zero;
+
+    for (int r = 0; r < plan->nranges; r++) {
+      __m256i d = _mm256_subs_epu8(_mm256_sub_epi8(v, lo[r]), width[r]);
+      hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(d, zero));
+    }
+
+    unsigned int in = (unsigned int)_mm256_movemask_epi8(hit);
+    if (plan->negate)
+      in = ~in;
+
+    if (in != 0xFFFFFFFFu)
+      return i + (size_t)__builtin_ctz(~in);
+  }
+
+  return i + while_sse2(plan, s + i, len - i);
+}
+
+// candidates are positions where both the first and the last needle byte
+// match, only those get a memcmp
+static size_t find_sse2(const unsigned char *s, size_t len,
+                        const unsigned char *needle, size_t nlen,
+                        int *found) {
+  const __m128i first = _mm_set1_epi8((char)needle[0]);
+  const __m128i last = _mm_set1_epi8((char)needle[nlen - 1]);
+  size_t i = 0;
+
+  for (; i + nlen - 1 + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + i + nlen - 1));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+    while (mask) {
+      size_t at = i + (size_t)__builtin_ctz(mask);
+      if (memcmp(s + at + 1, needle + 1, nlen - 2) == 0) {
+        *found = 1;
+        return at;
+      }
+      mask &= mask - 1;
+    }
+  }
+
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+find_avx2(const unsigned char *s, size_t len, const unsigned char *needle,
+          size_t nlen, int *found) {
+  const __m256i first = _mm256_set1_epi8((char)needle[0]);
+  const __m256i last = _mm256_set1_epi8((char)needle[nlen - 1]);
+  size_t i = 0;
+
+  for (; i + nlen - 1 + 32 <= len; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(s + i + nlen - 1));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+    while (mask) {
+      size_t at = i + (size_t)__builtin_ctz(mask);
+      if (memcmp(s + at + 1, needle + 1, nlen - 2) == 0) {
+        *found = 1;
+        return at;
+      }
+      mask &= mask - 1;
+    }
+  }
+
+  size_t j = find_sse2(s + i, len - i, needle, nlen, found);
+  return i + j;
+}
+
+typedef size_t (*while_kernel_t)(const ScanPlan *plan, const unsigned char *s,
+                                 size_t len);
+typedef size_t (*find_kernel_t)(const unsigned char *s, size_t len,
+                                const unsigned char *needle, size_t nlen,
+                                int *found);
+
+// set once through kernels_once, parse_records scans on several threads
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+static while_kernel_t while_kernel;
+static find_kernel_t find_kernel;
+
+static void pick_kernels(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    while_kernel = while_avx2;
+    find_kernel = find_avx2;
+  } else {
+    while_kernel = while_sse2;
+    find_kernel = find_sse2;
+  }
+}
+
+#endif
+
+/* ---------------------------
+   entry points
+   --------------------------- */
+
+size_t scan_while(const CharSet *set, const ScanPlan *plan, const char *s,
+                  size_t len) {
+  const unsigned char *u = (const unsigned char *)s;
+  size_t i = 0;
+
+#ifdef SCAN_X86
+  if (plan->nranges > 0) {
+    pthread_once(&kernels_once, pick_kernels);
+    i = while_kernel(plan, u, len);
+  }
+#else
+  (void)plan;
+#endif
+
+  while (i < len && charset_has(set, u[i]))
+    i++;
+
+  return i;
+}
+
+size_t scan_find(const char *s, size_t len, const char *needle, size_t nlen) {
+  if (nlen == 0)
+    return 0;
+  if (nlen > len)
+    return len;
+
+  if (nlen == 1) {
+    const char *at = memchr(s, needle[0], len);
+    return at ? (size_t)(at - s) : len;
+  }
+
+  const unsigned char *u = (const unsigned char *)s;
+  size_t i = 0;
+
+#ifdef SCAN_X86
+  pthread_once(&kernels_once, pick_kernels);
+
+  int found = 0;
+  i = find_kernel(u, len, (const unsigned char *)needle, nlen, &found);
+  if (found)
+    return i;
+#endif
+
+  for (; i + nlen <= len; i++) {
+    const char *at = memchr(s + i, needle[0], len - nlen + 1 - i);
+    if (!at)
+      break;
+
+    i = (size_t)(at - s);
+    if (memcmp(at, needle, nlen) == 0)
+      return i;
+  }
+
+  return len;
+}
@@ -0,0 +1,47 @@
+#ifndef __PARSER_SCAN
+#define __PARSER_SCAN
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a 256-bit byte set */
+typedef struct {
+  unsigned char bits[32];
+} CharSet;
+
+static inline int charset_has(const CharSet *cs, unsigned char c) {
+  return cs->bits[c >> 3] & (1u << (c & 7));
+}
+
+static inline void charset_add(CharSet *cs, unsigned char c) {
+  cs->bits[c >> 3] |= (unsigned char)(1u << (c & 7));
+}
+
+#define SCAN_MAX_RANGES 8
+
+/* a byte set rewritten as a few [lo, lo + width] ranges so the vector
+   kernels can test 16 or 32 bytes at once */
+typedef struct {
+  int nranges; // 0 if the set is too fragmented, the scalar loop is used
+  int negate;  // the ranges hold the bytes that stop the scan
+  unsigned char lo[SCAN_MAX_RANGES];
+  unsigned char width[SCAN_MAX_RANGES];
+} ScanPlan;
+
+void scan_plan(ScanPlan *plan, const CharSet *set);
+
+/* length of the longest prefix of s whose bytes are all in set */
+size_t scan_while(const CharSet *set, const ScanPlan *plan, const char *s,
+                  size_t len);
+
+/* offset of the first occurrence of needle in s, or len if there is none */
+size_t scan_find(const char *s, size_t len, const char *needle, size_t nlen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
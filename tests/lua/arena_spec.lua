@@ -0,0 +1,70 @@
+local P = require("parser")
+
+describe("parser", function()
+  it("should build parsers inside an arena", function()
+    local arena = P.arena()
+    local kv = arena:run(function()
+      local key = P.take_while("%a", 1):take_after(P.literal("="))
+      return key:pair(P.take_while("%w"))
+    end)
+
+    local out, rest = kv:parse("a=1;")
+    assert.are.same(out, { "a", "1" })
+    assert.are.equal(rest, ";")
+
+    local stats = arena:stats()
+    assert.are.equal(stats.nodes, 5)
+    assert.is_true(stats.bytes > 0)
+  end)
+
+  it("should pass arguments and results through with_arena", function()
+    local arena, a, b = P.with_arena(function(s)
+      return P.literal(s), P.literal(s .. s)
+    end, "x")
+
+    assert.are.equal(arena:stats().nodes, 2)
+    assert.are.equal(a:parse("xy"), "x")
+    assert.are.equal(b:parse("xxy"), "xx")
+  end)
+
+  it("should mix arena and heap parsers", function()
+    local heap = P.literal("b")
+    local arena = P.arena()
+    local p = arena:run(function()
+      return P.literal("a"):pair(heap)
+    end)
+
+    local q = p:or_else(heap)
+    arena:close()
+
+    assert.are.same(q:parse("ab"), { "a", "b" })
+    assert.are.equal(q:parse("b"), "b")
+  end)
+
+  it("should refuse parsers of a closed arena", function()
+    local arena = P.arena()
+    local p = arena:run(function()
+      return P.literal("a")
+    end)
+    arena:close()
+
+    assert.has_error(function()
+      p:parse("a")
+    end)
+    assert.has_error(function()
+      arena:run(function() end)
+    end)
+  end)
+
+  it("should restore the outer arena after an error", function()
+    local arena = P.arena()
+    assert.has_error(function()
+      arena:run(function()
+        error("boom")
+      end)
+    end)
+
+    P.literal("a")
+    assert.are.equal(arena:stats().nodes, 0)
+  end)
+end)
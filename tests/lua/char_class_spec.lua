@@ -0,0 +1,54 @@
+local P = require("parser")
+
+describe("parser", function()
+  it("should parse a single byte of a class", function()
+    local p = P.char_class("[%a_]")
+
+    local out, rest = p:parse("_x1")
+    assert.are.equal(out, "_")
+    assert.are.equal(rest, "x1")
+
+    out, rest = p:parse("1x")
+    assert.is.falsy(out)
+    assert.are.equal(rest, "1x")
+  end)
+
+  it("should support negated sets and ranges", function()
+    local out, rest = P.take_while('[^"]'):parse('hello" there')
+    assert.are.equal(out, "hello")
+    assert.are.equal(rest, '" there')
+
+    out, rest = P.take_while("[a-c%-]"):parse("ab-cd")
+    assert.are.equal(out, "ab-c")
+    assert.are.equal(rest, "d")
+  end)
+
+  it("should take a run as one string", function()
+    local out, rest = P.take_while("%d", 1):parse("123abc")
+    assert.are.equal(out, "123")
+    assert.are.equal(rest, "abc")
+
+    out, rest = P.take_while("%d", 1):parse("abc")
+    assert.is.falsy(out)
+    assert.are.equal(rest, "abc")
+
+    out, rest = P.take_while("%d"):parse("abc")
+    assert.are.equal(out, "")
+    assert.are.equal(rest, "abc")
+  end)
+
+  it("should parse digits and spaces", function()
+    local out, rest = P.digit():parse("42")
+    assert.are.equal(out, "4")
+    assert.are.equal(rest, "2")
+
+    out, rest = P.space1():parse("  \t x")
+    assert.are.equal(out, "  \t ")
+    assert.are.equal(rest, "x")
+  end)
+
+  it("should reject malformed classes", function()
+    assert.has_error(function() P.char_class("[abc") end)
+    assert.has_error(function() P.char_class("ab") end)
+  end)
+end)
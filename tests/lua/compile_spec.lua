@@ -0,0 +1,115 @@
+local P = require("parser")
+
+-- runs p both ways and checks the compiled parser agrees with the tree
+local function same(p, input)
+  local out, rest = p:parse(input)
+  local cout, crest = p:compile():parse(input)
+
+  assert.are.same(out, cout)
+  assert.are.equal(rest, crest)
+  return cout, crest
+end
+
+describe("parser", function()
+  it("should compile sequences and choices", function()
+    local ab = P.literal("a"):pair(P.literal("b"))
+    local p = ab:or_else(P.literal("a"):drop_for(P.literal("c")))
+        :take_after(P.literal(";"))
+
+    same(p, "ab;x")
+    same(p, "ac;x")
+    same(p, "ad;x")
+    same(p, "")
+  end)
+
+  it("should compile repetitions", function()
+    local word = P.take_while("%a", 1):take_after(P.space0())
+
+    same(word:zero_or_more(), "one two three!")
+    same(word:zero_or_more(), "!")
+    same(word:one_or_more(), "one two")
+    same(word:one_or_more(), "!")
+    same(P.char_class("%d"):one_or_more(), "123a")
+    same(P.any_char():zero_or_more(), "h\xc3\xa9")
+  end)
+
+  it("should stop repeating a parser that consumes nothing", function()
+    local out, rest = P.take_while("%d"):zero_or_more():compile():parse("ab")
+
+    assert.are.same(out, { "" })
+    assert.are.equal(rest, "ab")
+  end)
+
+  it("should run callbacks and fallback nodes", function()
+    local num = P.take_while("%d", 1):map(tonumber)
+    local even = num:pred(function(n)
+      return n % 2 == 0
+    end)
+    local tagged = P.literal("#"):and_then(function()
+      return num
+    end)
+    local pure = P.pure("none")
+
+    same(even, "42!")
+    same(even, "41!")
+    same(tagged, "#7")
+    same(tagged:or_else(pure), "x")
+    same(P.take_until("--", true):or_else(pure), "a--b")
+    same(num:memoize():pair(P.literal(";")), "5;")
+  end)
+
+  it("should compile recursive grammars", function()
+    local expr
+    expr = P.lazy(function()
+      return P.literal("("):drop_for(expr):take_after(P.literal(")"))
+          :map(function(v)
+            return v + 1
+          end)
+          :or_else(P.literal("x"):map(function()
+            return 0
+          end))
+    end)
+
+    local out, rest = same(expr, "((((x))))y")
+    assert.are.equal(out, 4)
+    assert.are.equal(rest, "y")
+    same(expr, "((x)")
+  end)
+
+  it("should not be bound by C recursion depth", function()
+    local nest
+    nest = P.lazy(function()
+      return P.literal("["):drop_for(nest):take_after(P.literal("]"))
+          :or_else(P.literal("."))
+    end)
+
+    local depth = 100000
+    local input = string.rep("[", depth) .. "." .. string.rep("]", depth)
+    local out, rest = nest:compile():parse(input)
+
+    assert.are.equal(out, ".")
+    assert.are.equal(rest, "")
+  end)
+
+  it("should raise once nesting outgrows the Lua stack", function()
+    local nest
+    nest = P.lazy(function()
+      return P.literal("["):drop_for(nest):take_after(P.literal("]"))
+          :or_else(P.literal("."))
+    end)
+    local compiled = nest:compile()
+
+    assert.has_error(function()
+      compiled:parse(string.rep("[", 1200000))
+    end, "parser nesting too deep")
+    assert.are.equal(compiled:parse("[[.]]"), ".")
+  end)
+
+  it("should inspect the source grammar", function()
+    local p = P.literal("a"):compile()
+
+    assert.are.equal(p:compile(), p)
+    assert.are.equal(tostring(p), "<Parser:compiled>")
+    assert.are.equal(P.inspect(p, 0), 'compiled(\n    literal("a")\n)')
+  end)
+end)
@@ -0,0 +1,35 @@
+local P = require("parser")
+
+describe("parser", function()
+  it("should return results when parsing inside a coroutine", function()
+    local p = P.literal("a"):pair(P.literal("b"):map(string.upper))
+
+    local co = coroutine.wrap(function()
+      local out, rest = p:parse("abc")
+      coroutine.yield(out, rest)
+    end)
+
+    local out, rest = co()
+    assert.are.same(out, { "a", "B" })
+    assert.are.equal(rest, "c")
+  end)
+
+  it("should handle deeply nested results", function()
+    local nested
+    nested = P.lazy(function()
+      return P.literal("("):drop_for(nested):take_after(P.literal(")"))
+          :map(function(v) return { v } end)
+          :or_else(P.literal("x"))
+    end)
+
+    local depth = 150
+    local input = string.rep("(", depth) .. "x" .. string.rep(")", depth)
+    local out, rest = nested:parse(input)
+
+    for _ = 1, depth do
+      out = out[1]
+    end
+    assert.are.equal(out, "x")
+    assert.are.equal(rest, "")
+  end)
+end)
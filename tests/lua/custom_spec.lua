@@ -0,0 +1,35 @@
+local P = require("parser")
+
+local word = P.custom(function(input, pos)
+  local s, e = input:find("^%a+", pos)
+  if not s then
+    return nil
+  end
+  return input:sub(s, e), e + 1
+end)
+
+describe("parser", function()
+  it("should run a positional custom parser", function()
+    local out, rest = P.literal(">"):drop_for(word):parse(">hello world")
+
+    assert.are.equal(out, "hello")
+    assert.are.equal(rest, " world")
+  end)
+
+  it("should fail when no position is returned", function()
+    local out, rest = word:parse("123")
+
+    assert.is.falsy(out)
+    assert.are.equal(rest, "123")
+  end)
+
+  it("should keep the rest-string protocol working", function()
+    local p = P.new(function(input)
+      return input:sub(1, 2), input:sub(3)
+    end)
+    local out, rest = P.literal("a"):drop_for(p):parse("abcd")
+
+    assert.are.equal(out, "bc")
+    assert.are.equal(rest, "d")
+  end)
+end)
@@ -0,0 +1,79 @@
+local P = require("parser")
+
+describe("parser", function()
+  local digit = P.char_class("%d")
+
+  it("should not try other alternatives past a cut", function()
+    local tried = false
+    local fallback = P.literal("{"):pred(function()
+      tried = true
+      return true
+    end)
+    local obj = P.literal("{"):cut():drop_for(digit):take_after(P.literal("}"))
+
+    local out, rest = obj:or_else(fallback):parse("{x}")
+    assert.is.falsy(out)
+    assert.are.equal(rest, "{x}")
+    assert.is.falsy(tried)
+
+    out, rest = obj:or_else(fallback):parse("{1}")
+    assert.are.equal(out, "1")
+    assert.are.equal(rest, "")
+  end)
+
+  it("should still try alternatives before the cut", function()
+    local obj = P.literal("{"):cut():drop_for(digit)
+    local value = obj:or_else(P.literal("["))
+
+    local out, rest = value:parse("[")
+    assert.are.equal(out, "[")
+    assert.are.equal(rest, "")
+  end)
+
+  it("should stop repetitions on failures past a cut", function()
+    local item = P.literal("("):cut():drop_for(digit):take_after(P.literal(")"))
+
+    local out, rest = item:zero_or_more():parse("(1)(2)x")
+    assert.are.same(out, { "1", "2" })
+    assert.are.equal(rest, "x")
+
+    out = item:zero_or_more():parse("(1)(x)")
+    assert.is.falsy(out)
+
+    out = item:sep_by(P.literal(",")):parse("(1),(x)")
+    assert.is.falsy(out)
+  end)
+
+  it("should commit enclosing choices after a cut succeeded", function()
+    local a = P.literal("a"):cut():pair(P.literal("b"))
+    local p = a:or_else(P.literal("ac"))
+
+    assert.is.falsy(p:parse("ac"))
+    assert.is.falsy(P.commit(P.literal("a")):pair(P.literal("b"))
+      :or_else(P.literal("ac")):parse("ac"))
+  end)
+
+  it("should behave the same when compiled", function()
+    local item = P.literal("("):cut():drop_for(digit):take_after(P.literal(")"))
+    local list = item:zero_or_more()
+    local p = list:or_else(P.pure("fallback"))
+
+    for _, input in ipairs({ "(1)(2)x", "(1)(x)", "x" }) do
+      local a, ra = p:parse(input)
+      local b, rb = p:compile():parse(input)
+      assert.are.same(a, b)
+      if a then
+        assert.are.equal(ra, rb)
+      end
+    end
+  end)
+
+  it("should work with memoization", function()
+    local item = P.literal("("):cut():drop_for(digit):take_after(P.literal(")"))
+    local list = item:zero_or_more()
+
+    local out = list:parse(string.rep("(1)", 5000), { memo = true })
+    assert.are.equal(#out, 5000)
+    assert.is.falsy(list:parse("(1)(x)", { memo = true }))
+  end)
+end)
@@ -0,0 +1,108 @@
+local P = require("parser")
+
+describe("parser", function()
+  local word = P.take_while("%a", 1)
+  local comma = P.literal(",")
+
+  -- overwrites bytes at an offset into one of the sections of a dump
+  local function patch(bytes, section, at, with)
+    local i = string.unpack("=I8", bytes, 57 + 8 * section) + at + 1
+    return bytes:sub(1, i - 1) .. with .. bytes:sub(i + #with)
+  end
+
+  it("should parse the same after a dump and load", function()
+    local list
+    list = P.lazy(function()
+      local item = word:or_else(list)
+      return P.literal("["):drop_for(item:sep_by(comma)):take_after(P.literal("]"))
+    end)
+    local loaded = P.load(list:dump())
+
+    for _, input in ipairs({ "[a,[b,c],d]", "[]", "[a,", "x" }) do
+      local out = list:parse(input)
+      assert.are.same(out, (loaded:parse(input)))
+    end
+  end)
+
+  it("should keep keywords, labels and expected sets", function()
+    local kw = P.one_of({ "true", "false", "null" })
+    local num = P.char_class("%d"):many1_concat():label("number")
+    local value = kw:or_else(num):or_else(P.literal('"'):cut():drop_for(word))
+    local p = value:sep_by(comma)
+    local loaded = P.load(p:dump())
+
+    assert.are.same(loaded:parse("null,12,\"x"), { "null", "12", "x" })
+
+    for _, input in ipairs({ "!", "nul", "1,\"" }) do
+      local _, _, err = p:parse(input)
+      local _, _, lerr = loaded:parse(input)
+      assert.are.equal(err.pos, lerr.pos)
+      assert.are.same(err.expected, lerr.expected)
+    end
+  end)
+
+  it("should bind callbacks by name", function()
+    local function is_even(n)
+      return n % 2 == 0
+    end
+    local num = P.char_class("%d"):many1_concat():map(tonumber)
+    local even = num:pred(is_even)
+    local bytes = even:sep_by(comma):dump({ tonumber = tonumber, even = is_even })
+
+    assert.has_error(function()
+      even:dump({ tonumber = tonumber })
+    end)
+
+    local loaded = P.load(bytes, {
+      tonumber = tonumber,
+      even = function(n)
+        return n % 2 == 0
+      end,
+    })
+    assert.are.same(loaded:parse("2,4,5"), { 2, 4 })
+    assert.has_error(function()
+      loaded:share()
+    end)
+    assert.has_error(function()
+      P.load(bytes, { tonumber = tonumber })
+    end)
+  end)
+
+  it("should load dumps from files", function()
+    local path = os.tmpname()
+    local f = assert(io.open(path, "wb"))
+    f:write(word:sep_by(comma):dump())
+    f:close()
+
+    local loaded = P.load_file(path)
+    os.remove(path)
+    assert.are.same(loaded:parse("a,b"), { "a", "b" })
+  end)
+
+  it("should reject anything that is not a dump", function()
+    local bytes = word:dump()
+    assert.has_error(function()
+      P.load("not a grammar")
+    end)
+    assert.has_error(function()
+      P.load(bytes:sub(1, 100))
+    end)
+    assert.has_error(function()
+      P.load("XXXX" .. bytes:sub(5))
+    end)
+  end)
+
+  it("should reject programs that would misuse the stack or frames", function()
+    local bytes = word:sep_by(comma):dump()
+    assert.are.same(P.load(bytes):parse("a,b"), { "a", "b" })
+
+    -- a return with no call frame as the first instruction
+    assert.has_error(function()
+      P.load(patch(bytes, 0, 0, string.char(12)))
+    end)
+    -- more scan ranges than the vector kernels hold
+    assert.has_error(function()
+      P.load(patch(bytes, 3, 32, string.pack("=i4", 100)))
+    end)
+  end)
+end)
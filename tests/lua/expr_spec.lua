@@ -0,0 +1,99 @@
+local P = require("parser")
+
+local num = P.take_while("%d", 1):map(tonumber)
+
+local function arith(a, op, b)
+  if op == "+" then return a + b end
+  if op == "-" then return a and a - b or -b end
+  if op == "*" then return a * b end
+  if op == "/" then return a / b end
+  if op == "^" then return a ^ b end
+  if op == "!" then
+    local n = 1
+    for i = 2, a do n = n * i end
+    return n
+  end
+end
+
+local calc = P.expr {
+  atom = num,
+  prefix = { { "-", 3 } },
+  infix = {
+    { { "+", "-" }, "left", 1 },
+    { { "*", "/" }, "left", 2 },
+    { "^", "right", 4 },
+  },
+  postfix = { { "!", 5 } },
+  fold = arith,
+}
+
+describe("parser", function()
+  it("should respect precedence and associativity", function()
+    assert.are.equal(calc:parse("1+2*3"), 7)
+    assert.are.equal(calc:parse("2*3+1"), 7)
+    assert.are.equal(calc:parse("10-4-3"), 3)
+    assert.are.equal(calc:parse("2^3^2"), 512)
+    assert.are.equal(calc:parse("-2^2"), -4)
+    assert.are.equal(calc:parse("3!+1"), 7)
+  end)
+
+  it("should leave a dangling operator unparsed", function()
+    local out, rest = calc:parse("1+2+")
+    assert.are.equal(out, 3)
+    assert.are.equal(rest, "+")
+
+    out, rest = calc:parse("+1")
+    assert.is.falsy(out)
+    assert.are.equal(rest, "+1")
+  end)
+
+  it("should fold once per operator", function()
+    local calls = 0
+    local p = P.expr {
+      atom = num,
+      infix = { { ops = "+", assoc = "left", prec = 1 } },
+      fold = function(a, _, b)
+        calls = calls + 1
+        return a + b
+      end,
+    }
+
+    local input = "1" .. string.rep("+1", 999)
+    assert.are.equal(p:parse(input), 1000)
+    assert.are.equal(calls, 999)
+  end)
+
+  it("should build tables without a fold function", function()
+    local p = P.expr {
+      atom = num,
+      infix = { { P.literal("+"), "left", 1 } },
+    }
+
+    local out = p:parse("1+2+3")
+    assert.are.same(out, { { 1, "+", 2 }, "+", 3 })
+  end)
+
+  it("should recurse through parenthesized atoms", function()
+    local expr
+    local atom = num:or_else(P.between(P.literal("("), P.lazy(function()
+      return expr
+    end), P.literal(")")))
+    expr = P.expr {
+      atom = atom,
+      infix = { { "+", "left", 1 }, { "*", "left", 2 } },
+      fold = arith,
+    }
+
+    assert.are.equal(expr:parse("(1+2)*3"), 9)
+    assert.are.equal(expr:compile():parse("(1+2)*(3+4)"), 21)
+  end)
+
+  it("should reject malformed specs", function()
+    assert.has_error(function()
+      P.expr { infix = {} }
+    end)
+    assert.has_error(function()
+      P.expr { atom = num, infix = { { "+", "up", 1 } } }
+    end)
+  end)
+end)
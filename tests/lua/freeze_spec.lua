@@ -0,0 +1,103 @@
+local P = require("parser")
+
+describe("parser", function()
+  local word = P.take_while("%a", 1)
+  local comma = P.literal(",")
+  local list = P.literal("["):drop_for(word:sep_by(comma)):take_after(P.literal("]"))
+
+  it("should parse the same when frozen", function()
+    local frozen = list:freeze()
+
+    for _, input in ipairs({ "[a,b]", "[]x", "[a,]", "a" }) do
+      local out, rest = list:parse(input)
+      local fout, frest = frozen:parse(input)
+      assert.are.same(out, fout)
+      if out ~= nil then
+        assert.are.equal(rest, frest)
+      end
+    end
+  end)
+
+  it("should keep keywords, classes and labels", function()
+    local kw = P.one_of({ "let", "letter", "in" }, { longest = true })
+    local num = P.char_class("%d"):many1_concat():label("number")
+    local stmt = kw:take_after(P.literal(" ")):pair(num:or_else(word))
+    local frozen = stmt:freeze()
+
+    assert.are.same(frozen:parse("letter 12"), { "letter", "12" })
+    assert.are.same(frozen:parse("in x"), { "in", "x" })
+
+    local _, _, err = stmt:parse("let !")
+    local _, _, ferr = frozen:parse("let !")
+    assert.are.equal(err.pos, ferr.pos)
+    assert.are.equal(tostring(err), tostring(ferr))
+  end)
+
+  it("should describe skipped alternatives", function()
+    local value = P.literal("true"):or_else(P.literal("false")):or_else(P.literal("null"))
+    local p = value:pair(P.literal(";"))
+    local frozen = p:freeze()
+
+    local _, _, err = frozen:parse("x")
+    assert.are.equal(err.pos, 1)
+    assert.are.same(err.expected, { '"true"', '"false"', '"null"' })
+    assert.are.same(err.expected, select(3, p:parse("x")).expected)
+
+    _, _, err = frozen:parse("true!")
+    assert.are.same(err.expected, { '";"' })
+  end)
+
+  it("should resolve lazy parsers", function()
+    local nested
+    nested = P.lazy(function()
+      return P.literal("("):drop_for(nested:or_else(P.literal("x"))):take_after(P.literal(")"))
+    end)
+
+    local frozen = nested:freeze()
+    assert.are.equal(frozen:parse("((x))"), "x")
+    assert.is.falsy(frozen:parse("((x)"))
+  end)
+
+  it("should honour cuts", function()
+    local obj = P.literal("{"):cut():drop_for(P.char_class("%d")):take_after(P.literal("}"))
+    local frozen = obj:or_else(P.literal("{x}")):freeze()
+
+    assert.are.equal(frozen:parse("{1}"), "1")
+    assert.is.falsy(frozen:parse("{x}"))
+  end)
+
+  it("should reject grammars that need the building state", function()
+    assert.has_error(function()
+      word:map(string.upper):freeze()
+    end)
+    assert.has_error(function()
+      word:memoize():freeze()
+    end)
+    assert.has_error(function()
+      P.one_of({ yes = true, no = false }):freeze()
+    end)
+  end)
+
+  it("should hand frozen grammars over with share and adopt", function()
+    local token = list:freeze():share()
+    collectgarbage()
+
+    local adopted = P.adopt(token)
+    assert.are.same(adopted:parse("[a,b]"), { "a", "b" })
+  end)
+
+  it("should adopt a token only once", function()
+    local token = list:freeze():share()
+    P.adopt(token)
+    assert.has_error(function()
+      P.adopt(token)
+    end)
+
+    local function holds()
+      return list
+    end
+    assert.has_error(function()
+      P.adopt(debug.upvalueid(holds, 1))
+    end)
+  end)
+end)
@@ -0,0 +1,32 @@
+local P = require("parser")
+
+describe("parser", function()
+  it("should resolve a lazy parser once", function()
+    local calls = 0
+    local p = P.lazy(function()
+      calls = calls + 1
+      return P.literal("a")
+    end)
+
+    local many = p:zero_or_more()
+    local out, rest = many:parse("aaab")
+    assert.are.same(out, { "a", "a", "a" })
+    assert.are.equal(rest, "b")
+
+    many:parse("aa")
+    assert.are.equal(calls, 1)
+  end)
+
+  it("should re-run the thunk when once is off", function()
+    local calls = 0
+    local p = P.lazy(function()
+      calls = calls + 1
+      return calls % 2 == 1 and P.literal("a") or P.literal("b")
+    end, { once = false })
+
+    local out, rest = p:zero_or_more():parse("abab!")
+    assert.are.same(out, { "a", "b", "a", "b" })
+    assert.are.equal(rest, "!")
+    assert.are.equal(calls, 5)
+  end)
+end)
@@ -14,4 +14,22 @@ describe("parser", function()
     assert.are.equal(rest, "defabc")
 
   end)
+
+  it("should match input containing NUL bytes", function()
+    local p = P.literal('a\0b'):pair(P.any_char())
+
+    local out, rest = p:parse('a\0b\0c')
+    assert.are.same(out, { 'a\0b', '\0' })
+    assert.are.equal(rest, 'c')
+  end)
+
+  it("should keep long literals inline", function()
+    local word = string.rep('abcdefgh', 64)
+    local p = P.literal(word)
+
+    local out, rest = p:parse(word .. '!')
+    assert.are.equal(out, word)
+    assert.are.equal(rest, '!')
+    assert.are.equal(P.inspect(P.literal('xy'), 0), 'literal("xy")')
+  end)
 end)
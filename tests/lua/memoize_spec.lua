@@ -0,0 +1,59 @@
+local P = require("parser")
+
+describe("parser", function()
+  it("should reuse a memoized result when backtracking", function()
+    local calls = 0
+    local a = P.literal("a"):map(function(v)
+      calls = calls + 1
+      return v
+    end):memoize()
+
+    local p = a:pair(P.literal("b")):or_else(a:pair(P.literal("c")))
+    local out, rest = p:parse("acd")
+
+    assert.are.same(out, { "a", "c" })
+    assert.are.equal(rest, "d")
+    assert.are.equal(calls, 1)
+  end)
+
+  it("should memoize every parser in packrat mode", function()
+    local calls = 0
+    local a = P.literal("a"):map(function(v)
+      calls = calls + 1
+      return v
+    end)
+
+    local p = a:pair(P.literal("b")):or_else(a:pair(P.literal("c")))
+    local out, rest = p:parse("acd", { memo = true })
+
+    assert.are.same(out, { "a", "c" })
+    assert.are.equal(rest, "d")
+    assert.are.equal(calls, 1)
+
+    calls = 0
+    p:parse("acd")
+    assert.are.equal(calls, 2)
+  end)
+
+  it("should memoize failures", function()
+    local p = P.literal("x"):memoize()
+    local out, rest = p:or_else(p):parse("abc")
+
+    assert.is.falsy(out)
+    assert.are.equal(rest, "abc")
+  end)
+
+  it("should leave the memo table usable after a parse raises", function()
+    local nest
+    nest = P.lazy(function()
+      return P.literal("["):drop_for(nest):take_after(P.literal("]")):or_else(P.literal("."))
+    end)
+    local p = P.literal("x"):memoize():pair(nest):compile()
+
+    assert.has_error(function()
+      p:parse("x" .. string.rep("[", 1200000))
+    end)
+    collectgarbage()
+    assert.are.same(p:parse("x[.]"), { "x", "." })
+  end)
+end)
@@ -0,0 +1,73 @@
+local P = require("parser")
+
+describe("parser", function()
+  it("should match the longest keyword", function()
+    local kw = P.one_of({ "in", "int", "if", "integer" })
+
+    local out, rest = kw:parse("int x")
+    assert.are.equal(out, "int")
+    assert.are.equal(rest, " x")
+
+    out, rest = kw:parse("integers")
+    assert.are.equal(out, "integer")
+    assert.are.equal(rest, "s")
+
+    out, rest = kw:parse("inte")
+    assert.are.equal(out, "int")
+    assert.are.equal(rest, "e")
+
+    out, rest = kw:parse("else")
+    assert.is.falsy(out)
+    assert.are.equal(rest, "else")
+  end)
+
+  it("should match the earliest declared keyword", function()
+    local kw = P.one_of({ "in", "int" }, { longest = false })
+
+    local out, rest = kw:parse("int")
+    assert.are.equal(out, "in")
+    assert.are.equal(rest, "t")
+  end)
+
+  it("should return mapped values", function()
+    local bool = P.one_of({ ["true"] = true, ["false"] = false })
+
+    local out, rest = bool:parse("false,")
+    assert.are.equal(out, false)
+    assert.are.equal(rest, ",")
+
+    out, rest = bool:parse("nil")
+    assert.is.falsy(out)
+    assert.are.equal(rest, "nil")
+  end)
+
+  it("should agree with or_else of literals", function()
+    local words = { "+", "+=", "++", "-", "-=", "->" }
+    local kw = P.one_of(words)
+    local alt = P.literal("++"):or_else(P.literal("+="))
+        :or_else(P.literal("+")):or_else(P.literal("->"))
+        :or_else(P.literal("-=")):or_else(P.literal("-"))
+
+    for _, input in ipairs({ "++a", "+=1", "+a", "->b", "-=", "-", "*" }) do
+      local a, ra = kw:parse(input)
+      local b, rb = alt:parse(input)
+      assert.are.equal(a, b)
+      assert.are.equal(ra, rb)
+    end
+  end)
+
+  it("should run inside compiled grammars", function()
+    local kw = P.one_of({ "let", "fn" })
+    local list = kw:sep_by(P.literal(" ")):compile()
+
+    local out, rest = list:parse("let fn let!")
+    assert.are.same(out, { "let", "fn", "let" })
+    assert.are.equal(rest, "!")
+  end)
+
+  it("should reject bad keyword lists", function()
+    assert.has_error(function() P.one_of({}) end)
+    assert.has_error(function() P.one_of({ "a", 1 }) end)
+    assert.has_error(function() P.one_of({ ["in"] = 1, ["int"] = 2 }, { longest = false }) end)
+  end)
+end)
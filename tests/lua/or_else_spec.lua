@@ -0,0 +1,86 @@
+local P = require("parser")
+
+local function both(p, input)
+  local out, rest = p:parse(input)
+  local cout, crest = p:compile():parse(input)
+
+  assert.are.same(out, cout)
+  assert.are.equal(rest, crest)
+  return out, rest
+end
+
+describe("parser", function()
+  it("should pick the first alternative that matches", function()
+    local p = P.literal("ab")
+        :or_else(P.literal("a"))
+        :or_else(P.take_while("%d", 1))
+        :or_else(P.literal("b"))
+
+    assert.are.same({ both(p, "abc") }, { "ab", "c" })
+    assert.are.same({ both(p, "ac") }, { "a", "c" })
+    assert.are.same({ both(p, "42b") }, { "42", "b" })
+    assert.are.same({ both(p, "b") }, { "b", "" })
+    assert.are.same({ both(p, "x") }, { nil, "x" })
+    assert.are.same({ both(p, "") }, { nil, "" })
+  end)
+
+  it("should still try alternatives that may match nothing", function()
+    local p = P.literal("a")
+        :or_else(P.take_while("%d"))
+        :or_else(P.literal("x"))
+
+    assert.are.same({ both(p, "x") }, { "", "x" })
+    assert.are.same({ both(p, "") }, { "", "" })
+  end)
+
+  it("should look past prefixes that may match nothing", function()
+    local ws = P.take_while("%s")
+    local word = ws:drop_for(P.take_while("%a", 1))
+    local num = ws:drop_for(P.take_while("%d", 1))
+    local p = word:or_else(num)
+
+    assert.are.same({ both(p, "  x") }, { "x", "" })
+    assert.are.same({ both(p, "  7") }, { "7", "" })
+    assert.are.same({ both(p:zero_or_more(), " a 1 b!") }, {
+      { "a", "1", "b" },
+      "!",
+    })
+  end)
+
+  it("should always try alternatives it can't see into", function()
+    local calls = 0
+    local any = P.custom(function(input, pos)
+      calls = calls + 1
+      return input:sub(pos, pos), pos + 1
+    end)
+    local p = P.literal("a"):or_else(any):or_else(P.literal("b"))
+
+    assert.are.same({ both(p, "a") }, { "a", "" })
+    assert.are.equal(calls, 0)
+    assert.are.same({ both(p, "z") }, { "z", "" })
+    assert.are.equal(calls, 2)
+  end)
+
+  it("should fail like the last alternative", function()
+    local ab = P.literal("a"):pair(P.literal("b"))
+    local ac = P.literal("a"):pair(P.literal("c"))
+
+    assert.are.same({ both(ab:or_else(ac), "ax") }, { nil, "x" })
+    assert.are.same({ both(ac:or_else(P.literal("x")), "ay") }, { nil, "ay" })
+  end)
+
+  it("should dispatch inside recursive grammars", function()
+    local value
+    value = P.lazy(function()
+      local list = P.literal("["):drop_for(value:zero_or_more())
+          :take_after(P.literal("]"))
+      return list:or_else(P.take_while("%d", 1)):or_else(P.literal(" ")
+        :drop_for(value))
+    end)
+
+    assert.are.same({ both(value, "[1[ 2 3]]!") }, {
+      { "1", { "2", "3" } },
+      "!",
+    })
+  end)
+end)
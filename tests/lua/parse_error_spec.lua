@@ -0,0 +1,69 @@
+local P = require("parser")
+
+describe("parser", function()
+  it("should report the furthest failure", function()
+    local item = P.take_while("%d", 1)
+    local list = P.literal("["):drop_for(item:sep_by(P.literal(",")))
+        :take_after(P.literal("]"))
+
+    local out, rest, err = list:parse("[1,2,x]")
+    assert.is.falsy(out)
+    assert.are.equal(rest, "[1,2,x]")
+    assert.are.equal(err.pos, 6)
+    assert.are.same(err.expected, { "%d" })
+
+    out, rest, err = list:parse("[1,2;")
+    assert.is.falsy(out)
+    assert.are.equal(err.pos, 5)
+    assert.are.same(err.expected, { '","', '"]"' })
+  end)
+
+  it("should count lines and columns", function()
+    local item = P.take_while("%a", 1):take_after(P.literal(";"))
+        :take_after(P.take_while("%s"))
+    local lines = item:zero_or_more():take_after(P.literal("end"))
+
+    local _, _, err = lines:parse("a;\nbb;\ncc!")
+    assert.are.equal(err.pos, 10)
+    assert.are.equal(err.line, 3)
+    assert.are.equal(err.column, 3)
+    assert.are.equal(tostring(err), 'line 3, column 3: expected ";"')
+  end)
+
+  it("should name labeled parsers", function()
+    local num = P.take_while("%d", 1):label("number")
+    local word = P.take_while("%a", 1):label("word")
+    local value = num:or_else(word)
+
+    local _, _, err = value:parse("!")
+    assert.are.same(err.expected, { "number", "word" })
+    assert.are.equal(tostring(err), "line 1, column 1: expected number or word")
+  end)
+
+  it("should include alternatives skipped by dispatch", function()
+    local kw = P.literal("true"):or_else(P.literal("false"))
+        :or_else(P.literal("null"))
+
+    local _, _, err = kw:parse("x")
+    assert.are.same(err.expected, { '"true"', '"false"', '"null"' })
+
+    local _, _, cerr = kw:compile():parse("x")
+    assert.are.same(cerr.expected, err.expected)
+  end)
+
+  it("should report the same errors when compiled", function()
+    local item = P.take_while("%d", 1)
+    local list = P.literal("["):drop_for(item:sep_by(P.literal(",")))
+        :take_after(P.literal("]"))
+
+    local _, _, err = list:parse("[1,2;")
+    local _, _, cerr = list:compile():parse("[1,2;")
+    assert.are.equal(cerr.pos, err.pos)
+    assert.are.same(cerr.expected, err.expected)
+  end)
+
+  it("should prefer inspect names", function()
+    local _, _, err = P.digit():parse("a")
+    assert.are.same(err.expected, { "digit" })
+  end)
+end)
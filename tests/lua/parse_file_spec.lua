@@ -0,0 +1,56 @@
+local P = require("parser")
+
+local function with_file(contents, fn)
+  local path = os.tmpname()
+  local f = assert(io.open(path, "wb"))
+  f:write(contents)
+  f:close()
+
+  local ok, err = pcall(fn, path)
+  os.remove(path)
+  assert(ok, err)
+end
+
+describe("parser", function()
+  it("should parse a file in place", function()
+    local line = P.take_until("\n"):take_after(P.literal("\n"))
+
+    with_file("one\ntwo\nthree", function(path)
+      local out, rest = P.parse_file(line:zero_or_more(), path)
+      assert.are.same(out, { "one", "two" })
+      assert.are.equal(rest, 9)
+
+      out, rest = P.parse_file(P.literal("two"), path)
+      assert.is.falsy(out)
+      assert.are.equal(rest, 1)
+    end)
+  end)
+
+  it("should handle empty files and embedded NULs", function()
+    with_file("", function(path)
+      assert.are.same({ P.parse_file(P.take_while("%a"), path) }, { "", 1 })
+    end)
+
+    with_file("a\0b", function(path)
+      local out = P.parse_file(P.any_char():one_or_more():compile(), path)
+      assert.are.same(out, { "a", "\0", "b" })
+    end)
+  end)
+
+  it("should hand custom parsers the file contents", function()
+    local p = P.custom(function(input, pos)
+      return #input, pos + 2
+    end)
+
+    with_file("abcd", function(path)
+      assert.are.same({ P.parse_file(p, path) }, { 4, 3 })
+    end)
+  end)
+
+  it("should raise on files it can't open", function()
+    local ok, err = pcall(P.parse_file, P.literal("a"), "/nonexistent/x")
+
+    assert.is.falsy(ok)
+    assert.is.truthy(err:find("cannot open /nonexistent/x", 1, true))
+  end)
+end)
@@ -0,0 +1,82 @@
+local P = require("parser")
+
+describe("parser", function()
+  local num = P.char_class("%d"):many1_concat()
+  local pair = num:take_after(P.literal("=")):pair(P.take_while("%a", 1))
+
+  local function lines(n)
+    local out = {}
+    for i = 1, n do
+      out[i] = i .. "=" .. string.rep("k", i % 7 + 1)
+    end
+    return table.concat(out, "\n") .. "\n"
+  end
+
+  it("should return outputs in record order", function()
+    local outs, errs = P.parse_records(pair, "1=a\n22=bb\n3=c", { threads = 2 })
+    assert.are.same(outs, { { "1", "a" }, { "22", "bb" }, { "3", "c" } })
+    assert.are.same(errs, {})
+  end)
+
+  it("should parse the same on any number of threads", function()
+    local input = lines(1000)
+    local one = P.parse_records(pair, input, { threads = 1 })
+    local many = P.parse_records(pair, input, { threads = 4 })
+    assert.are.equal(#one, 1000)
+    assert.are.same(one, many)
+    assert.are.same(many[1000], { "1000", string.rep("k", 1000 % 7 + 1) })
+  end)
+
+  it("should report failed records in their slot", function()
+    local input = lines(200):gsub("150=", "150:")
+    local outs, errs = P.parse_records(pair, input, { threads = 3 })
+    assert.are.equal(outs[150], false)
+    assert.are.same(outs[151], { "151", string.rep("k", 151 % 7 + 1) })
+    assert.are.same(errs[150].expected, { '"="' })
+    assert.are.equal(errs[150].column, 4)
+    assert.is.falsy(errs[149])
+  end)
+
+  it("should fail records that are not consumed whole", function()
+    local outs, errs = P.parse_records(num, "12\n7x\n3\n")
+    assert.are.same(outs, { "12", false, "3" })
+    assert.are.equal(errs[2].pos, 2)
+  end)
+
+  it("should take a separator and frozen grammars", function()
+    local outs = P.parse_records(num:freeze(), "1;2;;3", { sep = ";", threads = 2 })
+    assert.are.same(outs, { "1", "2", false, "3" })
+  end)
+
+  it("should parse grammars with callbacks on the calling thread", function()
+    local double = num:map(function(s)
+      return tonumber(s) * 2
+    end)
+    local outs = P.parse_records(double, "1\n2\n3", { threads = 4 })
+    assert.are.same(outs, { 2, 4, 6 })
+  end)
+
+  it("should raise what a record raises on any number of threads", function()
+    local nested
+    nested = P.lazy(function()
+      return P.literal("("):drop_for(nested:or_else(P.literal("x"))):take_after(P.literal(")"))
+    end)
+    local frozen = nested:freeze()
+    local input = string.rep("(x)\n", 200) .. string.rep("(", 1200000) .. "\n(x)\n"
+
+    for _, threads in ipairs({ 1, 4 }) do
+      assert.has_error(function()
+        P.parse_records(frozen, input, { threads = threads })
+      end, "parser nesting too deep")
+    end
+  end)
+
+  it("should reject fewer than one thread", function()
+    assert.has_error(function()
+      P.parse_records(num, "1\n2", { threads = 0 })
+    end)
+    assert.has_error(function()
+      P.parse_records(num, "1\n2", { threads = -1 })
+    end)
+  end)
+end)
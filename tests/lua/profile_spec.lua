@@ -0,0 +1,70 @@
+local P = require("parser")
+
+describe("parser", function()
+  it("should count calls and outcomes per label", function()
+    local digit = P.set_inspect(P.char_class("%d"), "digit")
+    local report, out, rest = P.profile(digit:one_or_more(), "123x")
+
+    assert.are.same(out, { "1", "2", "3" })
+    assert.are.equal(rest, "x")
+
+    local row = report.digit
+    assert.are.equal(row.calls, 4)
+    assert.are.equal(row.ok, 3)
+    assert.are.equal(row.fail, 1)
+    assert.are.equal(row.bytes, 3)
+    assert.are.equal(row.backtracks, 1)
+    assert.is_true(row.time >= row.self)
+  end)
+
+  it("should add up nodes sharing a label", function()
+    local a = P.set_inspect(P.literal("a"), "letter")
+    local b = P.set_inspect(P.literal("b"), "letter")
+    local report = P.profile(a:pair(b), "ab")
+
+    assert.are.equal(report.letter.calls, 2)
+    assert.are.equal(report.letter.bytes, 2)
+  end)
+
+  it("should show the branches of a choice", function()
+    local kw = P.set_inspect(P.literal("let"), "let")
+    local id = P.set_inspect(P.take_while("%a", 1), "ident")
+    local p = P.set_inspect(kw:or_else(id), "word")
+
+    local report, out = P.profile(p, "lex")
+    assert.are.equal(out, "lex")
+    assert.are.equal(report.word.calls, 1)
+    assert.are.equal(report.let.backtracks, 1)
+    assert.are.equal(report.ident.ok, 1)
+  end)
+
+  it("should profile compiled parsers through their source", function()
+    local digit = P.set_inspect(P.char_class("%d"), "digit")
+    local report, out = P.profile(digit:zero_or_more():compile(), "12")
+
+    assert.are.same(out, { "1", "2" })
+    assert.are.equal(report.digit.calls, 3)
+  end)
+
+  it("should report failed parses", function()
+    local report, out, rest = P.profile(P.literal("a"), "b")
+    assert.is.falsy(out)
+    assert.are.equal(rest, "b")
+    assert.are.equal(report["literal#1"].fail, 1)
+  end)
+
+  it("should raise what the parse raises and profile again after", function()
+    local nest
+    nest = P.lazy(function()
+      return P.literal("["):drop_for(nest):take_after(P.literal("]")):or_else(P.literal("."))
+    end)
+    local p = nest:compile()
+
+    assert.has_error(function()
+      P.profile(p, string.rep("[", 1200000))
+    end)
+    collectgarbage()
+    local _, out = P.profile(p, "[.]")
+    assert.are.equal(out, ".")
+  end)
+end)
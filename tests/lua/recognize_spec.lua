@@ -0,0 +1,57 @@
+local P = require("parser")
+
+describe("parser", function()
+  it("should return the consumed input of repetitions", function()
+    local vowel = P.any_char():pred(function(c)
+      return c:find("[aeiou]") ~= nil
+    end)
+
+    local out, rest = vowel:many_concat():parse("aeix")
+    assert.are.equal(out, "aei")
+    assert.are.equal(rest, "x")
+
+    out, rest = vowel:many_concat():parse("xa")
+    assert.are.equal(out, "")
+    assert.are.equal(rest, "xa")
+
+    out, rest = vowel:many1_concat():parse("xa")
+    assert.is.falsy(out)
+    assert.are.equal(rest, "xa")
+  end)
+
+  it("should return the input a parser consumed", function()
+    local num = P.literal("-"):or_else(P.pure(""))
+        :pair(P.take_while("%d", 1))
+        :recognize()
+
+    local out, rest = num:parse("-12;")
+    assert.are.equal(out, "-12")
+    assert.are.equal(rest, ";")
+
+    out, rest = num:parse("-;")
+    assert.is.falsy(out)
+    assert.are.equal(rest, "-;")
+  end)
+
+  it("should compile span combinators", function()
+    local digit = P.char_class("%d")
+    local cases = {
+      { digit:many_concat(), "123a" },
+      { digit:many_concat(), "a" },
+      { digit:many1_concat(), "a" },
+      { digit:many1_concat(), "9" },
+      { P.take_while("%a"):many_concat(), "ab1" },
+      { digit:pair(P.literal(".")):recognize(), "1.5" },
+      { digit:pair(P.literal(".")):recognize(), "15" },
+    }
+
+    for _, case in ipairs(cases) do
+      local p, input = case[1], case[2]
+      local out, rest = p:parse(input)
+      local cout, crest = p:compile():parse(input)
+
+      assert.are.same(out, cout)
+      assert.are.equal(rest, crest)
+    end
+  end)
+end)
@@ -0,0 +1,78 @@
+local P = require("parser")
+
+local num = P.take_while("%d", 1)
+local comma = P.literal(",")
+
+describe("parser", function()
+  it("should collect separated items into one table", function()
+    local p = num:sep_by(comma)
+
+    local out, rest = p:parse("1,22,333;")
+    assert.are.same(out, { "1", "22", "333" })
+    assert.are.equal(rest, ";")
+
+    out, rest = p:parse("x")
+    assert.are.same(out, {})
+    assert.are.equal(rest, "x")
+  end)
+
+  it("should leave a trailing separator unparsed", function()
+    local out, rest = num:sep_by(comma):parse("1,2,")
+    assert.are.same(out, { "1", "2" })
+    assert.are.equal(rest, ",")
+  end)
+
+  it("should require one item with sep_by1", function()
+    local p = num:sep_by1(comma)
+
+    assert.are.same(p:parse("7"), { "7" })
+
+    local out, rest = p:parse(",7")
+    assert.is.falsy(out)
+    assert.are.equal(rest, ",7")
+  end)
+
+  it("should collect items until the end matches", function()
+    local p = P.any_char():many_till(P.literal("-->"))
+
+    local out, rest = p:parse("ab-->c")
+    assert.are.same(out, { "a", "b" })
+    assert.are.equal(rest, "c")
+
+    assert.are.same(p:parse("-->"), {})
+
+    out, rest = p:parse("abc")
+    assert.is.falsy(out)
+    assert.are.equal(rest, "abc")
+  end)
+
+  it("should parse between delimiters", function()
+    local list = P.between(P.literal("["), num:sep_by(comma), P.literal("]"))
+
+    local out, rest = list:parse("[1,2]!")
+    assert.are.same(out, { "1", "2" })
+    assert.are.equal(rest, "!")
+  end)
+
+  it("should compile list combinators", function()
+    local item = num:map(tonumber)
+    local cases = {
+      { item:sep_by(comma), "1,2,3,x" },
+      { item:sep_by(comma), "x" },
+      { item:sep_by1(comma), "x" },
+      { item:sep_by(comma):sep_by(P.literal(";")), "1,2;3;,4" },
+      { P.any_char():many_till(P.literal(".")), "ab.c" },
+      { P.any_char():many_till(P.literal(".")), "abc" },
+      { P.take_while("%a"):many_till(P.literal(".")), "ab1." },
+    }
+
+    for _, case in ipairs(cases) do
+      local p, input = case[1], case[2]
+      local out, rest = p:parse(input)
+      local cout, crest = p:compile():parse(input)
+
+      assert.are.same(out, cout)
+      assert.are.equal(rest, crest)
+    end
+  end)
+end)
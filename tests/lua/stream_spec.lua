@@ -0,0 +1,84 @@
+local P = require("parser")
+
+-- a reader handing out s in pieces of at most n bytes
+local function pieces(s, n)
+  local at = 1
+  return function()
+    if at > #s then
+      return nil
+    end
+    local piece = s:sub(at, at + n - 1)
+    at = at + n
+    return piece
+  end
+end
+
+local function collect(iter)
+  local out, offsets = {}, {}
+  for at, v in iter do
+    offsets[#offsets + 1] = at
+    out[#out + 1] = v
+  end
+  return out, offsets
+end
+
+describe("parser", function()
+  it("should stream one result per match", function()
+    local line = P.take_until("\n"):take_after(P.literal("\n"))
+    local input = "alpha\nbeta\n\ngamma delta\n"
+
+    for _, n in ipairs({ 1, 2, 3, 7, 64 }) do
+      local out, offsets = collect(P.stream(line, pieces(input, n)))
+      assert.are.same(out, { "alpha", "beta", "", "gamma delta" })
+      assert.are.same(offsets, { 1, 7, 12, 13 })
+    end
+  end)
+
+  it("should wait for more input before deciding", function()
+    local word = P.take_while("%a", 1):take_after(P.take_while(" "))
+    local kw = P.literal("let"):or_else(word)
+    local p = kw:compile()
+
+    for _, n in ipairs({ 1, 2, 5 }) do
+      assert.are.same(collect(P.stream(word, pieces("let letter go", n))),
+        { "let", "letter", "go" })
+      assert.are.same(collect(P.stream(p, pieces("letter", n))),
+        { "let", "ter" })
+    end
+  end)
+
+  it("should stream recursive and repeated parsers", function()
+    local list
+    list = P.lazy(function()
+      return P.literal("["):drop_for(list:or_else(P.take_while("%d", 1))
+        :zero_or_more()):take_after(P.literal("]"))
+    end)
+
+    local input = "[1[2]][][[3]4]"
+    for _, p in ipairs({ list, list:compile() }) do
+      assert.are.same(collect(P.stream(p, pieces(input, 2))), {
+        { "1", { "2" } },
+        {},
+        { { "3" }, "4" },
+      })
+    end
+  end)
+
+  it("should read from files", function()
+    local f = io.tmpfile()
+    f:write("1,22,333,")
+    f:seek("set")
+
+    local num = P.take_while("%d", 1):take_after(P.literal(","))
+    assert.are.same(collect(P.stream(num, f, { chunk = 2 })),
+      { "1", "22", "333" })
+    f:close()
+  end)
+
+  it("should raise on input no match accepts", function()
+    local ok, err = pcall(collect, P.stream(P.literal("a"), pieces("aab", 1)))
+
+    assert.is.falsy(ok)
+    assert.is.truthy(err:find("no match at byte 3", 1, true))
+  end)
+end)
@@ -0,0 +1,54 @@
+local P = require("parser")
+
+describe("parser", function()
+  it("should take until a mark", function()
+    local out, rest = P.take_until("--"):parse("key value -- comment")
+    assert.are.equal(out, "key value ")
+    assert.are.equal(rest, "-- comment")
+
+    out, rest = P.take_until("--", true):parse("key value -- comment")
+    assert.are.equal(out, "key value --")
+    assert.are.equal(rest, " comment")
+
+    out, rest = P.take_until("--"):parse("no mark here")
+    assert.is.falsy(out)
+    assert.are.equal(rest, "no mark here")
+  end)
+
+  it("should agree with string.find on long inputs", function()
+    for _, mark in ipairs({ "x", "<>", "END", "abcdefgh" }) do
+      local p = P.take_until(mark)
+      for len = 0, 80 do
+        local input = string.rep("a", len) .. mark .. string.rep("b", 40)
+        local out, rest = p:parse(input)
+        local at = input:find(mark, 1, true)
+
+        assert.are.equal(out, input:sub(1, at - 1))
+        assert.are.equal(rest, input:sub(at))
+      end
+    end
+  end)
+
+  it("should agree with Lua patterns when scanning a class", function()
+    local classes = { "%s", "%d", "[%w_]", '[^"]', "[%a%d%p]" }
+    local alphabet = ' \t\n"_aZ09.,-'
+
+    math.randomseed(42)
+    for _, class in ipairs(classes) do
+      local p = P.take_while(class)
+      for _ = 1, 100 do
+        local chars = {}
+        for i = 1, math.random(0, 100) do
+          local k = math.random(1, #alphabet)
+          chars[i] = alphabet:sub(k, k)
+        end
+        local input = table.concat(chars)
+        local expected = input:match("^" .. class .. "*")
+
+        local out, rest = p:parse(input)
+        assert.are.equal(out, expected)
+        assert.are.equal(rest, input:sub(#expected + 1))
+      end
+    end
+  end)
+end)
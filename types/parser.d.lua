@@ -15,14 +15,17 @@ function M.any_char() end
 
 --- Lazily evaluates a parser.
 --- Useful for defining mutually recursive parsers.
+--- The function runs on first use and the parser it returns is reused from
+--- then on. Pass `{ once = false }` to run it on every parse instead.
 ---
 --- **Implemented in:** C
 --- @example
 --- local p
 --- p = parser.lazy(function() return parser.literal("a") or p end)
 ---@param parser_f fun(): Parser A function returning a parser.
+---@param opts { once: boolean? }?
 ---@return Parser
-function M.lazy(parser_f) end
+function M.lazy(parser_f, opts) end
 
 --- Parses a given literal string.
 ---
@@ -34,6 +37,318 @@ function M.lazy(parser_f) end
 ---@return Parser
 function M.literal(s) end
 
+--- Builds a parser from a Lua function.
+--- The function receives the whole input and the 1-based position to parse
+--- from, and returns the parsed value and the position after it. Returning
+--- no position fails the parse. The input is never copied.
+---
+--- **Implemented in:** C
+--- @example
+--- local word = parser.custom(function(input, pos)
+---   local s, e = input:find("^%a+", pos)
+---   if not s then return nil end
+---   return input:sub(s, e), e + 1
+--- end)
+--- print(word:parse("hello world"))  -- → "hello", " world"
+---@param f fun(input: string, pos: integer): any, integer?
+---@return Parser
+function M.custom(f) end
+
+--- Parses a single byte that belongs to a character class.
+--- The class uses Lua pattern syntax: a single item such as `"%d"` or `"x"`,
+--- or a bracketed set such as `"[%w_]"` or `"[^\"]"`. It is compiled once into
+--- a 256-bit byte set.
+---
+--- **Implemented in:** C
+--- @example
+--- local p = parser.char_class("[%a_]")
+--- print(p:parse("_x1"))  -- → "_", "x1"
+---@param class string
+---@return Parser
+function M.char_class(class) end
+
+--- Consumes the longest run of bytes in a character class and returns it as
+--- a single string. Fails if fewer than `min` bytes match.
+---
+--- **Implemented in:** C
+--- @example
+--- local p = parser.take_while("%d", 1)
+--- print(p:parse("123abc"))  -- → "123", "abc"
+---@param class string A character class, see `char_class`.
+---@param min integer? Fewest bytes to accept, defaults to 0.
+---@return Parser
+function M.take_while(class, min) end
+
+--- Consumes everything before the first occurrence of `mark` and returns it
+--- as one string. With `inclusive`, the mark is consumed and returned too.
+--- Fails if `mark` does not occur in the rest of the input.
+---
+--- **Implemented in:** C
+--- @example
+--- local p = parser.take_until("--")
+--- print(p:parse("key value -- comment"))  -- → "key value ", "-- comment"
+---@param mark string
+---@param inclusive boolean?
+---@return Parser
+function M.take_until(mark, inclusive) end
+
+---@class StreamOpts
+---@field chunk integer? bytes to ask the reader for at a time, defaults to 65536
+
+--- Parses a stream one top-level match at a time. `source` is a function
+--- returning the next chunk of input (or `nil` at the end), or a file handle.
+--- Only the input not matched yet is kept in memory; a match that runs into
+--- the end of what has been read so far is retried once more input arrives.
+--- Custom parsers only see the buffered input. Raises an error if the input
+--- left over does not match.
+---
+--- **Implemented in:** C
+--- @example
+--- local line = parser.take_until("\n"):take_after(parser.literal("\n"))
+--- for offset, text in parser.stream(line, io.open("log.txt")) do
+---   print(offset, text)
+--- end
+---@param p Parser
+---@param source (fun(size: integer): string?) | file*
+---@param opts StreamOpts?
+---@return fun(): integer?, any iterator over the byte offset and output of each match
+function M.stream(p, source, opts) end
+
+--- Parses a whole file without reading it into a Lua string first: the file
+--- is mapped into memory read-only and parsed in place, so only the outputs
+--- the grammar builds are allocated. Returns the output (or `nil`) and the
+--- 1-based position where the unparsed rest of the file starts. Raises an
+--- error if the file can't be opened.
+---
+--- **Implemented in:** C
+--- @example
+--- local line = parser.take_until("\n", true)
+--- local lines, rest = parser.parse_file(line:zero_or_more(), "log.txt")
+---@param p Parser
+---@param path string
+---@param opts ParseOpts?
+---@return any, integer
+function M.parse_file(p, path, opts) end
+
+---@alias ExprOps Parser | string | (Parser | string)[]
+
+---@class ExprSpec
+---@field atom Parser operand parser, parentheses usually go in here
+---@field infix { [1]: ExprOps, [2]: "left" | "right", [3]: integer }[]?
+---@field prefix { [1]: ExprOps, [2]: integer }[]?
+---@field postfix { [1]: ExprOps, [2]: integer }[]?
+---@field fold (fun(lhs: any, op: any, rhs: any): any)?
+
+--- Parses operator expressions by precedence climbing in C. Each row of
+--- `infix` is `{ ops, assoc, prec }`, each row of `prefix` and `postfix`
+--- is `{ ops, prec }`; the named fields `ops`, `assoc` and `prec` work too.
+--- `ops` is a parser, a literal string or a list of them. Higher `prec`
+--- binds tighter. Every operator application calls `fold(lhs, op, rhs)`
+--- once, with `lhs` nil for prefix and `rhs` nil for postfix operators.
+--- Without `fold` it builds `{ lhs, op, rhs }` tables. An operator with no
+--- operand after it is left unparsed. Compiled grammars run it as is.
+---
+--- **Implemented in:** C
+--- @example
+--- local num = parser.take_while("%d", 1):map(tonumber)
+--- local calc = parser.expr{
+---   atom = num,
+---   prefix = { { "-", 3 } },
+---   infix = { { { "+", "-" }, "left", 1 }, { "*", "left", 2 }, { "^", "right", 4 } },
+---   fold = function(a, op, b)
+---     if op == "+" then return a + b end
+---     if op == "-" then return a and a - b or -b end
+---     if op == "*" then return a * b end
+---     return a ^ b
+---   end,
+--- }
+--- print(calc:parse("1+2*3"))  -- → 7, ""
+---@param spec ExprSpec
+---@return Parser
+function M.expr(spec) end
+
+--- Matches one of a set of keywords in a single pass over the input, using
+--- a byte trie built in C. `words` is a list of strings, in which case the
+--- matched keyword is returned, or a table mapping each keyword to the
+--- value to return for it. By default the longest keyword wins; with
+--- `{ longest = false }` the earliest keyword in the list that matches
+--- wins. A map has no order, so it only takes the default.
+---
+--- **Implemented in:** C
+--- @example
+--- local kw = parser.one_of({ "in", "int", "if" })
+--- print(kw:parse("int x"))  -- → "int", " x"
+--- local bool = parser.one_of({ ["true"] = true, ["false"] = false })
+--- print(bool:parse("false"))  -- → false, ""
+---@param words string[] | table<string, any>
+---@param opts { longest: boolean? }?
+---@return Parser
+function M.one_of(words, opts) end
+
+---@class ProfileRow
+---@field calls integer
+---@field ok integer
+---@field fail integer
+---@field bytes integer consumed by the successful calls
+---@field backtracks integer failures an enclosing choice went on from
+---@field time number seconds, nested calls included
+---@field self number seconds, nested calls excluded
+
+--- Parses `input` like `p:parse` while counting, for every node that runs,
+--- its calls, outcomes, bytes consumed, backtracks and time. Rows are keyed
+--- by the label given with `set_inspect`; nodes sharing a label are added
+--- up, the others are listed as `kind#n`. Compiled parsers are profiled
+--- through their source, in the tree interpreter.
+---
+--- **Implemented in:** C
+--- @example
+--- local digit = parser.set_inspect(parser.char_class("%d"), "digit")
+--- local report, out, rest = parser.profile(digit:one_or_more(), "123x")
+--- print(report.digit.calls, report.digit.backtracks)  -- → 4, 1
+---@param p Parser
+---@param input string
+---@param opts ParseOpts?
+---@return table<string, ProfileRow>, any, string
+function M.profile(p, input, opts) end
+
+---@class RecordOpts
+---@field sep string? the byte records end with, `"\n"` by default
+---@field threads integer? how many threads parse, at least 1, one per core by default
+
+--- Splits `input` at every `sep` and parses each record on its own, spread
+--- over a pool of threads. A record has to be consumed whole. Outputs come
+--- back in input order; a record that failed holds `false` and its
+--- ParseError, with positions counted from the record's start, is in the
+--- second table under the same index. An empty record after the last
+--- separator is not counted.
+---
+--- The grammar is frozen (see `Parser:freeze`) to run on the workers, which
+--- pass their outputs back to be rebuilt as values on the calling state.
+--- Grammars that cannot be frozen are parsed on the calling thread. An error
+--- a record raises is raised here once the workers are done, the first in
+--- record order, as a parse on one thread would.
+---
+--- **Implemented in:** C
+--- @example
+--- local num = parser.char_class("%d"):many1_concat()
+--- local outs, errs = parser.parse_records(num, "12\n7x\n3\n", { threads = 4 })
+--- print(outs[1], outs[2], outs[3])  -- → "12", false, "3"
+--- print(tostring(errs[2]))  -- → line 1, column 2: expected %d
+---@param p Parser | ParserFrozen
+---@param input string
+---@param opts RecordOpts?
+---@return (table | string | false)[], table<integer, ParseError>
+function M.parse_records(p, input, opts) end
+
+---@class ParserFrozen
+M.ParserFrozen = {}
+
+--- Loads a grammar written by `Parser:dump`, binding its callbacks by name
+--- from `callbacks`. The program runs from a single copy of `bytes`, nothing
+--- is built per node. A grammar with callbacks belongs to this state and
+--- cannot be shared. The program is checked before it runs, a truncated,
+--- corrupt or foreign dump raises an error.
+---
+--- **Implemented in:** C
+---@param bytes string
+---@param callbacks table<string, function>?
+---@return ParserFrozen
+function M.load(bytes, callbacks) end
+
+--- Like `parser.load`, but maps the file and runs the program from the
+--- mapping.
+---
+--- **Implemented in:** C
+---@param path string
+---@param callbacks table<string, function>?
+---@return ParserFrozen
+function M.load_file(path, callbacks) end
+
+--- Wraps a token from `frozen:share()`, in this or any other Lua state and
+--- on any thread. Each token must be adopted exactly once; the grammar is
+--- freed when the last wrapper is collected. A token that is never adopted
+--- keeps its grammar alive, adopt it and drop the result to let it go.
+--- Adopting a token twice, or anything that is not a token, raises an error.
+---
+--- **Implemented in:** C
+--- @example
+--- local token = parser.literal("hi"):freeze():share()
+--- -- in another worker
+--- local p = parser.adopt(token)
+--- print(p:parse("hi!"))  -- → "hi", "!"
+---@param token lightuserdata
+---@return ParserFrozen
+function M.adopt(token) end
+
+--- Parses like `Parser:parse`. Runs are independent, so the same frozen
+--- grammar may parse on several threads at once.
+---
+--- **Implemented in:** C
+---@param self ParserFrozen
+---@param input string
+---@return table | string | nil, string, ParseError?
+function M.ParserFrozen:parse(input) end
+
+--- Returns a token holding a new reference, for `parser.adopt`.
+---
+--- **Implemented in:** C
+---@param self ParserFrozen
+---@return lightuserdata
+function M.ParserFrozen:share() end
+
+---@class ParserArena
+M.ParserArena = {}
+
+--- Creates a grammar arena. Parsers built inside `arena:run(fn)` are
+--- allocated together in large blocks and share a single refcount, so
+--- building a grammar with thousands of nodes costs a few allocations and
+--- the whole grammar is freed at once after `arena:close()`.
+---
+--- **Implemented in:** C
+--- @example
+--- local arena = parser.arena()
+--- local kv = arena:run(function()
+---   return parser.take_while("%a", 1):take_after(parser.literal("="))
+---     :pair(parser.take_while("%w"))
+--- end)
+--- print(kv:parse("a=1"))  -- → {"a", "1"}, ""
+--- arena:close()
+---@return ParserArena
+function M.arena() end
+
+--- Creates an arena and runs `fn` inside it, see `parser.arena`.
+---
+--- **Implemented in:** C
+--- @example
+--- local arena, p = parser.with_arena(function() return parser.literal("a") end)
+---@param fn fun(...): ...
+---@return ParserArena, ...
+function M.with_arena(fn, ...) end
+
+--- Calls `fn` with the given arguments, allocating every parser it builds in
+--- the arena, and returns its results. Runs nest.
+---
+--- **Implemented in:** C
+---@param self ParserArena
+---@param fn fun(...): ...
+---@return ...
+function M.ParserArena:run(fn, ...) end
+
+--- Detaches every parser built in the arena from Lua, using one afterwards
+--- raises an error. The memory goes back once no parser built outside the
+--- arena still holds one of its nodes.
+---
+--- **Implemented in:** C
+---@param self ParserArena
+function M.ParserArena:close() end
+
+--- Returns the number of nodes and bytes allocated in the arena.
+---
+--- **Implemented in:** C
+---@param self ParserArena
+---@return { nodes: integer, bytes: integer }
+function M.ParserArena:stats() end
+
 --- Returns a string representation of the parser’s parse tree.
 ---
 --- **Implemented in:** C
@@ -60,7 +375,7 @@ function M.set_inspect(parser, inspect_str) end
 
 --- Consumes a single whitespace character.
 ---
---- **Implemented in:** Lua
+--- **Implemented in:** C
 --- @example
 --- local p = parser.whitespace_char()
 --- print(p:parse(" abc"))  -- → " ", "abc"
@@ -69,7 +384,7 @@ function M.whitespace_char() end
 
 --- Consumes one or more whitespace characters.
 ---
---- **Implemented in:** Lua
+--- **Implemented in:** C
 --- @example
 --- local p = parser.space1()
 --- print(p:parse("   xyz"))  -- → "   ", "xyz"
@@ -78,13 +393,22 @@ function M.space1() end
 
 --- Consumes zero or more whitespace characters.
 ---
---- **Implemented in:** Lua
+--- **Implemented in:** C
 --- @example
 --- local p = parser.space0()
 --- print(p:parse("  hi"))   -- → "  ", "hi"
 ---@return Parser
 function M.space0() end
 
+--- Consumes a single decimal digit.
+---
+--- **Implemented in:** C
+--- @example
+--- local p = parser.digit()
+--- print(p:parse("42"))   -- → "4", "2"
+---@return Parser
+function M.digit() end
+
 --- Parses a quoted string (e.g. `"hello"`) and returns the unquoted value (e.g. `hello`).
 ---
 --- **Implemented in:** Lua
@@ -104,6 +428,25 @@ function M.quoted_string() end
 ---@return Parser
 function M.identifier() end
 
+--- Parses `open`, then `p`, then `close`, and returns the result of `p`.
+---
+--- **Implemented in:** Lua
+--- @example
+--- local p = parser.between(parser.literal("("), parser.digit(), parser.literal(")"))
+--- print(p:parse("(4)!"))  -- → "4", "!"
+---@param open Parser
+---@param p Parser
+---@param close Parser
+---@return Parser
+function M.between(open, p, close) end
+
+--- Same as `p:cut()`.
+---
+--- **Implemented in:** Lua
+---@param p Parser
+---@return Parser
+function M.commit(p) end
+
 ---The identity function, lifts normal strings to Parser world.
 ---
 ---**Implemented in:** Lua
@@ -151,6 +494,61 @@ function M.Parser:one_or_more() end
 ---@return Parser
 function M.Parser:zero_or_more() end
 
+--- Runs the parser zero or more times and returns the input it consumed as
+--- one string instead of a table of results.
+---
+--- **Implemented in:** C
+--- @example
+--- local hex = parser.char_class("[%x]")
+--- print(hex:many_concat():parse("ff0z"))  -- → "ff0", "z"
+---@param self Parser
+---@return Parser
+function M.Parser:many_concat() end
+
+--- Like `many_concat`, but fails unless the parser matches at least once.
+---
+--- **Implemented in:** C
+---@param self Parser
+---@return Parser
+function M.Parser:many1_concat() end
+
+--- Returns the slice of input the parser consumed instead of its result.
+---
+--- **Implemented in:** C
+--- @example
+--- local p = parser.literal("-"):pair(parser.digit()):recognize()
+--- print(p:parse("-4x"))  -- → "-4", "x"
+---@param self Parser
+---@return Parser
+function M.Parser:recognize() end
+
+--- Names what the parser expects in parse errors. When it fails where it
+--- started, `name` replaces whatever its own parsers expected there.
+---
+--- **Implemented in:** C
+--- @example
+--- local num = parser.take_while("%d", 1):label("number")
+--- local _, _, err = num:parse("x")
+--- print(err.expected[1])  -- → "number"
+---@param self Parser
+---@param name string
+---@return Parser
+function M.Parser:label(name) end
+
+--- Commits to the way the parse went once `self` succeeds. A later failure
+--- is not caught by any enclosing `or_else`, repetition or `sep_by`, it
+--- fails the whole parse right away instead of retrying alternatives. With
+--- `{ memo = true }` the memo entries before the cut are dropped.
+---
+--- **Implemented in:** C
+--- @example
+--- local obj = parser.literal("{"):cut():drop_for(parser.digit()):take_after(parser.literal("}"))
+--- local value = obj:or_else(parser.literal("{x"))
+--- print(value:parse("{x"))  -- → nil, "{x"  (the "{x" alternative is never tried)
+---@param self Parser
+---@return Parser
+function M.Parser:cut() end
+
 --- Parses the input using `self`.
 --- If successful, discards the result, then parses the remaining input with `taken`,
 --- returning the result of `taken`.
@@ -210,6 +608,9 @@ function M.Parser:and_then(f) end
 
 --- Attempts to parse using `self`.
 --- If it fails, tries the alternative parser `alt`.
+--- A chain of `or_else` calls looks at the next byte first and only tries the
+--- alternatives that can start with it; `custom`, `and_then` results and
+--- parsers that may match nothing are always tried.
 ---
 --- **Implemented in:** C
 --- @example
@@ -246,16 +647,127 @@ function M.Parser:pred(f) end
 ---@return Parser
 function M.Parser:pair(p) end
 
---- Executes the parser on the given input string.
+--- Parses zero or more `self` separated by `sep` and returns the items in
+--- one table, built directly in C. A trailing separator is left unparsed.
+---
+--- **Implemented in:** C
+--- @example
+--- local num = parser.take_while("%d", 1)
+--- print(num:sep_by(parser.literal(",")):parse("1,2,3,"))  -- → {"1", "2", "3"}, ","
+---@param self Parser
+---@param sep Parser
+---@return Parser
+function M.Parser:sep_by(sep) end
+
+--- Like `sep_by`, but fails unless there is at least one item.
+---
+--- **Implemented in:** C
+---@param self Parser
+---@param sep Parser
+---@return Parser
+function M.Parser:sep_by1(sep) end
+
+--- Parses `self` repeatedly until `end_p` matches and returns the results of
+--- `self` in one table. The value of `end_p` is dropped. Fails if neither
+--- matches before the end is found.
+---
+--- **Implemented in:** C
+--- @example
+--- local p = parser.any_char():many_till(parser.literal("-->"))
+--- print(p:parse("ab-->c"))  -- → {"a", "b"}, "c"
+---@param self Parser
+---@param end_p Parser
+---@return Parser
+function M.Parser:many_till(end_p) end
+
+--- Caches the result of this parser per input position for the duration of
+--- a single `parse` call, so backtracking alternatives don't re-parse it.
+--- Memoized values are shared between hits, `map` callbacks must not mutate
+--- their input.
+---
+--- **Implemented in:** C
+--- @example
+--- local a = parser.literal("a"):memoize()
+--- local p = a:pair(parser.literal("b")):or_else(a:pair(parser.literal("c")))
+--- print(p:parse("ac"))  -- → {"a", "c"}, "" (parses "a" only once)
+---@param self Parser
+---@return Parser
+function M.Parser:memoize() end
+
+--- Compiles the parser into a flat instruction array run by a small VM.
+--- The result parses exactly like the original but skips the per-node calls
+--- of the tree walk and is not limited by the C stack, so deeply nested input
+--- only costs memory. Lazy parsers are resolved while compiling; `custom`,
+--- `memoize` and `lazy(fn, { once = false })` nodes still run as before.
+---
+--- **Implemented in:** C
+--- @example
+--- local list
+--- list = parser.lazy(function()
+---   return parser.literal("["):drop_for(list:or_else(parser.literal("x")))
+---     :take_after(parser.literal("]"))
+--- end)
+--- print(list:compile():parse("[[x]]"))  -- → "x", ""
+---@param self Parser
+---@return Parser
+function M.Parser:compile() end
+
+--- Compiles the parser into a program that no longer refers to this Lua
+--- state: what it reports as expected is described up front and it holds
+--- its own copy of every literal, class and keyword set. Grammars that need
+--- the building state to parse are rejected with an error, that is `map`,
+--- `pred`, `and_then`, `custom`, `memoize`, `expr`, `one_of` with values and
+--- `lazy(fn, { once = false })`.
+---
+--- **Implemented in:** C
+--- @example
+--- local word = parser.take_while("%a", 1):label("word")
+--- local frozen = word:sep_by(parser.literal(",")):freeze()
+--- print(frozen:parse("a,b"))  -- → {"a", "b"}, ""
+---@param self Parser
+---@return ParserFrozen
+function M.Parser:freeze() end
+
+--- Writes the program `freeze` would build as a versioned binary image.
+--- Callbacks are stored by name, `callbacks` maps each name to the function
+--- used in the grammar. The other restrictions of `freeze` apply.
+---
+--- **Implemented in:** C
+--- @example
+--- local num = parser.char_class("%d"):many1_concat():map(tonumber)
+--- local bytes = num:dump({ tonumber = tonumber })
+--- local loaded = parser.load(bytes, { tonumber = tonumber })
+--- print(loaded:parse("42"))  -- → 42, ""
+---@param self Parser
+---@param callbacks table<string, function>?
+---@return string
+function M.Parser:dump(callbacks) end
+
+---@class ParseOpts
+---@field memo boolean? packrat mode: memoize every non-leaf parser for this call
+
+---@class ParseError
+---@field pos integer 1-based byte position of the furthest failure
+---@field line integer counted on first access
+---@field column integer counted on first access, in bytes
+---@field expected string[] what the parsers failing at `pos` expected
+
+--- Executes the parser on the given input string. On failure a third result
+--- describes the furthest position any parser failed at and what was
+--- expected there; `tostring(err)` gives a one-line message.
 ---
 --- **Implemented in:** C
 --- @example
 --- local p = parser.literal("hi")
 --- print(p:parse("hi there"))  -- → "hi", " there"
+--- print(p:parse("hi there", { memo = true }))  -- → "hi", " there"
+--- local _, _, err = p:parse("ho")
+--- print(tostring(err))  -- → line 1, column 1: expected "hi"
 ---@param self Parser
 ---@param input string
----@return table | string | nil, string The parsed result (or `nil`) and the remaining input.
-function M.Parser:parse(input) end
+---@param opts ParseOpts?
+---@return table | string | nil, string, ParseError? The parsed result (or `nil`), the remaining input and on failure the error.
+function M.Parser:parse(input, opts) end
 
 -- Utility functions
 M.utils = {}